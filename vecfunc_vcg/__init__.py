@@ -18,7 +18,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 """
 import time
 import numpy as np
-from vecfunc_vcg.vecfuncvcglib import join_all, vcg_maille_tuffin_multi_resource, aggregate_stats
+from vecfunc_vcg.vecfuncvcglib import join_all, join_max, leave_one_out_max, vcg_payments, \
+    vcg_maille_tuffin_multi_resource, aggregate_stats
 
 
 def validate_payments(payments, private_values):
@@ -31,13 +32,22 @@ def validate_payments(payments, private_values):
             "Bad payment value for player %s: payment (%f) > value (%f)" % (i, payments[i], private_values[i])
 
 
+def private_value(val_func, alloc):
+    """
+    The value of an allocation: the maximal value of the function in the box [0, alloc], as the joins
+    fix the functions to be rising (the same as VCGPayments::box_max()).
+    """
+    return np.max(val_func[tuple(slice(0, a + 1) for a in alloc)])
+
+
 ###############################################################################
 # Optimization
 ###############################################################################
 
 
 def joint_func(val_funcs, max_alloc, calc_payments=True,
-               join_method=None, join_chunk_size=None, join_flags=None, change_join_order=True):
+               join_method=None, join_chunk_size=None, join_flags=None, change_join_order=True,
+               join_thread_count=None, payment_strategy='chain', join_memory_budget=None):
     """
     Find the optimal social welfare given a list of vectorized valuations.
 
@@ -47,7 +57,10 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
         calc_payments (bool, optional): If True, will also return the
             corresponding player's payments for the optimal allocation.
             Defaults to True.
-        join_method (int, optional): The joint valuation method.
+        join_method (int or 'auto', optional): The joint valuation method.
+            'auto' selects the fastest method by probing. The decision is kept in memory, and in the
+            tuning file of VECFUNC_VCG_TUNING_FILE if it is set. Only the brute force and the data
+            structure methods (1-9) are probed.
         join_chunk_size (int, optional): The joint valuation chunk size.
         join_flags (str tuple, optional): One of the following flags:
             'filter': Filter compared points before.
@@ -55,6 +68,18 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
             'buildtime': Collects data structure build time statistics.
             'querytime': Collects data structure query time statistics.
         change_join_order (boo, optional): Change the join order to improve performance.
+        join_thread_count (int, optional): The number of threads used by each join
+            (0: all the available cores). Defaults to 1. The offline sweep and the concave methods
+            join on a single thread (see the 'serialJoins' statistics). The threads are shared by the
+            process: a join that starts while a join of another thread uses them joins on its calling
+            thread only.
+        join_memory_budget (int, optional): The maximal bytes of each join's data structure. Over it, the join
+            uses a larger chunk size or a leaner method (see the 'memoryFallbacks' statistics).
+            Defaults to unlimited.
+        payment_strategy (str, optional): How the social-welfare without each player is found:
+            'chain': Joins the prefix and suffix chains around each player (using a reversed join chain).
+            'divide': Divide and conquer over a segment tree of the players (see leave_one_out_max()).
+            Defaults to 'chain'.
 
     Returns: {
         'sw': The optimal social-welfare.
@@ -75,6 +100,8 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
     n = len(val_funcs)
     if n < 2:
         raise ValueError("Need at least two functions")
+    if payment_strategy not in ('chain', 'divide'):
+        raise ValueError("Unknown payment strategy: %s" % payment_strategy)
 
     if change_join_order:
         s = np.argsort([np.max(v) for v in val_funcs])
@@ -86,7 +113,8 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
     val_funcs = [val_funcs[i] for i in order]
 
     joined_func_lst = join_all(val_funcs, max_alloc, method=join_method, chunk_size=join_chunk_size,
-                               flags=join_flags)
+                               flags=join_flags, thread_count=join_thread_count,
+                               memory_budget=join_memory_budget)
     joined_func = joined_func_lst[-1]
     sw_argmax = joined_func.argmax()
     sw_max = joined_func[sw_argmax]
@@ -108,7 +136,7 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
     assert (total_alloc == sw_argmax).all(), "Non allocated: %s" % (sw_argmax - total_alloc)
 
     # Calculating the private values
-    private_values = [v[tuple(a)] for v, a in zip(val_funcs, allocs)]
+    private_values = [private_value(v, a) for v, a in zip(val_funcs, allocs)]
     ret['private-values'] = [private_values[i] for i in orig_order]
 
     # Validating private values match social-welfare
@@ -117,9 +145,26 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
 
     # Calculating the payments
     payments = []
-    if calc_payments:
+    if calc_payments and payment_strategy == 'divide':
+        others_max, others_stats = leave_one_out_max(val_funcs, max_alloc, method=join_method,
+                                                     chunk_size=join_chunk_size, flags=join_flags,
+                                                     thread_count=join_thread_count,
+                                                     memory_budget=join_memory_budget)
+        ret['stats'] = aggregate_stats(ret['stats'], *others_stats)
+
+        for i in range(n):
+            if all(a == 0 for a in allocs[i]):
+                payments.append(0)
+            else:
+                payments.append(others_max[i] - (sw_max - private_values[i]))
+        ret['payments'] = [payments[i] for i in orig_order]
+
+        # Validation
+        validate_payments(payments, private_values)
+    elif calc_payments:
         joined_func_rev_lst = join_all(val_funcs[::-1], max_alloc, method=join_method, chunk_size=join_chunk_size,
-                                       flags=join_flags)
+                                       flags=join_flags, thread_count=join_thread_count,
+                                       memory_budget=join_memory_budget)
         ret['stats'] = aggregate_stats(ret['stats'], joined_func_rev_lst[-1].aggregated_stats())
 
         joined_func_rev = joined_func_rev_lst[-1]
@@ -130,22 +175,24 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
         assert np.isclose(sw_max, rev_sw_max), "SW (%s) != SW-reverse (%s)" % (sw_max, rev_sw_max)
 
         ret['is-order-indifferent'] = np.allclose(joined_func.arr, joined_func_rev.arr)
+        sw_limit = np.broadcast_to(max_alloc, (joined_func.ndim,))
 
         for i in range(n):
             if all(a == 0 for a in allocs[i]):
                 payments.append(0)
                 continue
 
+            # With two players, the others are a single input function that may exceed the limit
             if i == 0:
-                jv = joined_func_rev_lst[1]
+                jv_max = private_value(joined_func_rev_lst[1], sw_limit)
             elif i == n-1:
-                jv = joined_func_lst[-2]
+                jv_max = private_value(joined_func_lst[-2], sw_limit)
             else:
-                jv = join_all([joined_func_lst[i - 1], joined_func_rev_lst[i + 1]], max_alloc, method=join_method,
-                              chunk_size=join_chunk_size, flags=join_flags)[-1]
-                ret['stats'] = aggregate_stats(ret['stats'], jv.stats)
+                # Only the maximal social welfare without player i is needed
+                jv_max, jv_stats = join_max(joined_func_lst[i - 1], joined_func_rev_lst[i + 1], max_alloc)
+                ret['stats'] = aggregate_stats(ret['stats'], jv_stats)
 
-            payments.append(jv.max() - (sw_max - private_values[i]))
+            payments.append(jv_max - (sw_max - private_values[i]))
         ret['payments'] = [payments[i] for i in orig_order]
 
         # Validation
@@ -156,6 +203,61 @@ def joint_func(val_funcs, max_alloc, calc_payments=True,
     return ret
 
 
+def native_joint_func(val_funcs, max_alloc, join_method=None, join_chunk_size=None, join_flags=None,
+                      change_join_order=True, join_thread_count=None, join_memory_budget=None):
+    """
+    Same as joint_func(), but the allocation and the payments are computed by a single native call
+    (see vcg_payments()). The joined functions are not returned.
+
+    Returns: {
+        'sw': The optimal social-welfare.
+        'used-resources': The sum of resource allocated.
+        'allocations': The player's allocation.
+        'private-values': The player's private values.
+        'payments': The player's payments.
+        'stats': Statistics (runtime and algorithm specific information).
+    }
+    """
+    start_time = time.time()
+    n = len(val_funcs)
+    if n < 2:
+        raise ValueError("Need at least two functions")
+
+    if change_join_order:
+        s = np.argsort([np.max(v) for v in val_funcs])
+        order = [s[-1], *s[:-2:2], *s[1:-2:2][::-1], s[-2]]
+        orig_order = np.argsort(order)
+    else:
+        order = orig_order = np.arange(len(val_funcs))
+
+    val_funcs = [val_funcs[i] for i in order]
+    allocs, payments, sw_max, vcg_stats = vcg_payments(val_funcs, max_alloc, method=join_method,
+                                               chunk_size=join_chunk_size, flags=join_flags,
+                                               thread_count=join_thread_count,
+                                               memory_budget=join_memory_budget)
+
+    private_values = [private_value(v, a) for v, a in zip(val_funcs, allocs)]
+    ret = {
+        'sw': sw_max,
+        'used-resources': np.sum(allocs, axis=0),
+        'allocations': [allocs[i] for i in orig_order],
+        'private-values': [private_values[i] for i in orig_order],
+        'payments': [payments[i] for i in orig_order],
+        'stats': vcg_stats,
+    }
+
+    # Validating private values match social-welfare
+    values_sum = np.sum(private_values)
+    assert np.isclose(values_sum, sw_max), f"SW ({sw_max}) - private_values ({values_sum}) = {sw_max - values_sum}"
+
+    # Validation
+    validate_payments(payments, private_values)
+
+    end_time = time.time()
+    ret['stats']['optimizationRunTime'] = end_time - start_time
+    return ret
+
+
 def maille_tuffin(val_funcs, val_funcs_1d, max_alloc, calc_payments=True):
     """
     Find the optimal social welfare given a list of vectorized valuations.
@@ -16,6 +16,7 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 """
-from vecfunc_vcg.vecfuncvcglib.joint_func import join_all
+from vecfunc_vcg.vecfuncvcglib.joint_func import join_all, join_max, leave_one_out_max, vcg_payments
 from vecfunc_vcg.vecfuncvcglib.maille_tuffin import vcg_maille_tuffin, vcg_maille_tuffin_multi_resource
 from vecfunc_vcg.vecfuncvcglib.stats import VCGStats, aggregate_stats
+from vecfunc_vcg.vecfuncvcglib.loader import set_ds_cache_capacity, clear_ds_cache
@@ -16,17 +16,26 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 """
+import ctypes
 import numpy as np
 from vecfunc.vecfunclib import VecFunc, as_vecfunc
 from vecfunc_vcg.vecfuncvcglib import loader
-from vecfunc_vcg.vecfuncvcglib.stats import aggregate_stats
+from vecfunc_vcg.vecfuncvcglib.stats import VCGStats, aggregate_stats
 import numbers
 
 
+# The join method that selects the method (and chunk size) by probing (see join_autotune.hpp)
+JOIN_METHOD_AUTO = 100
+
+
 class JoinedVecFunc(VecFunc):
-    def __init__(self, f1, f2, size_limit, method=None, chunk_size=None, flags=None):
-        self.method = 0 if method is None else method
+    def __init__(self, f1, f2, size_limit, method=None, chunk_size=None, flags=None, thread_count=None,
+                 memory_budget=None, join=True, out=None):
+        self.method = self.get_method_id(method)
         self.chunk_size = 64 if chunk_size is None else chunk_size
+        self.thread_count = 1 if thread_count is None else thread_count
+        # The bytes of the join's data structure (0: unlimited). Over it, a leaner method is used.
+        self.memory_budget = 0 if memory_budget is None else memory_budget
         self.f1 = as_vecfunc(f1)
         self.f2 = as_vecfunc(f2)
 
@@ -38,32 +47,51 @@ class JoinedVecFunc(VecFunc):
                              "but %s != %s." % (self.f1.ndim, self.f2.ndim))
         dtype = f1.dtype
         ndim = f1.ndim
-        shape = self.get_maximal_joined_func_size(self.f1, self.f2, np.add(size_limit, 1))
+        shape = self.get_maximal_joined_func_size(self.f1.shape, self.f2.shape, np.add(size_limit, 1))
+
+        # OUT: the (values, args) buffers of the result, in the caller's memory (e.g., join_all())
+        if out is None:
+            out = np.empty(shape, dtype=dtype, order='C'), np.empty(shape + (ndim,), dtype='uint32', order='C')
+        VecFunc.__init__(self, out[0], require_write=True)
+
+        self.flags_bool = self.get_flags_bool(flags)
+
+        self.arg_shape = shape + (ndim,)
+        arg_arr = out[1]
+        self.arg_arr = np.require(arg_arr, dtype='uint32', requirements=loader.write_req)
+
+        # Otherwise, the caller joins the functions (e.g., join_all())
+        self.stats = None
+        if join:
+            _, data = loader.load_lib(self.ndim, self.dtype)
+            vcg_join_func = data['vcg_join_func'][self.flags_bool]
+            self.stats = vcg_join_func(self.f1.arr, self.f1.ctype_arr_size, self.f2.arr, self.f2.ctype_arr_size,
+                                       self.arr, self.arg_arr, self.ctype_arr_size, self.method, self.chunk_size,
+                                       self.thread_count, self.memory_budget)
+            self.stats = self.stats.as_dict()
 
-        VecFunc.__init__(self, np.empty(shape, dtype=dtype, order='C'), require_write=True)
+    @staticmethod
+    def get_method_id(method):
+        if method is None:
+            return 0
+        if method == 'auto':
+            return JOIN_METHOD_AUTO
+        return method
 
+    @staticmethod
+    def get_flags_bool(flags):
         if flags is None:
             flags = ()
         if isinstance(flags, str):
             flags = (flags,)
 
-        flags_bool = tuple(
+        return tuple(
             [k in flags for k in ('filter_grad', 'filter', 'brute_opt', 'count', 'buildtime', 'querytime')])
-        _, data = loader.load_lib(self.ndim, self.dtype)
-        vcg_join_func = data['vcg_join_func'][flags_bool]
-
-        self.arg_shape = shape + (ndim,)
-        arg_arr = np.empty(self.arg_shape, dtype='uint32', order='C')
-        self.arg_arr = np.require(arg_arr, dtype='uint32', requirements=loader.write_req)
-
-        self.stats = vcg_join_func(self.f1.arr, self.f1.ctype_arr_size, self.f2.arr, self.f2.ctype_arr_size,
-                                   self.arr, self.arg_arr, self.ctype_arr_size, self.method, self.chunk_size)
-        self.stats = self.stats.as_dict()
 
     @staticmethod
-    def get_maximal_joined_func_size(f1, f2, size_limit):
-        """ Returns the maximal size of the joined function """
-        max_size = np.add(f1.shape, f2.shape) - 1
+    def get_maximal_joined_func_size(shape1, shape2, size_limit):
+        """ Returns the maximal size of the joined function of functions of the given shapes """
+        max_size = np.add(shape1, shape2) - 1
         max_size = np.minimum(max_size, size_limit)
         return tuple(np.maximum(max_size, 0).astype(np.uint32))
 
@@ -100,6 +128,141 @@ class JoinedVecFunc(VecFunc):
         return agg_stats
 
 
+def join_max(f1, f2, size_limit):
+    """
+    Returns the maximal value of the joined function of f1 and f2 (see JoinedVecFunc) and the join
+    statistics, without materializing the joined function and its arguments.
+    """
+    f1 = as_vecfunc(f1)
+    f2 = as_vecfunc(f2)
+    if f1.dtype != f2.dtype:
+        raise ValueError("Functions must have the same data type,"
+                         "but %s != %s." % (f1.dtype, f2.dtype))
+    if f1.ndim != f2.ndim:
+        raise ValueError("Functions must have the same number of dimensions,"
+                         "but %s != %s." % (f1.ndim, f2.ndim))
+
+    shape = JoinedVecFunc.get_maximal_joined_func_size(f1.shape, f2.shape, np.add(size_limit, 1))
+    res_size = np.require(np.array(shape, dtype='uint32'), dtype='uint32', requirements=loader.read_req)
+    ret_max = np.require(np.zeros(1, dtype=f1.dtype), dtype=f1.dtype, requirements=loader.write_req)
+
+    _, data = loader.load_lib(f1.ndim, f1.dtype)
+    stats = data['vcg_join_max_func'](f1.arr, f1.ctype_arr_size, f2.arr, f2.ctype_arr_size, res_size, ret_max)
+    return ret_max[0], stats.as_dict()
+
+
+def leave_one_out_max(funcs, joined_func_size_limit, method=None, chunk_size=None, flags=None, thread_count=None,
+                      memory_budget=None):
+    """
+    Returns the maximal value of the join of all the functions except i, for each i, and the joins statistics.
+
+    Divide and conquer over a segment tree of the functions: each node's join of its children is shared,
+    and the join of all the functions outside a node is passed down to its children. So all the
+    leave-one-out functions come out of O(n log n) joins (each bounded by the size limit).
+    The leave-one-out of a leaf only needs its maximum, so it is a max-only join (see join_max()).
+    A node's results are dropped as soon as its subtree is done.
+    """
+    n = len(funcs)
+    join_kwargs = dict(method=method, chunk_size=chunk_size, flags=flags, thread_count=thread_count,
+                       memory_budget=memory_budget)
+    size_limit = tuple(np.add(np.broadcast_to(joined_func_size_limit, (as_vecfunc(funcs[0]).ndim,)), 1))
+    stats = []
+    ret = [None] * n
+
+    def join(f1, f2):
+        jf = JoinedVecFunc(f1, f2, joined_func_size_limit, **join_kwargs)
+        stats.append(jf.stats)
+        # The args are not used, so the joined functions are not kept alive
+        jf.f1 = jf.f2 = None
+        return jf
+
+    def clipped_max(f):
+        arr = as_vecfunc(f).arr
+        return arr[tuple(slice(0, l) for l in size_limit)].max()
+
+    # The join of the functions in [lo, hi)
+    segments = {}
+
+    def build(lo, hi):
+        if hi - lo == 1:
+            segments[lo, hi] = funcs[lo]
+            return
+        mid = (lo + hi) // 2
+        build(lo, mid)
+        build(mid, hi)
+        segments[lo, hi] = join(segments[lo, mid], segments[mid, hi])
+
+    # OTHERS: the join of all the functions outside [lo, hi) (None if there are none)
+    def solve(lo, hi, others):
+        mid = (lo + hi) // 2
+        left, right = segments.pop((lo, mid)), segments.pop((mid, hi))
+        for c_lo, c_hi, sibling in ((lo, mid, right), (mid, hi, left)):
+            if c_hi - c_lo > 1:
+                continue
+            if others is None:
+                ret[c_lo] = clipped_max(sibling)
+            else:
+                ret[c_lo], cur_stats = join_max(others, sibling, joined_func_size_limit)
+                stats.append(cur_stats)
+
+        left_others = right_others = None
+        if mid - lo > 1:
+            left_others = right if others is None else join(others, right)
+        if hi - mid > 1:
+            right_others = left if others is None else join(others, left)
+        del left, right, others
+
+        if left_others is not None:
+            solve(lo, mid, left_others)
+            del left_others
+        if right_others is not None:
+            solve(mid, hi, right_others)
+
+    if n > 1:
+        # The join of all the functions is not needed
+        build(0, n // 2)
+        build(n // 2, n)
+        solve(0, n, None)
+    return ret, stats
+
+
+def vcg_payments(funcs, max_alloc, method=None, chunk_size=None, flags=None, thread_count=None, memory_budget=None):
+    """
+    Computes the VCG allocation and payments by a single native call.
+    The prefix and suffix join chains are joined one after the other, and the leave-one-out joins in parallel.
+
+    Returns: The player's allocations, the player's payments, the optimal social welfare and the statistics.
+    """
+    funcs = [as_vecfunc(f) for f in funcs]
+    ndim = funcs[0].ndim
+    dtype = funcs[0].dtype
+    for f in funcs[1:]:
+        if f.dtype != dtype:
+            raise ValueError("Functions must have the same data type,"
+                             "but %s != %s." % (dtype, f.dtype))
+        if f.ndim != ndim:
+            raise ValueError("Functions must have the same number of dimensions,"
+                             "but %s != %s." % (ndim, f.ndim))
+
+    n = len(funcs)
+    vals = (ctypes.c_void_p * n)(*[f.arr.ctypes.data for f in funcs])
+    sizes = np.require(np.concatenate([f.shape for f in funcs]), dtype='uint32', requirements=loader.read_req)
+    size_limit = np.require(np.broadcast_to(max_alloc, (ndim,)), dtype='uint32', requirements=loader.read_req)
+    ret_allocs = np.require(np.zeros((n, ndim), dtype='uint32'), dtype='uint32', requirements=loader.write_req)
+    ret_payments = np.require(np.zeros(n, dtype=dtype), dtype=dtype, requirements=loader.write_req)
+    ret_sw = np.require(np.zeros(1, dtype=dtype), dtype=dtype, requirements=loader.write_req)
+
+    _, data = loader.load_lib(ndim, dtype)
+    vcg_payments_func = data['vcg_payments_func'][JoinedVecFunc.get_flags_bool(flags)]
+    stats = vcg_payments_func(vals, sizes, n, size_limit,
+                              JoinedVecFunc.get_method_id(method),
+                              64 if chunk_size is None else chunk_size,
+                              1 if thread_count is None else thread_count,
+                              0 if memory_budget is None else memory_budget,
+                              ret_allocs, ret_payments, ret_sw)
+    return [tuple(a) for a in ret_allocs], list(ret_payments), ret_sw[0], stats.as_dict()
+
+
 def test_ds_build_time(v, method, chunk_size):
     v = as_vecfunc(v)
     lib = v.get_lib()
@@ -118,9 +281,52 @@ def sum_test_ds_build_time(funcs, method, chunk_size):
     return ret
 
 
-def join_all(funcs, joined_func_size_limit, method=None, chunk_size=None, flags=None):
+def join_all(funcs, joined_func_size_limit, method=None, chunk_size=None, flags=None, thread_count=None,
+             memory_budget=None):
+    """
+    Joins the prefixes of the functions list by a single native call.
+    The results are views of one values block and one args block, allocated once for the chain.
+    """
+    inputs = [as_vecfunc(f) for f in funcs]
+    shapes = []
+    shape = inputs[0].shape
+    for f in inputs[1:]:
+        shape = JoinedVecFunc.get_maximal_joined_func_size(shape, f.shape, np.add(joined_func_size_limit, 1))
+        shapes.append(shape)
+
+    offsets = np.cumsum([0] + [int(np.prod(s, dtype=np.int64)) for s in shapes])
+    ndim = inputs[0].ndim
+    val_block = np.empty(offsets[-1], dtype=inputs[0].dtype)
+    arg_block = np.empty(offsets[-1] * ndim, dtype='uint32')
+
     joined_funcs = [funcs[0]]
-    for f in funcs[1:]:
+    for k, f in enumerate(funcs[1:]):
+        lo, hi = offsets[k], offsets[k+1]
+        out = val_block[lo:hi].reshape(shapes[k]), arg_block[lo*ndim:hi*ndim].reshape(shapes[k] + (ndim,))
         joined_funcs.append(JoinedVecFunc(joined_funcs[-1], f, joined_func_size_limit, method=method,
-                                          chunk_size=chunk_size, flags=flags))
+                                          chunk_size=chunk_size, flags=flags, thread_count=thread_count,
+                                          memory_budget=memory_budget, join=False, out=out))
+    if len(joined_funcs) < 2:
+        return joined_funcs
+
+    first = joined_funcs[1]
+    inputs = [first.f1, *[jf.f2 for jf in joined_funcs[1:]]]
+    results = joined_funcs[1:]
+    res_count = len(results)
+
+    vals = (ctypes.c_void_p * len(inputs))(*[f.arr.ctypes.data for f in inputs])
+    sizes = np.require(np.concatenate([f.shape for f in inputs]), dtype='uint32', requirements=loader.read_req)
+    res_vals = (ctypes.c_void_p * res_count)(*[jf.arr.ctypes.data for jf in results])
+    res_args = (ctypes.c_void_p * res_count)(*[jf.arg_arr.ctypes.data for jf in results])
+    res_sizes = np.require(np.concatenate([jf.shape for jf in results]), dtype='uint32',
+                           requirements=loader.read_req)
+    res_stats = (VCGStats * res_count)()
+
+    _, data = loader.load_lib(first.ndim, first.dtype)
+    vcg_join_chain_func = data['vcg_join_chain_func'][first.flags_bool]
+    vcg_join_chain_func(vals, sizes, len(inputs), res_vals, res_args, res_sizes, res_stats,
+                        first.method, first.chunk_size, first.thread_count, first.memory_budget)
+
+    for jf, stats in zip(results, res_stats):
+        jf.stats = stats.as_dict()
     return joined_funcs
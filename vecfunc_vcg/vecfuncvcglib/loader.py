@@ -47,6 +47,7 @@ subpath_options = "vecfuncvcglib/bin", "vecfuncvcglib", "bin", "."
 
 __lib__ = {}
 __force_compile__ = False
+__ds_cache_capacity__ = 0
 
 
 def force_compile(force=True):
@@ -54,6 +55,23 @@ def force_compile(force=True):
     __force_compile__ = force
 
 
+def set_ds_cache_capacity(capacity_bytes):
+    """
+    Sets the capacity (bytes) of the data structures cache of each module (0, the default, disables the cache).
+    The cache keeps the built data structures for later joins of the same functions.
+    """
+    global __ds_cache_capacity__
+    __ds_cache_capacity__ = capacity_bytes
+    for lib, _ in __lib__.values():
+        lib.vcg_ds_cache_set_capacity(capacity_bytes)
+
+
+def clear_ds_cache():
+    """ Releases the cached data structures of all the modules """
+    for lib, _ in __lib__.values():
+        lib.vcg_ds_cache_clear()
+
+
 def locate_lib_path(fname):
     """ Locate a file in the optional sub-folders"""
     curpath = os.path.dirname(os.path.abspath(__file__))
@@ -113,6 +131,8 @@ def get_types(ndim, dtype):
         vcg_ret_alloc_type=np.ctypeslib.ndpointer(dtype='uint32', ndim=1, flags=write_req),
         joined_vecfunc_type=np.ctypeslib.ndpointer(dtype=dtype, ndim=ndim, flags=write_req),
         joined_vecfunc_arg_type=np.ctypeslib.ndpointer(dtype='uint32', ndim=ndim + 1, flags=write_req),
+        vcg_ret_max_type=np.ctypeslib.ndpointer(dtype=dtype, ndim=1, flags=write_req),
+        vcg_ret_allocs_type=np.ctypeslib.ndpointer(dtype='uint32', ndim=2, flags=write_req),
     )
 
 
@@ -137,7 +157,7 @@ def load_lib(ndim, dtype):
 
     t = get_types(ndim, dtype)
 
-    vcg_join_func = {
+    vcg_join_names = {
         (False, False, False, False, False, False): 'nofilter',
         (False, True,  False, False, False, False): 'filter',
         (False, True,  True,  False, False, False): 'brute_opt',
@@ -153,9 +173,15 @@ def load_lib(ndim, dtype):
         (True, True,  False, True,  True,  True):  'fg_querytime',
 
     }
-    vcg_join_func = {k: getattr(lib, 'vcg_join_%s' % v) for k, v in vcg_join_func.items()}
+    vcg_join_func = {k: getattr(lib, 'vcg_join_%s' % v) for k, v in vcg_join_names.items()}
     t['vcg_join_func'] = vcg_join_func
 
+    vcg_join_chain_func = {k: getattr(lib, 'vcg_join_chain_%s' % v) for k, v in vcg_join_names.items()}
+    t['vcg_join_chain_func'] = vcg_join_chain_func
+
+    vcg_payments_func = {k: getattr(lib, 'vcg_payments_%s' % v) for k, v in vcg_join_names.items()}
+    t['vcg_payments_func'] = vcg_payments_func
+
     vcg_maille_tuffin_func = {(True,): 'buildtime', (False,): 'main'}
     vcg_maille_tuffin_func = {k: getattr(lib, 'vcg_maille_tuffin_%s' % v) for k, v in vcg_maille_tuffin_func.items()}
     t['vcg_maille_tuffin_func'] = vcg_maille_tuffin_func
@@ -165,10 +191,26 @@ def load_lib(ndim, dtype):
             t['vecfunc_type'], t['vec_size_t'],
             t['vecfunc_type'], t['vec_size_t'],
             t['joined_vecfunc_type'], t['joined_vecfunc_arg_type'],
-            t['vec_size_t'], ctypes.c_uint32, ctypes.c_uint32
+            t['vec_size_t'], ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint64
         )
         vcg_join.restype = VCGStats
 
+    for vcg_join_chain in vcg_join_chain_func.values():
+        vcg_join_chain.argtypes = (
+            ctypes.POINTER(ctypes.c_void_p), t['vcg_val_sizes_type'], ctypes.c_uint32,
+            ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_void_p), t['vcg_val_sizes_type'],
+            ctypes.POINTER(VCGStats), ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint64
+        )
+        vcg_join_chain.restype = None
+
+    for vcg_payments in vcg_payments_func.values():
+        vcg_payments.argtypes = (
+            ctypes.POINTER(ctypes.c_void_p), t['vcg_val_sizes_type'], ctypes.c_uint32, t['vcg_val_sizes_type'],
+            ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint64,
+            t['vcg_ret_allocs_type'], t['vcg_ret_max_type'], t['vcg_ret_max_type']
+        )
+        vcg_payments.restype = VCGStats
+
     for vcg_maille_tuffin in vcg_maille_tuffin_func.values():
         vcg_maille_tuffin.argtypes = (
             t['vcg_concat_vals_type'], t['vcg_val_sizes_type'],
@@ -177,9 +219,25 @@ def load_lib(ndim, dtype):
         )
         vcg_maille_tuffin.restype = VCGStats
 
+    lib.vcg_join_max.argtypes = (
+        t['vecfunc_type'], t['vec_size_t'],
+        t['vecfunc_type'], t['vec_size_t'],
+        t['vcg_val_sizes_type'], t['vcg_ret_max_type']
+    )
+    lib.vcg_join_max.restype = VCGStats
+    t['vcg_join_max_func'] = lib.vcg_join_max
+
     lib.vcg_test_ds_build_time.argtypes = (t['vecfunc_type'], t['vec_size_t'], ctypes.c_uint32, ctypes.c_uint32)
     lib.vcg_test_ds_build_time.restype = VCGStats
 
+    lib.vcg_ds_cache_set_capacity.argtypes = (ctypes.c_uint64,)
+    lib.vcg_ds_cache_set_capacity.restype = None
+    lib.vcg_ds_cache_clear.argtypes = ()
+    lib.vcg_ds_cache_clear.restype = None
+    lib.vcg_ds_cache_size.argtypes = ()
+    lib.vcg_ds_cache_size.restype = ctypes.c_uint64
+    lib.vcg_ds_cache_set_capacity(__ds_cache_capacity__)
+
     ret = lib, t
     __lib__[key] = ret
     return ret
@@ -37,6 +37,7 @@ class VCGStats(ctypes.Structure):
         ("comparedInBoundPoints", ctypes.c_double),
         ("comparedEdgePoints", ctypes.c_double),
         ("comparedBruteForce", ctypes.c_double),
+        ("prunedBruteForce", ctypes.c_double),
 
         ("dsPts", ctypes.c_uint),
         ("totalPts", ctypes.c_uint),
@@ -44,6 +45,24 @@ class VCGStats(ctypes.Structure):
 
         ("joinedFuncCount", ctypes.c_uint),
         ("bruteForceCount", ctypes.c_uint),
+
+        ("dsCacheHits", ctypes.c_uint),
+        ("dsCacheMisses", ctypes.c_uint),
+
+        ("dsMemoryBytes", ctypes.c_ulong),
+
+        ("costBruteCellNs", ctypes.c_double),
+        ("costQueryNs", ctypes.c_double),
+        ("costFetchPointNs", ctypes.c_double),
+        ("costBruteDecisions", ctypes.c_uint),
+        ("costQueryBruteDecisions", ctypes.c_uint),
+        ("costFetchDecisions", ctypes.c_uint),
+
+        ("memoryFallbacks", ctypes.c_uint),
+        ("memoryFallbackMethod", ctypes.c_uint),
+        ("memoryFallbackChunkSize", ctypes.c_uint),
+
+        ("serialJoins", ctypes.c_uint),
     ]
 
     def as_dict(self):
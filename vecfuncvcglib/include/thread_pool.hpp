@@ -0,0 +1,286 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+
+/*
+ * Work stealing thread pool.
+ *
+ * A run splits the tasks [0, taskCount) into contiguous blocks, one per worker.
+ * Each worker pops tasks from the front of its own queue, and once it is empty,
+ * steals tasks from the back of the other workers' queues.
+ * The calling thread participates in the run as worker 0.
+ *
+ * The worker threads are started on the first parallel run that needs them, and wait for the
+ * next run until the pool is destroyed. A run that is nested in a run (in one of its tasks, on
+ * any of its workers) is serial.
+ *
+ * The pool has one parallel run at a time. A run that starts while another thread's run holds
+ * the pool does not wait for it: it runs all its tasks on its calling thread, and it is not
+ * counted in the statistics. So concurrent joins (from several calling threads) are serialized:
+ * one of them uses the pool's threads, and each of the others joins on its calling thread only.
+ *
+ * The library runs on a single process wide pool (see shared()), so all the joins and the DS
+ * builds of all the calling threads share its threads.
+ */
+class WorkStealingPool {
+private:
+	class TaskQueue {
+	private:
+		std::mutex lock;
+		std::deque<unsigned int> tasks;
+
+	public:
+		void push(unsigned int task) {
+			std::lock_guard<std::mutex> guard(lock);
+			tasks.push_back(task);
+		}
+
+		bool pop(unsigned int& task) {
+			std::lock_guard<std::mutex> guard(lock);
+			if (tasks.empty())
+				return false;
+			task = tasks.front();
+			tasks.pop_front();
+			return true;
+		}
+
+		bool steal(unsigned int& task) {
+			std::lock_guard<std::mutex> guard(lock);
+			if (tasks.empty())
+				return false;
+			task = tasks.back();
+			tasks.pop_back();
+			return true;
+		}
+	};
+
+	unsigned int threadCount;
+	std::vector<std::thread> threads;
+
+	// Held by the calling thread for the duration of a parallel run, so a concurrent run (from
+	// another thread) is serial. A nested run is detected by in_run(), not by this lock.
+	std::mutex runLock;
+
+	// The current run: its work, its worker count, and the workers that did not finish it.
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::function<void(unsigned int)> job;
+	unsigned int jobWorkers = 0;
+	unsigned int pending = 0;
+	unsigned long generation = 0;
+	bool stopping = false;
+
+public:
+	explicit WorkStealingPool(unsigned int threadCount) :
+			threadCount(threadCount > 0 ? threadCount : defaultThreadCount()) {}
+
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+	~WorkStealingPool() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& th : threads)
+			th.join();
+	}
+
+	unsigned int size() const {
+		return threadCount;
+	}
+
+	static unsigned int defaultThreadCount() {
+		unsigned int n = std::thread::hardware_concurrency();
+		return n > 0 ? n : 1;
+	}
+
+	// The runs of the process wide pool with up to THREAD_COUNT workers (see shared()).
+	class Shared {
+	private:
+		WorkStealingPool& pool;
+		unsigned int threadCount;
+
+	public:
+		Shared(WorkStealingPool& pool, unsigned int threadCount) :
+				pool(pool), threadCount(threadCount) {}
+
+		unsigned int size() const {
+			return threadCount;
+		}
+
+		template<typename F>
+		void run(unsigned int taskCount, F f) {
+			pool.run(threadCount, taskCount, f);
+		}
+	};
+
+	/*
+	 * The process wide pool, for runs of THREAD_COUNT workers (0: the default).
+	 * It has the threads of the largest run so far, and lives until the process exits, so its
+	 * threads are reused by all the runs (and joins) of all the calling threads.
+	 */
+	static Shared shared(unsigned int threadCount) {
+		static WorkStealingPool pool(defaultThreadCount());
+		return Shared(pool, threadCount > 0 ? threadCount : defaultThreadCount());
+	}
+
+	/*
+	 * Runs F(task, worker) for each task in [0, taskCount).
+	 * Returns when all the tasks are done.
+	 */
+	template<typename F>
+	void run(unsigned int taskCount, F f) {
+		run(threadCount, taskCount, f);
+	}
+
+	// Same as run(), but with up to THREAD_COUNT workers (the pool starts the threads it lacks).
+	template<typename F>
+	void run(unsigned int threadCount, unsigned int taskCount, F f) {
+		unsigned int workers = std::min(threadCount, taskCount);
+		std::unique_lock<std::mutex> running(runLock, std::defer_lock);
+		if (workers <= 1 || in_run() || !running.try_lock()) {
+			for (unsigned int t=0; t < taskCount; t++)
+				f(t, 0);
+			return;
+		}
+
+		std::unique_ptr<TaskQueue[]> queues(new TaskQueue[workers]);
+		for (unsigned int w=0; w < workers; w++) {
+			unsigned int lo = (unsigned int)(((unsigned long)taskCount * w) / workers);
+			unsigned int hi = (unsigned int)(((unsigned long)taskCount * (w+1)) / workers);
+			for (unsigned int t=lo; t < hi; t++)
+				queues[w].push(t);
+		}
+
+		TaskQueue* q = queues.get();
+		auto work = [q, workers, &f](unsigned int w) {
+			unsigned int t;
+			while (true) {
+				if (q[w].pop(t)) {
+					f(t, w);
+					continue;
+				}
+
+				bool stolen = false;
+				for (unsigned int i=1; i < workers && !stolen; i++)
+					stolen = q[(w+i) % workers].steal(t);
+				if (!stolen)
+					break;
+				f(t, w);
+			}
+		};
+
+		start(workers, work);
+		RunScope scope(*this);
+		work(0);
+	}
+
+private:
+	// Is the calling thread running tasks of a run (as its caller or as one of its workers)?
+	static bool& in_run() {
+		static thread_local bool r = false;
+		return r;
+	}
+
+	/*
+	 * The calling thread's part of a parallel run. On exit (also by an exception of a task), it
+	 * restores in_run() and waits for the workers, so they are done with the run's tasks and F
+	 * before these are destroyed and RUNNING is released.
+	 */
+	class RunScope {
+	private:
+		WorkStealingPool& pool;
+		bool prevInRun;
+
+	public:
+		explicit RunScope(WorkStealingPool& pool) : pool(pool), prevInRun(in_run()) {
+			in_run() = true;
+		}
+
+		RunScope(const RunScope&) = delete;
+		RunScope& operator=(const RunScope&) = delete;
+
+		~RunScope() {
+			in_run() = prevInRun;
+			pool.finish();
+		}
+	};
+
+	// Publishes the run of WORK to workers [1, WORKERS).
+	void start(unsigned int workers, const std::function<void(unsigned int)>& work) {
+		while (threads.size() + 1 < workers)
+			threads.push_back(std::thread(&WorkStealingPool::worker, this, threads.size() + 1));
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			job = work;
+			jobWorkers = workers;
+			pending = workers - 1;
+			generation++;
+		}
+		wake.notify_all();
+	}
+
+	// Waits for the workers of the current run.
+	void finish() {
+		std::unique_lock<std::mutex> guard(lock);
+		done.wait(guard, [this] { return pending == 0; });
+		job = nullptr;
+	}
+
+	void worker(unsigned int w) {
+		// A worker thread only runs tasks.
+		in_run() = true;
+		unsigned long seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this, seen] { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+				if (w >= jobWorkers)
+					continue;
+			}
+
+			job(w);
+
+			std::lock_guard<std::mutex> guard(lock);
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+};
+
+
+#endif /* THREAD_POOL_HPP_ */
@@ -39,6 +39,7 @@ public:
 	double comparedInBoundPoints = 0;
 	double comparedEdgePoints = 0;
 	double comparedBruteForce = 0;
+	double prunedBruteForce = 0;
 
 	unsigned int dsPts = 0;
 	unsigned int totalPts = 0;
@@ -47,9 +48,78 @@ public:
 	unsigned int joinedFuncCount = 0;
 	unsigned int bruteForceCount = 0;
 
+	unsigned int dsCacheHits = 0;
+	unsigned int dsCacheMisses = 0;
+
+	// The bytes of the built DSs: their points, their rank spaces and their arrays.
+	unsigned long dsMemoryBytes = 0;
+
+	// The calibrated costs (nanoseconds) of the cost model of the last join, and the decisions of
+	// all the joins (see JoinCostModel).
+	double costBruteCellNs = 0;
+	double costQueryNs = 0;
+	double costFetchPointNs = 0;
+	unsigned int costBruteDecisions = 0;
+	unsigned int costQueryBruteDecisions = 0;
+	unsigned int costFetchDecisions = 0;
+
+	// The joins that did not fit the memory budget, and the method and chunk size of the last one
+	// (see join_vecfunc_memory_select()).
+	unsigned int memoryFallbacks = 0;
+	unsigned int memoryFallbackMethod = 0;
+	unsigned int memoryFallbackChunkSize = 0;
+
+	// The joins with more than one thread that ran on a single thread, as their method is serial.
+	unsigned int serialJoins = 0;
+
 	VCGStats(const char* method="default") : method(method) {}
 
 public:
+	// Accumulates the statistics of another run (e.g., a concurrent one).
+	void add(const VCGStats& o) {
+		totalRuntime += o.totalRuntime;
+		dsCreatePointsTime += o.dsCreatePointsTime;
+		dsBuildTime += o.dsBuildTime;
+		dsQueryTime += o.dsQueryTime;
+		dsQueryFetchTime += o.dsQueryFetchTime;
+
+		expectedComparedPoints += o.expectedComparedPoints;
+		comparedPoints += o.comparedPoints;
+		comparedInBoundPoints += o.comparedInBoundPoints;
+		comparedEdgePoints += o.comparedEdgePoints;
+		comparedBruteForce += o.comparedBruteForce;
+		prunedBruteForce += o.prunedBruteForce;
+
+		dsPts += o.dsPts;
+		totalPts += o.totalPts;
+		totalQueries += o.totalQueries;
+
+		joinedFuncCount += o.joinedFuncCount;
+		bruteForceCount += o.bruteForceCount;
+
+		dsCacheHits += o.dsCacheHits;
+		dsCacheMisses += o.dsCacheMisses;
+
+		dsMemoryBytes += o.dsMemoryBytes;
+
+		if (o.costBruteDecisions + o.costQueryBruteDecisions + o.costFetchDecisions > 0) {
+			costBruteCellNs = o.costBruteCellNs;
+			costQueryNs = o.costQueryNs;
+			costFetchPointNs = o.costFetchPointNs;
+		}
+		costBruteDecisions += o.costBruteDecisions;
+		costQueryBruteDecisions += o.costQueryBruteDecisions;
+		costFetchDecisions += o.costFetchDecisions;
+
+		memoryFallbacks += o.memoryFallbacks;
+		if (o.memoryFallbacks > 0) {
+			memoryFallbackMethod = o.memoryFallbackMethod;
+			memoryFallbackChunkSize = o.memoryFallbackChunkSize;
+		}
+
+		serialJoins += o.serialJoins;
+	}
+
 	void print() {
 		if (joinedFuncCount > 0) {
 	        std::cout
@@ -65,6 +135,31 @@ public:
 	        << "DS PTS count:                     " << dsPts                          << std::endl
 	        << "Total PTS count:                  " << totalPts                       << std::endl
 	        << "Total Queries:                    " << totalQueries                   << std::endl;
+	        if (dsCacheHits + dsCacheMisses > 0)
+	            std::cout
+	            << "DS Cache Hits/Misses:             "
+	            << dsCacheHits << "/" << dsCacheMisses                                << std::endl;
+	        if (dsMemoryBytes > 0)
+	            std::cout
+	            << "DS Memory (bytes):                " << dsMemoryBytes                  << std::endl;
+	        if (costBruteDecisions + costQueryBruteDecisions + costFetchDecisions > 0)
+	            std::cout
+	            << "Cost Model Brute/Query/Fetch (ns): "
+	            << costBruteCellNs << "/" << costQueryNs << "/" << costFetchPointNs      << std::endl
+	            << "Cost Model Decisions (B/QB/F):    "
+	            << costBruteDecisions << "/" << costQueryBruteDecisions << "/"
+	            << costFetchDecisions                                                << std::endl;
+	        if (memoryFallbacks > 0)
+	            std::cout
+	            << "Memory Fallbacks (method/chunk):  " << memoryFallbacks << " ("
+	            << memoryFallbackMethod << "/" << memoryFallbackChunkSize << ")"       << std::endl;
+	        if (serialJoins > 0)
+	            std::cout
+	            << "Serial Joins:                     " << serialJoins                    << std::endl;
+	        if (prunedBruteForce > 0)
+	            std::cout
+	            << "Brute Force Pruning Ratio:        "
+	            << (prunedBruteForce / (prunedBruteForce + comparedBruteForce))       << std::endl;
 		}
 
         std::cout
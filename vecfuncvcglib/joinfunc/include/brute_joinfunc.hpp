@@ -20,11 +20,73 @@
 #define BRUTE_JOINFUNC_HPP_
 
 #include <cstring>
+#include <memory>
+#include <vector>
+#include <algorithm>
 
 #include <debug.h>
 #include <vcg_stats.hpp>
+#include <thread_pool.hpp>
 #include <jointvecfunc.hpp>
+#include "brute_simd.hpp"
 
+// Tasks per worker in a parallel join. More tasks balance better the uneven query costs.
+#define PARALLEL_TASKS_PER_WORKER (16)
+
+
+/*
+ * The workers' result buffers of the parallel joins (see join_rows_parallel()).
+ * Within a Scope (e.g., a join chain), the joins of the calling thread share the buffers of the
+ * scope, so they are allocated once rather than on every join.
+ */
+template <typename T, unsigned int D>
+class JoinScratch {
+public:
+	using index = typename VecFunc<T,D>::index;
+
+	// Sets VAL and ARG to the buffers of worker W, of at least SIZE points.
+	void get(unsigned int w, unsigned long size, T*& val, index*& arg) {
+		if (w >= sizes.size()) {
+			vals.resize(w+1);
+			args.resize(w+1);
+			sizes.resize(w+1, 0);
+		}
+		if (sizes[w] < size) {
+			vals[w].reset(new T[size]);
+			args[w].reset(new index[size]);
+			sizes[w] = size;
+		}
+		val = vals[w].get();
+		arg = args[w].get();
+	}
+
+	// The scratch of the current scope of the calling thread (NULL if none).
+	static JoinScratch*& current() {
+		static thread_local JoinScratch* s = NULL;
+		return s;
+	}
+
+	// Shares a scratch between the joins of the calling thread until the end of the scope.
+	class Scope {
+	private:
+		JoinScratch* prev;
+		JoinScratch scratch;
+
+	public:
+		Scope() : prev(current()) {
+			current() = &scratch;
+		}
+
+		~Scope() {
+			current() = prev;
+		}
+	};
+
+private:
+	std::vector<std::unique_ptr<T[]>> vals;
+	std::vector<std::unique_ptr<index[]>> args;
+	std::vector<unsigned long> sizes;
+};
 
 template <typename T, unsigned int D>
 class BruteForceJoinFunc {
@@ -41,6 +103,26 @@ public:
 	    std::memset((void*)res.arg, 0, sizeof(*res.arg)*res_vec_size);
 	}
 
+	// Lexicographic order, i.e., the order of the linear (C order) index.
+	static inline bool index_less(const index& a, const index& b) {
+		FOR_EACH_DIM(d) {
+			if (a[d] != b[d])
+				return a[d] < b[d];
+		}
+		return false;
+	}
+
+	// Converts a linear position (C order) in the box [0, limit) to its index.
+	static inline void unravel_index(unsigned long pos, const index& limit, index& i) {
+		for (unsigned int d=D; d-- > 0;) {
+			i[d] = pos % limit[d];
+			pos /= limit[d];
+		}
+	}
+
+	// ORDERED: on equal values, keep the lowest A index.
+	// This makes the result independent of the order in which the A points are joined.
+	template<bool ORDERED=false>
 	static inline void join_val_check_point(const index& i_a, T a_val, const index& i_b, T b_val,
 	                					    TDJoinedVecFunc& res) {
 	    index i_res;
@@ -48,19 +130,107 @@ public:
 	    auto res_ind = res.get_index(i_res);
 	    auto val = a_val + b_val;
 
-	    if (res[res_ind] < val) {
+	    if (res[res_ind] < val || (ORDERED && res[res_ind] == val && index_less(i_a, res.arg[res_ind]))) {
 	        res[res_ind] = val;
 	        res.arg[res_ind] = i_a;
 	    }
 	}
 
+	// Joins A point with all the B points in the box [B_LO, B_LO + B_EXT), a row (innermost dimension) at a time.
+	// Each row of B maps to a consecutive row of RES, which is updated by the SIMD row kernel.
+	template<bool ORDERED=false>
+	static inline void join_val_box(const index& i_a, T a_val,
+	                    const TDVecFunc& b, const index& b_lo, const index& b_ext,
+	                    TDJoinedVecFunc& res) {
+		unsigned int row_size = b_ext[D-1];
+		if (row_size == 0)
+			return;
+
+		index i_row, i_b, i_res, rows_limit;
+		rows_limit = b_ext;
+		rows_limit[D-1] = 1;
+	    FOR_EACH_INDEX(i_row, rows_limit) {
+	    	vec_add(b_lo, i_row, i_b);
+	    	vec_add(i_a, i_b, i_res);
+	    	auto res_ind = res.get_index(i_res);
+	    	BruteSIMD::join_row<T, index, ORDERED>(a_val, b.m + b.get_index(i_b), res.m + res_ind,
+	    			res.arg + res_ind, row_size, i_a, index_less);
+	    }
+	}
+
+	// Joins A point with all the B points in B_LIMIT.
+	template<bool ORDERED=false>
 	static inline void join_val_inner(const index& i_a, T a_val,
 	                    const TDVecFunc& b, const index& b_limit,
 	                    TDJoinedVecFunc& res) {
-	    index i_b;
-	    FOR_EACH_INDEX(i_b, b_limit) {
-	        join_val_check_point(i_a, a_val, i_b, b[i_b], res);
-	    }
+		index b_lo;
+		FOR_EACH_DIM(d)
+			b_lo[d] = 0;
+		join_val_box<ORDERED>(i_a, a_val, b, b_lo, b_limit, res);
+	}
+
+	// Merge a partial result into RES with the same rule as an ordered check point.
+	static inline void merge_result_point(TDJoinedVecFunc& res, const TDJoinedVecFunc& src,
+			unsigned long res_ind) {
+		if (res[res_ind] < src[res_ind] ||
+				(res[res_ind] == src[res_ind] && index_less(src.arg[res_ind], res.arg[res_ind]))) {
+			res[res_ind] = src[res_ind];
+			res.arg[res_ind] = src.arg[res_ind];
+		}
+	}
+
+	/*
+	 * Joins the rows (the first dim) [0, ROWS) of A in parallel on the shared work stealing pool.
+	 * JOIN_ROWS(lo, hi, w, res) joins the A points of rows [lo, hi) into RES, on worker W.
+	 * Each worker has its own result (worker 0 uses RES itself), which is the same object in all
+	 * its calls. The results are of the current JoinScratch scope, if any.
+	 * A worker may join its rows out of order (after a steal), so JOIN_ROWS must keep the lowest
+	 * A index on ties (ORDERED). Then merging the workers' results yields the same result as a
+	 * serial join. RES is expected to be reset.
+	 */
+	template<typename F>
+	static void join_rows_parallel(unsigned int rows, TDJoinedVecFunc& res, unsigned int threadCount,
+			F joinRows) {
+		WorkStealingPool::Shared pool = WorkStealingPool::shared(threadCount);
+		unsigned int taskCount = std::min(rows, pool.size() * PARALLEL_TASKS_PER_WORKER);
+		unsigned int workers = std::min(pool.size(), taskCount);
+		if (workers <= 1) {
+			joinRows(0, rows, 0, res);
+			return;
+		}
+
+		unsigned long res_vec_size = res.size.size();
+		std::vector<std::unique_ptr<TDJoinedVecFunc>> workerRes(workers);
+		JoinScratch<T,D> localScratch;
+		JoinScratch<T,D>* scratch = JoinScratch<T,D>::current();
+		if (scratch == NULL)
+			scratch = &localScratch;
+
+		workerRes[0].reset(new TDJoinedVecFunc(res.m, res.arg, res.size));
+		for (unsigned int w=1; w < workers; w++) {
+			T* val;
+			index* arg;
+			scratch->get(w, res_vec_size, val, arg);
+			workerRes[w].reset(new TDJoinedVecFunc(val, arg, res.size));
+			reset_result_array(*workerRes[w]);
+		}
+
+		pool.run(taskCount, [&](unsigned int task, unsigned int w) {
+			unsigned int lo = (unsigned int)(((unsigned long)rows * task) / taskCount);
+			unsigned int hi = (unsigned int)(((unsigned long)rows * (task+1)) / taskCount);
+			joinRows(lo, hi, w, *workerRes[w]);
+		});
+
+		// Merge: each task owns a distinct slice of RES, so no synchronization is needed.
+		unsigned long sliceSize = (res_vec_size + taskCount - 1) / taskCount;
+		pool.run(taskCount, [&](unsigned int task, unsigned int) {
+			unsigned long lo = task * sliceSize;
+			unsigned long hi = std::min(lo + sliceSize, res_vec_size);
+			for (unsigned int w=1; w < workers; w++) {
+				for (unsigned long k=lo; k < hi; k++)
+					merge_result_point(res, *workerRes[w], k);
+			}
+		});
 	}
 
 	template<bool COUNTERS>
@@ -0,0 +1,301 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+Brute force row kernel
+
+Joins a single A point with a single row (the innermost dimension) of B:
+    for j in [0, n):
+        if res[j] < a_val + b[j]:
+            res[j] = a_val + b[j]
+            arg[j] = i_a
+
+The values are added, compared and stored in SIMD lanes (AVX2 or AVX-512).
+Only the updated lanes write their arg, one by one, as arg is an array of indices.
+The instruction set is selected at runtime, so the library is built without any -m flags.
+*/
+#ifndef BRUTE_SIMD_HPP_
+#define BRUTE_SIMD_HPP_
+
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BRUTE_SIMD_X86 (1)
+#include <immintrin.h>
+#else
+#define BRUTE_SIMD_X86 (0)
+#endif
+
+
+namespace BruteSIMD {
+
+typedef enum {SCALAR=0, AVX2=1, AVX512=2} SimdLevel;
+
+// Compile with -D BRUTE_SIMD_LEVEL=<0|1|2> to force the instruction set (0 disables SIMD).
+static inline SimdLevel simd_level() {
+#if defined(BRUTE_SIMD_LEVEL)
+	return (SimdLevel)(BRUTE_SIMD_LEVEL);
+#elif BRUTE_SIMD_X86
+	static const SimdLevel level = []() -> SimdLevel {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return AVX512;
+		if (__builtin_cpu_supports("avx2"))
+			return AVX2;
+		return SCALAR;
+	}();
+	return level;
+#else
+	return SCALAR;
+#endif
+}
+
+
+template<typename T, typename I, bool ORDERED, typename LESS>
+static inline void update_lanes(unsigned int ltBits, unsigned int eqBits, I* arg, const I& i_a,
+		LESS index_less) {
+	while (ltBits) {
+		arg[__builtin_ctz(ltBits)] = i_a;
+		ltBits &= ltBits - 1;
+	}
+
+	while (ORDERED && eqBits) {
+		unsigned int j = __builtin_ctz(eqBits);
+		if (index_less(i_a, arg[j]))
+			arg[j] = i_a;
+		eqBits &= eqBits - 1;
+	}
+}
+
+
+template<typename T, typename I, bool ORDERED, typename LESS>
+static inline void row_scalar(T a_val, const T* b, T* res, I* arg, unsigned int lo, unsigned int n,
+		const I& i_a, LESS index_less) {
+	for (unsigned int j=lo; j < n; j++) {
+		T val = a_val + b[j];
+		if (res[j] < val || (ORDERED && res[j] == val && index_less(i_a, arg[j]))) {
+			res[j] = val;
+			arg[j] = i_a;
+		}
+	}
+}
+
+
+#if BRUTE_SIMD_X86
+
+#define SIMD_AVX2 __attribute__((target("avx2")))
+#define SIMD_AVX512 __attribute__((target("avx512f")))
+
+
+/*
+ * Per value type vector operations.
+ * lt(res, v) and eq(res, v) return a bit per lane.
+ * Integer operations are selected by size and signedness, so they do not depend on the
+ * exact integer types behind VALUE.
+ */
+template<typename T, bool IS_FLOAT = std::is_floating_point<T>::value> class Avx2Ops;
+template<typename T, bool IS_FLOAT = std::is_floating_point<T>::value> class Avx512Ops;
+
+
+template<> class Avx2Ops<float> {
+public:
+	typedef __m256 reg;
+	static const unsigned int lanes = 8;
+	SIMD_AVX2 static inline reg set1(float v) { return _mm256_set1_ps(v); }
+	SIMD_AVX2 static inline reg load(const float* p) { return _mm256_loadu_ps(p); }
+	SIMD_AVX2 static inline reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+	SIMD_AVX2 static inline unsigned int lt(reg r, reg v) {
+		return _mm256_movemask_ps(_mm256_cmp_ps(r, v, _CMP_LT_OQ));
+	}
+	SIMD_AVX2 static inline unsigned int eq(reg r, reg v) {
+		return _mm256_movemask_ps(_mm256_cmp_ps(r, v, _CMP_EQ_OQ));
+	}
+	SIMD_AVX2 static inline void store(float* p, reg r, reg v) {
+		_mm256_storeu_ps(p, _mm256_blendv_ps(r, v, _mm256_cmp_ps(r, v, _CMP_LT_OQ)));
+	}
+};
+
+template<> class Avx2Ops<double> {
+public:
+	typedef __m256d reg;
+	static const unsigned int lanes = 4;
+	SIMD_AVX2 static inline reg set1(double v) { return _mm256_set1_pd(v); }
+	SIMD_AVX2 static inline reg load(const double* p) { return _mm256_loadu_pd(p); }
+	SIMD_AVX2 static inline reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+	SIMD_AVX2 static inline unsigned int lt(reg r, reg v) {
+		return _mm256_movemask_pd(_mm256_cmp_pd(r, v, _CMP_LT_OQ));
+	}
+	SIMD_AVX2 static inline unsigned int eq(reg r, reg v) {
+		return _mm256_movemask_pd(_mm256_cmp_pd(r, v, _CMP_EQ_OQ));
+	}
+	SIMD_AVX2 static inline void store(double* p, reg r, reg v) {
+		_mm256_storeu_pd(p, _mm256_blendv_pd(r, v, _mm256_cmp_pd(r, v, _CMP_LT_OQ)));
+	}
+};
+
+// Integers: AVX2 only has a signed greater-than. Unsigned values are compared after flipping
+// their sign bit.
+template<typename T, bool IS64 = (sizeof(T) == 8), bool IS_SIGNED = std::is_signed<T>::value>
+class Avx2IntOps {
+public:
+	typedef __m256i reg;
+	static const unsigned int lanes = 32 / sizeof(T);
+
+	SIMD_AVX2 static inline reg set1(T v) {
+		return IS64 ? _mm256_set1_epi64x((long long)v) : _mm256_set1_epi32((int)v);
+	}
+	SIMD_AVX2 static inline reg load(const T* p) { return _mm256_loadu_si256((const __m256i*)p); }
+	SIMD_AVX2 static inline reg add(reg a, reg b) {
+		return IS64 ? _mm256_add_epi64(a, b) : _mm256_add_epi32(a, b);
+	}
+	SIMD_AVX2 static inline reg flip(reg a) {
+		if (IS_SIGNED)
+			return a;
+		return _mm256_xor_si256(a, IS64 ? _mm256_set1_epi64x((long long)1 << 63) :
+				_mm256_set1_epi32((int)0x80000000));
+	}
+	SIMD_AVX2 static inline reg ltMask(reg r, reg v) {
+		return IS64 ? _mm256_cmpgt_epi64(flip(v), flip(r)) : _mm256_cmpgt_epi32(flip(v), flip(r));
+	}
+	SIMD_AVX2 static inline unsigned int bits(reg m) {
+		return IS64 ? _mm256_movemask_pd(_mm256_castsi256_pd(m)) :
+				_mm256_movemask_ps(_mm256_castsi256_ps(m));
+	}
+	SIMD_AVX2 static inline unsigned int lt(reg r, reg v) { return bits(ltMask(r, v)); }
+	SIMD_AVX2 static inline unsigned int eq(reg r, reg v) {
+		return bits(IS64 ? _mm256_cmpeq_epi64(r, v) : _mm256_cmpeq_epi32(r, v));
+	}
+	SIMD_AVX2 static inline void store(T* p, reg r, reg v) {
+		_mm256_storeu_si256((__m256i*)p, _mm256_blendv_epi8(r, v, ltMask(r, v)));
+	}
+};
+
+template<typename T> class Avx2Ops<T, false> : public Avx2IntOps<T> {};
+
+
+template<> class Avx512Ops<float> {
+public:
+	typedef __m512 reg;
+	static const unsigned int lanes = 16;
+	SIMD_AVX512 static inline reg set1(float v) { return _mm512_set1_ps(v); }
+	SIMD_AVX512 static inline reg load(const float* p) { return _mm512_loadu_ps(p); }
+	SIMD_AVX512 static inline reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+	SIMD_AVX512 static inline unsigned int lt(reg r, reg v) { return _mm512_cmp_ps_mask(r, v, _CMP_LT_OQ); }
+	SIMD_AVX512 static inline unsigned int eq(reg r, reg v) { return _mm512_cmp_ps_mask(r, v, _CMP_EQ_OQ); }
+	SIMD_AVX512 static inline void store(float* p, reg r, reg v) {
+		_mm512_mask_storeu_ps(p, (__mmask16)lt(r, v), v);
+	}
+};
+
+template<> class Avx512Ops<double> {
+public:
+	typedef __m512d reg;
+	static const unsigned int lanes = 8;
+	SIMD_AVX512 static inline reg set1(double v) { return _mm512_set1_pd(v); }
+	SIMD_AVX512 static inline reg load(const double* p) { return _mm512_loadu_pd(p); }
+	SIMD_AVX512 static inline reg add(reg a, reg b) { return _mm512_add_pd(a, b); }
+	SIMD_AVX512 static inline unsigned int lt(reg r, reg v) { return _mm512_cmp_pd_mask(r, v, _CMP_LT_OQ); }
+	SIMD_AVX512 static inline unsigned int eq(reg r, reg v) { return _mm512_cmp_pd_mask(r, v, _CMP_EQ_OQ); }
+	SIMD_AVX512 static inline void store(double* p, reg r, reg v) {
+		_mm512_mask_storeu_pd(p, (__mmask8)lt(r, v), v);
+	}
+};
+
+template<typename T, unsigned int SIZE = sizeof(T), bool IS_SIGNED = std::is_signed<T>::value>
+class Avx512IntOps;
+
+#define AVX512_INT_OPS(SIZE, IS_SIGNED, BITS, CMP) \
+template<typename T> class Avx512IntOps<T, SIZE, IS_SIGNED> { \
+public: \
+	typedef __m512i reg; \
+	static const unsigned int lanes = 512 / BITS; \
+	SIMD_AVX512 static inline reg set1(T v) { return _mm512_set1_epi##BITS(v); } \
+	SIMD_AVX512 static inline reg load(const T* p) { return _mm512_loadu_si512((const void*)p); } \
+	SIMD_AVX512 static inline reg add(reg a, reg b) { return _mm512_add_epi##BITS(a, b); } \
+	SIMD_AVX512 static inline unsigned int lt(reg r, reg v) { return _mm512_cmplt_##CMP##BITS##_mask(r, v); } \
+	SIMD_AVX512 static inline unsigned int eq(reg r, reg v) { return _mm512_cmpeq_##CMP##BITS##_mask(r, v); } \
+	SIMD_AVX512 static inline void store(T* p, reg r, reg v) { \
+		_mm512_mask_storeu_epi##BITS((void*)p, _mm512_cmplt_##CMP##BITS##_mask(r, v), v); \
+	} \
+}
+
+AVX512_INT_OPS(4, true,  32, epi);
+AVX512_INT_OPS(4, false, 32, epu);
+AVX512_INT_OPS(8, true,  64, epi);
+AVX512_INT_OPS(8, false, 64, epu);
+
+#undef AVX512_INT_OPS
+
+template<typename T> class Avx512Ops<T, false> : public Avx512IntOps<T> {};
+
+
+#define DEF_ROW_SIMD(NAME, OPS, TARGET) \
+template<typename T, typename I, bool ORDERED, typename LESS> \
+TARGET static void NAME(T a_val, const T* b, T* res, I* arg, unsigned int n, const I& i_a, \
+		LESS index_less) { \
+	typedef OPS<T> ops; \
+	auto va = ops::set1(a_val); \
+	unsigned int j = 0; \
+	for (; j + ops::lanes <= n; j += ops::lanes) { \
+		auto v = ops::add(va, ops::load(b+j)); \
+		auto r = ops::load(res+j); \
+		unsigned int ltBits = ops::lt(r, v); \
+		unsigned int eqBits = ORDERED ? ops::eq(r, v) : 0; \
+		if (!ltBits && !eqBits) \
+			continue; \
+		ops::store(res+j, r, v); \
+		update_lanes<T, I, ORDERED>(ltBits, eqBits, arg+j, i_a, index_less); \
+	} \
+	row_scalar<T, I, ORDERED>(a_val, b, res, arg, j, n, i_a, index_less); \
+}
+
+DEF_ROW_SIMD(row_avx2, Avx2Ops, SIMD_AVX2)
+DEF_ROW_SIMD(row_avx512, Avx512Ops, SIMD_AVX512)
+
+#undef DEF_ROW_SIMD
+
+#endif // BRUTE_SIMD_X86
+
+
+/*
+ * Updates RES/ARG with A_VAL + B for a row of N consecutive cells.
+ * INDEX_LESS(i, j) is the ordered tie breaking rule (used only if ORDERED).
+ */
+template<typename T, typename I, bool ORDERED, typename LESS>
+static inline void join_row(T a_val, const T* b, T* res, I* arg, unsigned int n, const I& i_a,
+		LESS index_less) {
+#if BRUTE_SIMD_X86
+	switch (simd_level()) {
+	case AVX512:
+		row_avx512<T, I, ORDERED>(a_val, b, res, arg, n, i_a, index_less);
+		return;
+	case AVX2:
+		row_avx2<T, I, ORDERED>(a_val, b, res, arg, n, i_a, index_less);
+		return;
+	default:
+		break;
+	}
+#endif
+	row_scalar<T, I, ORDERED>(a_val, b, res, arg, 0, n, i_a, index_less);
+}
+
+} // BruteSIMD
+
+#endif /* BRUTE_SIMD_HPP_ */
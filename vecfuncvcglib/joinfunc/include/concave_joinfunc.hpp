@@ -0,0 +1,117 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CONCAVE_JOINFUNC_HPP_
+#define CONCAVE_JOINFUNC_HPP_
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <jointvecfunc.hpp>
+#include "serial_joinfunc.hpp"
+
+
+/*
+ * Linear time join of two concave 1D functions.
+ *
+ * The (max,+) convolution of two concave sequences is the merge of their gradients, so the
+ * optimal split of RES[k] is monotone in k: it is either the split of RES[k-1] or one step
+ * further in A. Each step compares the actual sums, so ties are resolved in favor of the
+ * lowest A index, as in the other methods. O(|A| + |B|).
+ *
+ * The concavity of both functions is checked at runtime. Otherwise (or if D > 1), falls back
+ * to a DS method (see SerialJoinFunc).
+ */
+template <typename T, unsigned int D, unsigned int GRAD_INTERVAL = 1>
+class Concave1DJoinFunc : public SerialJoinFunc<T, D> {
+public:
+	using Serial = SerialJoinFunc<T, D>;
+	using TDVecFunc = VecFunc<T,D>;
+	using TDJoinedVecFunc = JointVecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	// Non increasing gradients (up to EPS). Expects a rising function (see fix_rising()).
+	static bool is_concave(const T* m, unsigned int n) {
+		for (unsigned int i=2; i < n; i++) {
+			if (m[i] - m[i-1] > m[i-1] - m[i-2] + EPS)
+				return false;
+		}
+		return true;
+	}
+
+	static bool is_concave(const TDVecFunc& v) {
+		return D == 1 && is_concave(v.m, v.size[0]);
+	}
+
+	// The walk is linear in the result, so it runs on the calling thread.
+	static bool join_domain(TDVecFunc& a, TDVecFunc& b, TDJoinedVecFunc& res, unsigned int threadCount,
+			VCGStats* stats) {
+		return Serial::join_domain(a, b, res, threadCount, stats,
+				[] (const TDVecFunc& v) { return is_concave(v); },
+				[] (const TDVecFunc& x, const TDVecFunc& y, TDJoinedVecFunc& r) {
+			join_concave(x.m, x.size[0], y.m, y.size[0], r.m, r.arg, r.size[0]);
+		});
+	}
+
+	/*
+	 * RES[k] = max_{i+j=k} A[i] + B[j], and ARG[k] = i (the lowest one), for k < RES_SIZE.
+	 * Only the positive values are written (RES is reset by the caller).
+	 */
+	static void join_concave(const T* a, unsigned int a_size, const T* b, unsigned int b_size,
+			T* res, index* arg, unsigned int res_size) {
+		split_concave(a, a_size, b, b_size, res_size, [res, arg] (unsigned int k, unsigned int i, T val) {
+			if (0 < val) {
+				res[k] = val;
+				arg[k][0] = i;
+			}
+		});
+	}
+
+	/*
+	 * Calls F(k, i, val) for each k < min(K_LIMIT, |A|+|B|-1), with the lowest split i that
+	 * maximizes val = A[i] + B[k-i].
+	 */
+	template<typename F>
+	static void split_concave(const T* a, unsigned int a_size, const T* b, unsigned int b_size,
+			unsigned int k_limit, F f) {
+		if (a_size == 0 || b_size == 0)
+			return;
+
+		k_limit = std::min(k_limit, a_size + b_size - 1);
+		unsigned int i = 0;
+		for (unsigned int k=0; k < k_limit; k++) {
+			// The split must keep the B index in range
+			if (k - i >= b_size)
+				i = k - (b_size - 1);
+
+			unsigned int i_hi = std::min(k, a_size - 1);
+			T val = a[i] + b[k-i];
+			while (i < i_hi) {
+				T next = a[i+1] + b[k-i-1];
+				if (!(val < next))
+					break;
+				val = next;
+				i++;
+			}
+
+			f(k, i, val);
+		}
+	}
+};
+
+
+#endif /* CONCAVE_JOINFUNC_HPP_ */
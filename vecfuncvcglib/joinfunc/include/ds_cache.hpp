@@ -0,0 +1,305 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DS_CACHE_HPP_
+#define DS_CACHE_HPP_
+
+#include <list>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <vecfunc.hpp>
+
+
+// The default capacity (bytes) of the DS cache. 0: no cache (see DSCacheControl::set_capacity()).
+#ifndef DS_CACHE_DEFAULT_CAPACITY
+#define DS_CACHE_DEFAULT_CAPACITY (0)
+#endif
+
+
+/*
+ * The capacity (bytes) of the DS caches of all the DS types, and the bytes they hold.
+ *
+ * The cache is off by default (DS_CACHE_DEFAULT_CAPACITY). Once enabled, it keeps the most
+ * recently used DSs up to its capacity (by their memoryFootprint() and the copy of the values
+ * they were built from). The uses of all the DS types are ordered by a single sequence, so the
+ * least recently used DS is evicted first, whatever its type.
+ * A join with a memory budget (see BudgetScope) counts the cached DSs against its budget: the
+ * cache is trimmed to the budget when it caches a DS, so the budgeted join does not keep more
+ * than its budget alive after it returns.
+ */
+class DSCacheControl {
+public:
+	// The last use (see next_use()) of the least recently used DS of a cache, or 0 if it is empty.
+	typedef unsigned long (*OldestFunc)();
+	// Evicts the least recently used DS of a cache.
+	typedef void (*EvictFunc)();
+
+	// Sets the capacity and trims the caches to it. 0 disables the cache (and releases it).
+	static void set_capacity(unsigned long bytes) {
+		std::lock_guard<std::mutex> guard(lock());
+		capacity_bytes() = bytes;
+		trim_all(bytes);
+	}
+
+	static unsigned long capacity() {
+		std::lock_guard<std::mutex> guard(lock());
+		return capacity_bytes();
+	}
+
+	// Releases all the cached DSs (the capacity is kept).
+	static void clear() {
+		std::lock_guard<std::mutex> guard(lock());
+		trim_all(0);
+	}
+
+	// The bytes of the cached DSs.
+	static unsigned long size() {
+		std::lock_guard<std::mutex> guard(lock());
+		return cached_bytes();
+	}
+
+	// Limits the cache to the memory budget of the joins of this thread in its lifetime.
+	class BudgetScope {
+		unsigned long prev;
+
+	public:
+		explicit BudgetScope(unsigned long memoryBudget) : prev(budget()) {
+			budget() = memoryBudget;
+		}
+
+		~BudgetScope() {
+			budget() = prev;
+		}
+	};
+
+	// The bytes that the caches may hold for the current thread (0: no cache).
+	static unsigned long limit() {
+		std::lock_guard<std::mutex> guard(lock());
+		return limit_locked();
+	}
+
+protected:
+	static unsigned long limit_locked() {
+		unsigned long ret = capacity_bytes();
+		if (budget() > 0)
+			ret = std::min(ret, budget());
+		return ret;
+	}
+
+	static std::mutex& lock() {
+		static std::mutex m;
+		return m;
+	}
+
+	static unsigned long& cached_bytes() {
+		static unsigned long b = 0;
+		return b;
+	}
+
+	static void register_cache(OldestFunc oldest, EvictFunc evict) {
+		caches().push_back(Cache{oldest, evict});
+	}
+
+	// The sequence number of a use of a cached DS.
+	static unsigned long next_use() {
+		static unsigned long u = 0;
+		return ++u;
+	}
+
+	// Evicts the least recently used DSs of all the caches until they hold at most LIMIT bytes.
+	static void trim_all(unsigned long limit) {
+		while (cached_bytes() > limit) {
+			const Cache* lru = nullptr;
+			unsigned long lruUse = 0;
+			for (auto& c : caches()) {
+				unsigned long use = c.oldest();
+				if (use > 0 && (lru == nullptr || use < lruUse)) {
+					lru = &c;
+					lruUse = use;
+				}
+			}
+			if (lru == nullptr)
+				break;
+			lru->evict();
+		}
+	}
+
+private:
+	static unsigned long& capacity_bytes() {
+		static unsigned long c = DS_CACHE_DEFAULT_CAPACITY;
+		return c;
+	}
+
+	static unsigned long& budget() {
+		static thread_local unsigned long b = 0;
+		return b;
+	}
+
+	typedef struct {
+		OldestFunc oldest;
+		EvictFunc evict;
+	} Cache;
+
+	static std::vector<Cache>& caches() {
+		static std::vector<Cache> c;
+		return c;
+	}
+};
+
+
+/*
+ * Cache of built data structures (one per DS type and gradient interval).
+ *
+ * The same B function is often joined more than once (e.g., in the forward and the reverse
+ * join chains). A DS is keyed by the function's size, a hash of its content, and the build
+ * parameters, so it is reused for the same values wherever they are (the joins of a chain copy
+ * B to a buffer of their own, see VCGPayments::join_chain()). The hash only narrows the search:
+ * an entry keeps a copy of the values it was built from, and a hit must have the same values.
+ * The DS copies share their points, so a hit is cheap.
+ * The cache is bounded by bytes (see DSCacheControl).
+ */
+template <typename DS, typename T, unsigned int D, unsigned int GRAD_INTERVAL>
+class DSCache : public DSCacheControl {
+public:
+	using TDVecFunc = VecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	typedef struct {
+		index size;
+		uint64_t hash;
+		unsigned int chunkSize;
+		bool filterGrad;
+	} Key;
+
+	// FNV-1a of the function's values.
+	static uint64_t content_hash(const TDVecFunc& v) {
+		const unsigned char* p = (const unsigned char*)v.m;
+		const unsigned char* end = p + sizeof(T) * (unsigned long)v.total_size();
+		uint64_t h = 14695981039346656037ULL;
+		for (; p < end; p++) {
+			h ^= *p;
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	/*
+	 * Returns the cached DS of V, or builds it by BUILD() (outside the lock) and caches it.
+	 */
+	template<typename F>
+	static DS get(const TDVecFunc& v, unsigned int chunkSize, bool filterGrad, F build,
+			VCGStats* stats) {
+		if (limit() == 0)
+			return build();
+
+		Key key;
+		key.size = v.size;
+		key.hash = content_hash(v);
+		key.chunkSize = chunkSize;
+		key.filterGrad = filterGrad;
+
+		{
+			std::lock_guard<std::mutex> guard(lock());
+			auto& e = entries();
+			for (auto it = e.begin(); it != e.end(); ++it) {
+				if (!same_key(it->key, key) || !same_values(it->values, v))
+					continue;
+				e.splice(e.begin(), e, it);
+				it->lastUse = next_use();
+				stats->dsCacheHits++;
+				stats->dsPts += it->ptsCount;
+				stats->totalPts += v.total_size();
+				return it->ds;
+			}
+		}
+
+		stats->dsCacheMisses++;
+		auto dsPts = stats->dsPts;
+		DS ds = build();
+		unsigned long dsBytes = ds.memoryFootprint() + sizeof(T) * (unsigned long)v.total_size();
+
+		std::lock_guard<std::mutex> guard(lock());
+		static bool registered = false;
+		if (!registered) {
+			register_cache(oldest, evict);
+			registered = true;
+		}
+
+		unsigned long maxBytes = limit_locked();
+		if (dsBytes > maxBytes)
+			return ds;
+		trim_all(maxBytes - dsBytes);
+		entries().push_front(Entry{key, std::vector<T>(v.m, v.m + v.total_size()), ds,
+				stats->dsPts - dsPts, dsBytes, next_use()});
+		cached_bytes() += dsBytes;
+		return ds;
+	}
+
+private:
+	struct Entry {
+		Key key;
+		std::vector<T> values;
+		DS ds;
+		unsigned int ptsCount;
+		unsigned long bytes;
+		unsigned long lastUse;
+	};
+
+	static inline bool same_key(const Key& k1, const Key& k2) {
+		if (k1.hash != k2.hash || k1.chunkSize != k2.chunkSize ||
+				k1.filterGrad != k2.filterGrad)
+			return false;
+		FOR_EACH_DIM(d) {
+			if (k1.size[d] != k2.size[d])
+				return false;
+		}
+		return true;
+	}
+
+	// Compares the bytes, as content_hash().
+	static inline bool same_values(const std::vector<T>& values, const TDVecFunc& v) {
+		return std::memcmp(values.data(), v.m, sizeof(T) * values.size()) == 0;
+	}
+
+	// The entries are ordered by their last use, so the last one is the least recently used.
+	// Called with the lock held.
+	static unsigned long oldest() {
+		auto& e = entries();
+		return e.empty() ? 0 : e.back().lastUse;
+	}
+
+	static void evict() {
+		auto& e = entries();
+		cached_bytes() -= e.back().bytes;
+		e.pop_back();
+	}
+
+	static std::list<Entry>& entries() {
+		static std::list<Entry> e;
+		return e;
+	}
+};
+
+
+#endif /* DS_CACHE_HPP_ */
@@ -45,11 +45,19 @@ Finally, to normalize all the equations to the same form:
 #include <iomanip>
 #include <numeric>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
 
 #include <debug.h>
 #include <vcg_stats.hpp>
+#include <thread_pool.hpp>
+#include <upper_bound_ds.hpp>
+#include <rank_space.hpp>
 #include <jointvecfunc.hpp>
 #include "brute_joinfunc.hpp"
+#include "ds_cache.hpp"
+#include "join_cost_model.hpp"
 
 //#define POINT_WITH_IND (((D) % 2) == 0)
 #define POINT_WITH_IND (true)
@@ -60,6 +68,7 @@ Finally, to normalize all the equations to the same form:
 
 #define EPS (std::numeric_limits<T>::epsilon())
 
+
 template <typename T, unsigned int D,
 	template<typename, typename, unsigned int> class UPPERBOUND_DS,
 	unsigned int GRAD_INTERVAL = 1>
@@ -74,18 +83,97 @@ public:
 		T val;
 	} PointData;
 
-	typedef UPPERBOUND_DS<T, PointData, POINT_DIM> join_val_ds;
-
-	using TDPoint = typename join_val_ds::point;
+	typedef UpperBoundDS::SharedPoints<T, PointData, POINT_DIM> shared_points;
+	using TDPoint = typename shared_points::point;
 	using TDPointVec = typename TDPoint::pointVec;
 
+	// The DS is built on the points in rank space (see RankSpace): with the narrow ranks if every
+	// dim has fewer than RANK_NARROW_COUNT distinct coordinates, and with the wide ones otherwise.
+	typedef typename UpperBoundDS::RankKey<T>::type key_type;
+	typedef typename UpperBoundDS::RankKey<T>::narrow narrow_key_type;
+
+	// A built DS of keys of type K, with the rank space of its points.
+	template<typename K>
+	class KeyedDS {
+	public:
+		typedef UpperBoundDS::RankSpace<T, K, POINT_DIM> rank_space;
+		typedef UPPERBOUND_DS<K, PointData, POINT_DIM> join_val_ds;
+		typedef typename join_val_ds::point DSPoint;
+		typedef typename DSPoint::pointVec DSPointVec;
+
+		rank_space ranks;
+		join_val_ds ds;
+
+		KeyedDS(const rank_space& r, const shared_points& pts, unsigned int chunkSize) : ranks(r),
+				ds(ranks.transform(pts), chunkSize) {}
+
+		unsigned long memoryFootprint() const {
+			return ranks.memoryFootprint() + ds.pointsFootprint() + ds.memoryFootprint();
+		}
+	};
+
+	typedef KeyedDS<key_type> WideDS;
+	typedef KeyedDS<narrow_key_type> NarrowDS;
+
+	// A built DS of B, of one of the key types (the other is NULL). The copies share it.
+	class JoinDS {
+	public:
+		std::shared_ptr<const WideDS> wide;
+		std::shared_ptr<const NarrowDS> narrow;
+
+		JoinDS(const shared_points& pts, unsigned int chunkSize) {
+			typename WideDS::rank_space ranks(pts);
+			if (!std::is_same<key_type, narrow_key_type>::value && ranks.maxCount() < RANK_NARROW_COUNT)
+				narrow.reset(new NarrowDS(typename NarrowDS::rank_space(ranks), pts, chunkSize));
+			else
+				wide.reset(new WideDS(ranks, pts, chunkSize));
+		}
+
+		unsigned long memoryFootprint() const {
+			return narrow ? narrow->memoryFootprint() : wide->memoryFootprint();
+		}
+
+		// The memoryFootprint() of the DS of SIZE points, before it is built (with the wide keys,
+		// as the distinct coordinates are not known yet).
+		static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize) {
+			typedef typename WideDS::join_val_ds join_val_ds;
+			unsigned long ret = (unsigned long)size * (sizeof(typename WideDS::DSPoint) +
+					POINT_DIM * sizeof(key_type) + sizeof(typename join_val_ds::point_id));
+			if (!std::is_same<T, key_type>::value)
+				ret += (unsigned long)POINT_DIM * size * sizeof(T);
+			return ret + join_val_ds::estimateFootprint(size, chunkSize);
+		}
+	};
+
 	typedef enum {UP=0, DOWN=1, IND=2} UpDown;
 
-public:
-	static inline T& access_point(TDPoint& p, unsigned int cur_dim, UpDown direction) {
-		return access_point(p.vector, cur_dim, direction);
-	}
+	struct JoinCounters {
+		unsigned long expected = 0;
+		unsigned long actual = 0;
+		unsigned long actualInBound = 0;
+		unsigned long actualEdge = 0;
+		unsigned long bruteForce = 0;
+		unsigned long bruteForceCount = 0;
+		unsigned long totalCount = 0;
+		double queryTime = 0;
+		double queryFetchTime = 0;
+		JoinCostModel model;
+
+		void add(const JoinCounters& o) {
+			expected += o.expected;
+			actual += o.actual;
+			actualInBound += o.actualInBound;
+			actualEdge += o.actualEdge;
+			bruteForce += o.bruteForce;
+			bruteForceCount += o.bruteForceCount;
+			totalCount += o.totalCount;
+			queryTime += o.queryTime;
+			queryFetchTime += o.queryFetchTime;
+			model.add(o.model);
+		}
+	};
 
+public:
 	static inline T& access_point(TDPointVec& v, unsigned int cur_dim, UpDown direction) {
 		return v[POINT_DIM_MULTIPLY*cur_dim + (unsigned int)direction];
 	}
@@ -110,55 +198,65 @@ public:
 		}
 	}
 
+	/*
+	 * Creates the point vector of the point I_E of E (see the conditions above).
+	 * Returns false if the point is not joined (FILTER_GRAD).
+	 */
 	template <bool FILTER_GRAD>
-	static inline typename join_val_ds::shared_points create_points(const TDVecFunc& e,
-						unsigned int res_vec_size) {
-		auto ret_pts = std::shared_ptr<TDPoint>(new TDPoint[res_vec_size], std::default_delete<TDPoint[]>());
-        TDPoint* pts = ret_pts.get();
+	static inline bool create_point(const TDVecFunc& e, index& i_e, T e_val, TDPointVec& v) {
+		if (FILTER_GRAD && e_val < 0)
+			return false;
 
-        T up_val, down_val;
+		T up_val, down_val;
+		FOR_EACH_DIM(d) {
+			get_up_down_val(e, i_e, d, e_val, up_val, down_val);
+			if (FILTER_GRAD && down_val < EPS)
+				return false;
+
+			access_point(v, d, UP) = up_val;
+			if (std::is_signed<T>::value)
+				access_point(v, d, DOWN) = -down_val;
+			else
+				access_point(v, d, DOWN) = MAX_VALUE - down_val;
+			if (POINT_WITH_IND)
+				access_point(v, d, IND) = i_e[d];
+		}
+		return true;
+	}
 
+	// The points of E are written to the columns as they are created (see SharedPoints).
+	template <bool FILTER_GRAD>
+	static inline shared_points create_points(const TDVecFunc& e,
+						unsigned int res_vec_size) {
+		shared_points pts(res_vec_size);
         unsigned int pts_count = 0;
 
         index i_e;
+        TDPointVec v;
+        PointData data;
         FOR_EACH_MAT_INDEX(e, i_e) {
 			auto e_ind = e.get_index(i_e);
 //			if (FILTER_GRAD && e_ind == 0)
 //				continue;
 
 			auto e_val = e[e_ind];
-			if (FILTER_GRAD && e_val < 0)
+			if (!create_point<FILTER_GRAD>(e, i_e, e_val, v))
 				continue;
 
-			TDPoint& p = pts[pts_count++];
-			p.val.ind = i_e;
-			p.val.val = e_val;
-			
-			FOR_EACH_DIM(d) {
-				get_up_down_val(e, i_e, d, e_val, up_val, down_val);
-				if (FILTER_GRAD && down_val < EPS) {
-					--pts_count;
-					break;
-				}
-
-				access_point(p, d, UP) = up_val;
-				if (std::is_signed<T>::value)
-					access_point(p, d, DOWN) = -down_val;
-				else
-					access_point(p, d, DOWN) = MAX_VALUE - down_val;
-				if (POINT_WITH_IND)
-					access_point(p, d, IND) = i_e[d];
-			}
+			data.ind = i_e;
+			data.val = e_val;
+			pts.setPoint(pts_count++, v, data);
 		}
 
         DEBUG_OUTPUT("Point DIM: " << POINT_DIM);
 
-        typename join_val_ds::shared_points pts_object(ret_pts, pts_count);
-		return pts_object;
+        pts.setSize(pts_count);
+		return pts;
 	}
 
 	template <bool FILTER_GRAD, bool BUILD_TIMING>
-	static join_val_ds build_ds(const TDVecFunc& v, unsigned int chunkSize, VCGStats* stats) {
+	static JoinDS build_ds(const TDVecFunc& v, unsigned int chunkSize, unsigned int threadCount,
+			VCGStats* stats) {
 	    unsigned int vec_size = v.total_size();
 	    STATS_INIT(stats_var);
 
@@ -169,139 +267,377 @@ public:
 		stats->totalPts += vec_size;
 		if (BUILD_TIMING)
 			STATS_ADD_TIME(stats_var, stats->dsCreatePointsTime);
-		join_val_ds r(pts, chunkSize);
+		UpperBoundDS::BuildThreads::Scope buildThreads(threadCount);
+		JoinDS r(pts, chunkSize);
 		if(BUILD_TIMING)
 			STATS_ADD_TIME(stats_var, stats->dsBuildTime);
+		stats->dsMemoryBytes += r.memoryFootprint();
 
 		return r;
     }
 
-	template <bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool COUNTERS, bool BUILD_TIMING, bool QUERY_TIMING>
-	static void join_vecfunc(TDVecFunc& a, TDVecFunc& b, TDJoinedVecFunc& res,
-			unsigned int chunkSize, VCGStats* stats __attribute__((unused))) {
-		FastJoinFunc::reset_result_array(res);
-		a.fix_rising();
-		b.fix_rising();
+	// Same as build_ds(), but reuses the DS of a B function that was already built (see DSCache).
+	template <bool FILTER_GRAD, bool BUILD_TIMING>
+	static JoinDS cached_build_ds(const TDVecFunc& v, unsigned int chunkSize, unsigned int threadCount,
+			VCGStats* stats) {
+		return DSCache<JoinDS, T, D, GRAD_INTERVAL>::get(v, chunkSize, FILTER_GRAD, [&] () {
+			return build_ds<FILTER_GRAD, BUILD_TIMING>(v, chunkSize, threadCount, stats);
+		}, stats);
+	}
 
-		unsigned int b_vec_size = b.total_size();
+	/*
+	 * Creates the query vector of A point: the B points that are strictly below it (in all
+	 * the dims) are the candidates to be joined with it (see the conditions above).
+	 * Returns false if A point cannot be joined (FILTER_GRAD).
+	 */
+	template <bool FILTER_GRAD>
+	static inline bool create_upper(const TDVecFunc& a, index& i_a, T a_val, const index& b_limit,
+			TDPointVec& upper) {
+		T up_val, down_val;
+		FOR_EACH_DIM(d) {
+			get_up_down_val(a, i_a, d, a_val, up_val, down_val);
+			if (FILTER_GRAD && down_val < EPS)
+				return false;
+
+			access_point(upper, d, UP) = down_val;
+			if (std::is_signed<T>::value) {
+				access_point(upper, d, DOWN) = -up_val;
+			} else {
+				access_point(upper, d, DOWN) = MAX_VALUE - up_val;
+			}
+			if (POINT_WITH_IND)
+				access_point(upper, d, IND) = b_limit[d]-1;
+		}
 
-		STATS_INIT(stats_var);
+		upper.nextafter();
+		return true;
+	}
 
-		DEBUG_OUTPUT("DS Build Start");
-		join_val_ds r = build_ds<FILTER_GRAD, BUILD_TIMING>(b, chunkSize, stats);
-		DEBUG_OUTPUT("DS Build End");
+	/*
+	 * A batch of A points to join.
+	 * The DS queries of the batch are issued together (queryBatch()), so the DS can interleave
+	 * their traversals. Each query has its own copy of the DS (lane) that keeps its results.
+	 * The query vectors are in the rank space of the DS (of type KDS, see KeyedDS).
+	 */
+	template<typename KDS>
+	class JoinBatch {
+	public:
+		typedef enum {SKIP=0, BRUTE=1, QUERY=2} JoinKind;
+		typedef typename KDS::join_val_ds join_val_ds;
+
+		std::vector<join_val_ds> lanes;
+		join_val_ds* lanePtrs[QUERY_BATCH_SIZE];
+		typename KDS::rank_space ranks;
+		typename KDS::DSPointVec uppers[QUERY_BATCH_SIZE];
+		unsigned int budgets[QUERY_BATCH_SIZE];
+		unsigned int maxPtsCount[QUERY_BATCH_SIZE];
+		unsigned int queryCount = 0;
+
+		index i_a[QUERY_BATCH_SIZE];
+		index b_limit[QUERY_BATCH_SIZE];
+		T a_val[QUERY_BATCH_SIZE];
+		JoinKind kind[QUERY_BATCH_SIZE];
+		unsigned int lane[QUERY_BATCH_SIZE];
+		unsigned int size = 0;
+
+		explicit JoinBatch(const KDS& r) : lanes(QUERY_BATCH_SIZE, r.ds), ranks(r.ranks) {
+			for (unsigned int i=0; i < QUERY_BATCH_SIZE; i++)
+				lanePtrs[i] = &lanes[i];
+		}
 
-		typename join_val_ds::point_vec upper;
+		bool full() const {
+			return size == QUERY_BATCH_SIZE;
+		}
 
-		auto p_resPts = std::unique_ptr<TDPoint*[]>(new TDPoint*[b_vec_size]);
-		TDPoint** resPts = p_resPts.get();
+		void clear() {
+			size = 0;
+			queryCount = 0;
+		}
+	};
+
+	// Adds A point to the batch, and prepares its query (if required).
+	template <bool FILTER_GRAD, bool BRUTE_OPT, bool COUNTERS, typename KDS>
+	static inline void prepare_point(JoinBatch<KDS>& batch, const TDVecFunc& a, const TDVecFunc& b,
+			const TDJoinedVecFunc& res, index& i_a, JoinCounters& c) {
+		unsigned int k = batch.size++;
+		batch.i_a[k] = i_a;
+		index& b_limit = batch.b_limit[k];
+
+		auto a_val = a[i_a];
+		batch.a_val[k] = a_val;
+
+		vec_dec(res.size, i_a, b_limit);
+		b_limit.min(b.size);
+
+		// A small box is brute forced before the FILTER_GRAD check, so its point is joined anyway.
+		if (BRUTE_OPT && c.model.brute_before_query(b_limit.size())) {
+			batch.kind[k] = JoinBatch<KDS>::BRUTE;
+			return;
+		}
+		TDPointVec upper;
+		if (!create_upper<FILTER_GRAD>(a, i_a, a_val, b_limit, upper)) {
+			batch.kind[k] = JoinBatch<KDS>::SKIP;
+			return;
+		}
 
-		unsigned long expected = 0;
-		unsigned long actual = 0;
-		unsigned long actualInBound = 0;
-		unsigned long actualEdge = 0;
-		unsigned long bruteForce = 0;
-		unsigned long bruteForceCount = 0;
-		unsigned long totalCount = 0;
+		unsigned int l = batch.queryCount;
+		batch.ranks.transformUpper(upper, batch.uppers[l]);
 
+		if (COUNTERS)
+			c.totalCount++;
 
-		index i_a, a_limit, b_limit;
-		T up_val, down_val;
-		a_limit = a.size;
-		a_limit.min(res.size);
-		FOR_EACH_INDEX(i_a, a_limit) {
-			auto a_val = a[i_a];
+		if (BRUTE_OPT)
+			batch.budgets[l] = c.model.fetch_budget(b_limit.size());
+
+		batch.kind[k] = JoinBatch<KDS>::QUERY;
+		batch.lane[k] = l;
+		batch.queryCount++;
+	}
+
+	/*
+	 * Queries the DS for the whole batch, and then joins its points in their order.
+	 * The candidates of a query are joined as the DS visits them (forEachCandidate()).
+	 * With BRUTE_OPT, some of the batches are timed to calibrate the cost model, except with
+	 * FILTER_GRAD: the brute force also joins the flat B points, which are not in the DS, so the
+	 * decisions may change the result. They are then decided by the counts only (see
+	 * JoinCostModel).
+	 */
+	template <bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool COUNTERS, bool QUERY_TIMING, typename KDS>
+	static void flush_batch(JoinBatch<KDS>& batch, const TDVecFunc& b, TDJoinedVecFunc& res,
+			JoinCounters& c) {
+		typedef typename KDS::join_val_ds join_val_ds;
+		typedef typename KDS::DSPoint DSPoint;
+		STATS_INIT(stats_var);
+		STATS_INIT(model_var);
+		bool timed = BRUTE_OPT && !FILTER_GRAD && batch.size > 0 && c.model.next_batch();
+
+		if (batch.queryCount > 0) {
+			double t = 0;
+			if (QUERY_TIMING || timed)
+				STATS_START(stats_var);
+			if (BRUTE_OPT)
+				join_val_ds::queryBatchBudget(batch.lanePtrs, batch.uppers, batch.budgets, batch.queryCount,
+						batch.maxPtsCount);
+			else
+				join_val_ds::queryBatch(batch.lanePtrs, batch.uppers, batch.queryCount, batch.maxPtsCount);
+			if (QUERY_TIMING || timed)
+				STATS_ADD_TIME(stats_var, t);
+			if (QUERY_TIMING)
+				c.queryTime += t;
+			if (timed)
+				c.model.add_query(batch.queryCount, t);
+		}
+
+		for (unsigned int k=0; k < batch.size; k++) {
+			index& i_a = batch.i_a[k];
+			index& b_limit = batch.b_limit[k];
+			auto a_val = batch.a_val[k];
+
+			if (batch.kind[k] == JoinBatch<KDS>::SKIP)
+				continue;
 
-			vec_dec(res.size, i_a, b_limit);
-			b_limit.min(b.size);
 			auto b_points_count = b_limit.size();
-			if (BRUTE_OPT && b_points_count < 64) {
-				FastJoinFunc::join_val_inner(i_a, a_val, b, b_limit, res);
+			if (batch.kind[k] == JoinBatch<KDS>::BRUTE) {
+				if (timed)
+					STATS_START(model_var);
+				FastJoinFunc::template join_val_inner<true>(i_a, a_val, b, b_limit, res);
+				if (timed)
+					c.model.add_brute(b_points_count, stats_elapsed(model_var));
 				if (COUNTERS) {
-					bruteForce += b_limit.size();
-					bruteForceCount++;
+					c.bruteForce += b_points_count;
+					c.bruteForceCount++;
 				}
 				continue;
 			}
 
+			unsigned int l = batch.lane[k];
+			// The count of an over budget query is unknown (see JoinCostModel).
+			unsigned int maxPtsCount = batch.maxPtsCount[l];
+			if (COUNTERS && maxPtsCount != QUERY_OVER_BUDGET)
+				c.expected += maxPtsCount;
+
+			if (BRUTE_OPT && c.model.brute_after_query(b_points_count, maxPtsCount)) {
+				if (timed)
+					STATS_START(model_var);
+				FastJoinFunc::template join_val_inner<true>(i_a, a_val, b, b_limit, res);
+				if (timed)
+					c.model.add_brute(b_points_count, stats_elapsed(model_var));
+				if (COUNTERS) {
+					c.bruteForce += b_points_count;
+					c.bruteForceCount++;
+				}
+				continue;
+			}
+
+			if (timed)
+				STATS_START(model_var);
 			if (QUERY_TIMING)
 				STATS_START(stats_var);
-
-			bool is_point_valid = true;
-			FOR_EACH_DIM(d) {
-				get_up_down_val(a, i_a, d, a_val, up_val, down_val);
-				if (FILTER_GRAD && down_val < EPS) {
-					is_point_valid = false;
-					break;
+			auto visit = [&] (const DSPoint* pt) {
+				const DSPoint& p = *pt;
+				if (COUNTERS) {
+					c.actual++;
+					if (b.is_edge(p.val.ind))
+						c.actualEdge++;
 				}
 
-				access_point(upper, d, UP) = down_val;
-				if (std::is_signed<T>::value) {
-					access_point(upper, d, DOWN) = -up_val;
-				} else {
-					access_point(upper, d, DOWN) = MAX_VALUE - up_val;
-				}
-				if (POINT_WITH_IND)
-					access_point(upper, d, IND) = b_limit[d]-1;
-			}
+				if (!p.val.ind.less(b_limit))
+					return;
+				if (COUNTERS)
+					c.actualInBound++;
+
+				FastJoinFunc::template join_val_check_point<true>(i_a, a_val, p.val.ind, p.val.val, res);
+			};
+			batch.lanes[l].template forEachCandidate<FILTER>(batch.uppers[l], visit);
+			if (QUERY_TIMING)
+				STATS_ADD_TIME(stats_var, c.queryFetchTime);
+			if (timed)
+				c.model.add_fetch(maxPtsCount, stats_elapsed(model_var));
+		}
+
+		batch.clear();
+	}
 
-			if (FILTER_GRAD && !is_point_valid)
+	// Joins the A points in the linear positions (C order) [lo, hi) of A_LIMIT, in batches.
+	template <bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool COUNTERS, bool QUERY_TIMING, typename KDS>
+	static void join_points(JoinBatch<KDS>& batch, const TDVecFunc& a, const TDVecFunc& b,
+			TDJoinedVecFunc& res, const index& a_limit, unsigned long lo, unsigned long hi,
+			JoinCounters& c) {
+		index i_a;
+		for (unsigned long pos=lo; pos < hi; pos++) {
+			FastJoinFunc::unravel_index(pos, a_limit, i_a);
+			prepare_point<FILTER_GRAD, BRUTE_OPT, COUNTERS>(batch, a, b, res, i_a, c);
+			if (batch.full())
+				flush_batch<FILTER_GRAD, FILTER, BRUTE_OPT, COUNTERS, QUERY_TIMING>(batch, b, res, c);
+		}
+
+		flush_batch<FILTER_GRAD, FILTER, BRUTE_OPT, COUNTERS, QUERY_TIMING>(batch, b, res, c);
+	}
+
+	static void add_counters_stats(const JoinCounters& c, VCGStats* stats) {
+		unsigned long totalNonBruteForce = c.totalCount - c.bruteForceCount;
+		stats->expectedComparedPoints += (double)c.expected / (double)c.totalCount;
+		stats->comparedPoints += (double)c.actual / (double)totalNonBruteForce;
+		stats->comparedInBoundPoints = (double)c.actualInBound / (double)totalNonBruteForce;
+		stats->comparedEdgePoints = (double)c.actualEdge / (double)totalNonBruteForce;
+		stats->comparedBruteForce += (double)c.bruteForce / (double)c.bruteForceCount;
+		stats->bruteForceCount += (double)c.bruteForceCount;
+		stats->totalQueries += c.totalCount;
+	}
+
+	/*
+	 * Joins the A points in parallel on a work stealing pool.
+	 * The A index space is split into tasks of consecutive points (in C order).
+	 * Each worker has its own batch (copies of the DS for the query state) and its own result
+	 * buffer (worker 0 uses RES itself). The buffers are of the current JoinScratch scope, if any.
+	 * Ties are resolved in favor of the lowest A index (ORDERED), so merging the workers' results
+	 * yields the same result as the serial join, regardless of the tasks' distribution.
+	 */
+	template <bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool COUNTERS, bool QUERY_TIMING, typename KDS>
+	static void join_vecfunc_parallel(const KDS& r, const TDVecFunc& a, const TDVecFunc& b,
+			TDJoinedVecFunc& res, const index& a_limit, unsigned int threadCount, JoinCounters& c) {
+		WorkStealingPool::Shared pool = WorkStealingPool::shared(threadCount);
+
+		unsigned long a_count = a_limit.size();
+		unsigned long taskSize = a_count / (pool.size() * PARALLEL_TASKS_PER_WORKER);
+		if (taskSize < 1)
+			taskSize = 1;
+		unsigned int taskCount = (unsigned int)((a_count + taskSize - 1) / taskSize);
+		unsigned int workers = std::min(pool.size(), taskCount);
+
+		unsigned long res_vec_size = res.size.size();
+
+		std::vector<std::unique_ptr<JoinBatch<KDS>>> workerBatch(workers);
+		std::vector<JoinCounters> workerCounters(workers);
+		std::vector<std::unique_ptr<TDJoinedVecFunc>> workerRes(workers);
+		JoinScratch<T,D> localScratch;
+		JoinScratch<T,D>* scratch = JoinScratch<T,D>::current();
+		if (scratch == NULL)
+			scratch = &localScratch;
+
+		for (unsigned int w=0; w < workers; w++) {
+			workerBatch[w].reset(new JoinBatch<KDS>(r));
+			if (w == 0) {
+				workerRes[w].reset(new TDJoinedVecFunc(res.m, res.arg, res.size));
 				continue;
+			}
+			T* val;
+			index* arg;
+			scratch->get(w, res_vec_size, val, arg);
+			workerRes[w].reset(new TDJoinedVecFunc(val, arg, res.size));
+			FastJoinFunc::reset_result_array(*workerRes[w]);
+		}
 
-			upper.nextafter();
+		pool.run(taskCount, [&](unsigned int task, unsigned int w) {
+			unsigned long lo = task * taskSize;
+			unsigned long hi = std::min(lo + taskSize, a_count);
+			join_points<FILTER_GRAD, FILTER, BRUTE_OPT, COUNTERS, QUERY_TIMING>(*workerBatch[w],
+					a, b, *workerRes[w], a_limit, lo, hi, workerCounters[w]);
+		});
+
+		// Merge: each task owns a distinct slice of RES, so no synchronization is needed.
+		unsigned long sliceSize = (res_vec_size + taskCount - 1) / taskCount;
+		pool.run(taskCount, [&](unsigned int task, unsigned int) {
+			unsigned long lo = task * sliceSize;
+			unsigned long hi = std::min(lo + sliceSize, res_vec_size);
+			for (unsigned int w=1; w < workers; w++) {
+				for (unsigned long k=lo; k < hi; k++)
+					FastJoinFunc::merge_result_point(res, *workerRes[w], k);
+			}
+		});
 
-			if (COUNTERS)
-				totalCount++;
+		for (auto& wc : workerCounters)
+			c.add(wc);
+	}
 
-	        unsigned int maxPtsCount = r.query(upper);
-	        if (QUERY_TIMING)
-	        	STATS_ADD_TIME(stats_var, stats->dsQueryTime);
-	        if (COUNTERS)
-	        	expected += maxPtsCount;
+	// Joins A with the DS R (of type KDS, see KeyedDS), in parallel if THREAD_COUNT is not 1.
+	template <bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool COUNTERS, bool QUERY_TIMING, typename KDS>
+	static void join_keyed(const KDS& r, const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res,
+			const index& a_limit, unsigned int threadCount, JoinCounters& c) {
+		if (threadCount != 1) {
+			join_vecfunc_parallel<FILTER_GRAD, FILTER, BRUTE_OPT, COUNTERS, QUERY_TIMING>(r, a, b, res,
+					a_limit, threadCount, c);
+		} else {
+			JoinBatch<KDS> batch(r);
+			join_points<FILTER_GRAD, FILTER, BRUTE_OPT, COUNTERS, QUERY_TIMING>(batch, a, b, res,
+					a_limit, 0, a_limit.size(), c);
+		}
+	}
 
-	        if (BRUTE_OPT && maxPtsCount >= b_points_count) {
-				FastJoinFunc::join_val_inner(i_a, a_val, b, b_limit, res);
-				if (COUNTERS) {
-					bruteForce += b_points_count;
-					bruteForceCount++;
-				}
-	        } else {
-	        	if (QUERY_TIMING)
-	        		STATS_START(stats_var);
-				auto resCount = r.template fetchQuery<FILTER>(upper, resPts);
-				if (QUERY_TIMING)
-					STATS_ADD_TIME(stats_var, stats->dsQueryFetchTime);
-				if (COUNTERS) {
-					actual += resCount;
-					actualInBound += resCount;
-				}
+	template <bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool COUNTERS, bool BUILD_TIMING, bool QUERY_TIMING>
+	static void join_vecfunc(TDVecFunc& a, TDVecFunc& b, TDJoinedVecFunc& res,
+			unsigned int chunkSize, unsigned int threadCount, VCGStats* stats __attribute__((unused))) {
+		FastJoinFunc::reset_result_array(res);
+		a.fix_rising();
+		b.fix_rising();
+
+		DEBUG_OUTPUT("DS Build Start");
+		JoinDS r = cached_build_ds<FILTER_GRAD, BUILD_TIMING>(b, chunkSize, threadCount, stats);
+		DEBUG_OUTPUT("DS Build End");
 
-				for (unsigned i_p=0; i_p<resCount; i_p++) {
-					const TDPoint& p = *resPts[i_p];
-					if (COUNTERS && b.is_edge(p.val.ind))
-						actualEdge++;
+		JoinCounters c;
 
-					if (!p.val.ind.less(b_limit)) {
-						if (COUNTERS)
-							actualInBound--;
-						continue;
-					}
+		index a_limit;
+		a_limit = a.size;
+		a_limit.min(res.size);
 
-                    FastJoinFunc::join_val_check_point(i_a, a_val, p.val.ind, p.val.val, res);
-				}
-			}
+		if (r.narrow) {
+			join_keyed<FILTER_GRAD, FILTER, BRUTE_OPT, COUNTERS, QUERY_TIMING>(*r.narrow, a, b, res,
+					a_limit, threadCount, c);
+		} else {
+			join_keyed<FILTER_GRAD, FILTER, BRUTE_OPT, COUNTERS, QUERY_TIMING>(*r.wide, a, b, res,
+					a_limit, threadCount, c);
 		}
 
-		if (COUNTERS) {
-			unsigned long totalNonBruteForce = totalCount - bruteForceCount;
-			stats->expectedComparedPoints += (double)expected / (double)totalCount;
-			stats->comparedPoints += (double)actual / (double)totalNonBruteForce;
-			stats->comparedInBoundPoints = (double)actualInBound / (double)totalNonBruteForce;
-			stats->comparedEdgePoints = (double)actualEdge / (double)totalNonBruteForce;
-			stats->comparedBruteForce += (double)bruteForce / (double)bruteForceCount;
-			stats->bruteForceCount += (double)bruteForceCount;
-			stats->totalQueries += totalCount;
+		if (QUERY_TIMING) {
+			stats->dsQueryTime += c.queryTime;
+			stats->dsQueryFetchTime += c.queryFetchTime;
 		}
+
+		if (COUNTERS)
+			add_counters_stats(c, stats);
+		if (BRUTE_OPT)
+			c.model.add_stats(stats);
 	}
 };
 
@@ -0,0 +1,255 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JOIN_AUTOTUNE_HPP_
+#define JOIN_AUTOTUNE_HPP_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <type_traits>
+
+#include <debug.h>
+#include <stats.h>
+#include <vcg_stats.hpp>
+#include <thread_pool.hpp>
+#include <jointvecfunc.hpp>
+#include "brute_joinfunc.hpp"
+
+
+// The join method id that selects the method (and chunk size) by probing (see JoinAutoTune).
+#define JOIN_VECFUNC_AUTO (100)
+
+// The probed methods: the brute force and the DS methods.
+#define JOIN_VECFUNC_AUTO_CANDIDATES {0, 1, 2, 3, 4, 5, 6, 7, 8, 9}
+// The chunk sizes that are probed for the selected DS (in addition to the caller's).
+#define JOIN_VECFUNC_AUTO_CHUNK_SIZES {4, 16, 64, 256}
+
+// The A points that are sampled by a probe: slices of consecutive points, spread over A.
+#define JOIN_VECFUNC_AUTO_SAMPLE_SLICES (8)
+#define JOIN_VECFUNC_AUTO_SLICE_SIZE (32)
+
+// The environment variable of the tuning file. Unset (or empty) keeps the decisions in memory.
+#define JOIN_TUNING_FILE_ENV "VECFUNC_VCG_TUNING_FILE"
+
+
+/*
+ * The tuning decisions: a method and a chunk size per key.
+ * The decisions are kept in memory. If a tuning file is set (JOIN_TUNING_FILE_ENV), they are
+ * loaded from it on first use, and each new decision is appended to it, so later runs skip the
+ * probing. Each line is "<key> <method> <chunk size>" (the last line of a key wins).
+ */
+class JoinTuningFile {
+public:
+	typedef struct {
+		unsigned int method;
+		unsigned int chunkSize;
+	} Decision;
+
+	static std::string path() {
+		const char* env = std::getenv(JOIN_TUNING_FILE_ENV);
+		return env == NULL ? "" : env;
+	}
+
+	static bool lookup(const std::string& key, Decision& decision) {
+		std::lock_guard<std::mutex> guard(lock());
+		auto& t = table();
+		auto it = t.find(key);
+		if (it == t.end())
+			return false;
+		decision = it->second;
+		return true;
+	}
+
+	static void store(const std::string& key, const Decision& decision) {
+		std::lock_guard<std::mutex> guard(lock());
+		table()[key] = decision;
+
+		std::string p = path();
+		if (p.empty())
+			return;
+		std::ofstream f(p, std::ios::app);
+		if (!f) {
+			DEBUG_OUTPUT("Cannot write the tuning file: " << p);
+			return;
+		}
+		f << key << " " << decision.method << " " << decision.chunkSize << std::endl;
+	}
+
+private:
+	static std::mutex& lock() {
+		static std::mutex m;
+		return m;
+	}
+
+	static std::map<std::string, Decision>& table() {
+		static std::map<std::string, Decision> t;
+		static bool loaded = false;
+		if (loaded)
+			return t;
+		loaded = true;
+
+		std::string p = path();
+		if (p.empty())
+			return t;
+		std::ifstream f(p);
+		std::string line, key;
+		Decision decision;
+		while (std::getline(f, line)) {
+			std::istringstream s(line);
+			if (s >> key >> decision.method >> decision.chunkSize)
+				t[key] = decision;
+		}
+		return t;
+	}
+};
+
+
+/*
+ * Probes of the join methods.
+ *
+ * A probe joins a sample of the A points (into RES, which the selected method resets), and
+ * estimates the runtime of the full join: the DS build time, and the sample query time scaled
+ * to all the A points. The probes are single threaded and without statistics.
+ */
+template <typename T, unsigned int D, unsigned int G = 1>
+class JoinAutoTune {
+public:
+	using Brute = BruteForceJoinFunc<T,D>;
+	using TDVecFunc = VecFunc<T,D>;
+	using TDJoinedVecFunc = JointVecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	static unsigned int log2_bucket(unsigned long v) {
+		unsigned int ret = 0;
+		while (v > 1) {
+			v >>= 1;
+			ret++;
+		}
+		return ret;
+	}
+
+	// E.g., "d2:i32:fg1:f1:bo0:a10:b12:c8:t2" (the sizes and the thread count are in log2 buckets,
+	// the chunk size is the caller's).
+	template<bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool ... REST>
+	static std::string key(const TDVecFunc& a, const TDVecFunc& b, const TDJoinedVecFunc& res,
+			unsigned int chunkSize, unsigned int threadCount) {
+		if (threadCount == 0)
+			threadCount = WorkStealingPool::defaultThreadCount();
+		index a_limit;
+		a_limit = a.size;
+		a_limit.min(res.size);
+
+		char kind = std::is_floating_point<T>::value ? 'f' : (std::is_signed<T>::value ? 'i' : 'u');
+		std::ostringstream s;
+		s << "d" << D << ":" << kind << sizeof(T) * 8 << ":fg" << (FILTER_GRAD ? 1 : 0)
+		  << ":f" << (FILTER ? 1 : 0) << ":bo" << (BRUTE_OPT ? 1 : 0)
+		  << ":a" << log2_bucket(a_limit.size()) << ":b" << log2_bucket(b.total_size())
+		  << ":c" << chunkSize << ":t" << log2_bucket(threadCount);
+		return s.str();
+	}
+
+	// Calls F(lo, hi) for each sampled slice of the linear positions [0, A_COUNT).
+	// Returns the number of sampled positions.
+	template<typename F>
+	static unsigned long for_each_slice(unsigned long a_count, F f) {
+		unsigned long slices = JOIN_VECFUNC_AUTO_SAMPLE_SLICES;
+		unsigned long sliceSize = JOIN_VECFUNC_AUTO_SLICE_SIZE;
+		if (a_count <= slices * sliceSize) {
+			f(0ul, a_count);
+			return a_count;
+		}
+
+		unsigned long sampled = 0;
+		for (unsigned long s=0; s < slices; s++) {
+			unsigned long lo = s * (a_count - sliceSize) / (slices - 1);
+			f(lo, lo + sliceSize);
+			sampled += sliceSize;
+		}
+		return sampled;
+	}
+
+	static double probe_brute(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res) {
+		index a_limit, i_a, b_limit;
+		a_limit = a.size;
+		a_limit.min(res.size);
+		unsigned long a_count = a_limit.size();
+		if (a_count == 0)
+			return 0;
+
+		double queryTime = 0;
+		STATS_INIT(start_time);
+		STATS_START(start_time);
+		unsigned long sampled = for_each_slice(a_count, [&] (unsigned long lo, unsigned long hi) {
+			for (unsigned long pos=lo; pos < hi; pos++) {
+				Brute::unravel_index(pos, a_limit, i_a);
+				vec_dec(res.size, i_a, b_limit);
+				b_limit.min(b.size);
+				Brute::join_val_inner(i_a, a[i_a], b, b_limit, res);
+			}
+		});
+		STATS_ADD_TIME(start_time, queryTime);
+
+		return queryTime * (double)a_count / (double)sampled;
+	}
+
+	template<typename FAST, bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool ... REST>
+	static double probe_fast(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res,
+			unsigned int chunkSize) {
+		index a_limit;
+		a_limit = a.size;
+		a_limit.min(res.size);
+		unsigned long a_count = a_limit.size();
+
+		double buildTime = 0, queryTime = 0;
+		VCGStats probeStats;
+		STATS_INIT(start_time);
+		STATS_START(start_time);
+		auto r = FAST::template build_ds<FILTER_GRAD, false>(b, chunkSize, 1, &probeStats);
+		STATS_ADD_TIME(start_time, buildTime);
+		if (a_count == 0)
+			return buildTime;
+
+		STATS_START(start_time);
+		unsigned long sampled = r.narrow ?
+				probe_keyed<FAST, FILTER_GRAD, FILTER, BRUTE_OPT>(*r.narrow, a, b, res, a_limit) :
+				probe_keyed<FAST, FILTER_GRAD, FILTER, BRUTE_OPT>(*r.wide, a, b, res, a_limit);
+		STATS_ADD_TIME(start_time, queryTime);
+
+		return buildTime + queryTime * (double)a_count / (double)sampled;
+	}
+
+	// Joins the sampled slices with the DS R (see FastJoinFunc::KeyedDS).
+	// Returns the number of sampled positions.
+	template<typename FAST, bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, typename KDS>
+	static unsigned long probe_keyed(const KDS& r, const TDVecFunc& a, const TDVecFunc& b,
+			TDJoinedVecFunc& res, const index& a_limit) {
+		typename FAST::template JoinBatch<KDS> batch(r);
+		typename FAST::JoinCounters c;
+		return for_each_slice(a_limit.size(), [&] (unsigned long lo, unsigned long hi) {
+			FAST::template join_points<FILTER_GRAD, FILTER, BRUTE_OPT, false, false>(batch, a, b,
+					res, a_limit, lo, hi, c);
+		});
+	}
+};
+
+
+#endif /* JOIN_AUTOTUNE_HPP_ */
@@ -0,0 +1,172 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JOIN_COST_MODEL_HPP_
+#define JOIN_COST_MODEL_HPP_
+
+#include <cmath>
+
+#include <debug.h>
+#include <stats.h>
+#include <vcg_stats.hpp>
+#include <upper_bound_ds.hpp>
+
+
+// The initial costs (nanoseconds). They match the former fixed rules: brute force below 64
+// cells, and brute force if the query may fetch as many points as the cells.
+#define COST_MODEL_BRUTE_CELL_NS (1.0)
+#define COST_MODEL_QUERY_NS (64.0)
+#define COST_MODEL_FETCH_POINT_NS (1.0)
+
+// The weight of the initial costs, in units (cells, queries or points) of measurements.
+#define COST_MODEL_PRIOR_UNITS (64.0)
+
+// One of every COST_MODEL_SAMPLE_INTERVAL batches is timed.
+#define COST_MODEL_SAMPLE_INTERVAL (8)
+
+
+/*
+ * Online cost model of a fast join (BRUTE_OPT).
+ *
+ * The costs of a brute force cell, of a DS query and of a fetched point are calibrated during
+ * the join, by timing a sample of the batches. Each A point is then joined by the cheapest
+ * predicted way:
+ *  - Brute force, without a query, if the box is cheaper than a query.
+ *  - Otherwise, the DS is queried with a budget: the candidates count above which a brute
+ *    force of the box is predicted to be cheaper than fetching them. If the query exceeds its
+ *    budget, it is stopped and the box is brute forced (the hybrid). Otherwise, the candidates
+ *    are fetched.
+ * Each worker has its own model (in its JoinCounters).
+ *
+ * Without FILTER_GRAD, the brute force and the fetch find the same maximum with the same tie
+ * rule (see FastJoinFunc), so the decisions, which depend on the timing, do not change the result.
+ * With FILTER_GRAD, the brute force also joins the flat B points (which are not in the DS), so
+ * the model is not calibrated: it keeps its initial costs, and its decisions depend only on the
+ * counts (the cells of the box and the candidates of the query).
+ */
+class JoinCostModel {
+public:
+	double bruteTime = 0;
+	unsigned long bruteCells = 0;
+	double queryTime = 0;
+	unsigned long queries = 0;
+	double fetchTime = 0;
+	unsigned long fetchPoints = 0;
+
+	unsigned long bruteDecisions = 0;
+	unsigned long queryBruteDecisions = 0;
+	unsigned long fetchDecisions = 0;
+
+	unsigned long batchCount = 0;
+
+	static inline double estimate(double time, unsigned long units, double initial) {
+		return (time * 1e9 + COST_MODEL_PRIOR_UNITS * initial) / ((double)units + COST_MODEL_PRIOR_UNITS);
+	}
+
+	double brute_cell_ns() const {
+		return estimate(bruteTime, bruteCells, COST_MODEL_BRUTE_CELL_NS);
+	}
+
+	double query_ns() const {
+		return estimate(queryTime, queries, COST_MODEL_QUERY_NS);
+	}
+
+	double fetch_point_ns() const {
+		return estimate(fetchTime, fetchPoints, COST_MODEL_FETCH_POINT_NS);
+	}
+
+	// Returns true if the next batch should be timed.
+	inline bool next_batch() {
+		return (batchCount++ % COST_MODEL_SAMPLE_INTERVAL) == 0;
+	}
+
+	// Before the query: brute force a box of CELLS?
+	inline bool brute_before_query(unsigned long cells) {
+		bool ret = (double)cells * brute_cell_ns() < query_ns();
+		if (ret)
+			bruteDecisions++;
+		return ret;
+	}
+
+	/*
+	 * The maximal number of candidates that is still cheaper to fetch than to brute force a box
+	 * of CELLS: the budget of its query. A query over the budget is not finished.
+	 */
+	inline unsigned int fetch_budget(unsigned long cells) const {
+		double budget = std::ceil((double)cells * brute_cell_ns() / fetch_point_ns()) - 1;
+		if (!(budget > 0))
+			return 0;
+		if (budget >= QUERY_NO_BUDGET)
+			return QUERY_NO_BUDGET;
+		return (unsigned int)budget;
+	}
+
+	/*
+	 * After the query: brute force a box of CELLS, instead of fetching up to PTS_COUNT points?
+	 * An over budget query (QUERY_OVER_BUDGET) is always brute forced.
+	 */
+	inline bool brute_after_query(unsigned long cells, unsigned long ptsCount) {
+		bool ret = ptsCount == QUERY_OVER_BUDGET ||
+				(double)cells * brute_cell_ns() <= (double)ptsCount * fetch_point_ns();
+		if (ret)
+			queryBruteDecisions++;
+		else
+			fetchDecisions++;
+		return ret;
+	}
+
+	void add_brute(unsigned long cells, double time) {
+		bruteCells += cells;
+		bruteTime += time;
+	}
+
+	void add_query(unsigned long count, double time) {
+		queries += count;
+		queryTime += time;
+	}
+
+	void add_fetch(unsigned long ptsCount, double time) {
+		fetchPoints += ptsCount;
+		fetchTime += time;
+	}
+
+	void add(const JoinCostModel& o) {
+		bruteTime += o.bruteTime;
+		bruteCells += o.bruteCells;
+		queryTime += o.queryTime;
+		queries += o.queries;
+		fetchTime += o.fetchTime;
+		fetchPoints += o.fetchPoints;
+		bruteDecisions += o.bruteDecisions;
+		queryBruteDecisions += o.queryBruteDecisions;
+		fetchDecisions += o.fetchDecisions;
+	}
+
+	// The costs are per unit, so they are of the last join (and not summed over the joins).
+	void add_stats(VCGStats* stats) const {
+		stats->costBruteCellNs = brute_cell_ns();
+		stats->costQueryNs = query_ns();
+		stats->costFetchPointNs = fetch_point_ns();
+		stats->costBruteDecisions += bruteDecisions;
+		stats->costQueryBruteDecisions += queryBruteDecisions;
+		stats->costFetchDecisions += fetchDecisions;
+	}
+};
+
+
+#endif /* JOIN_COST_MODEL_HPP_ */
@@ -19,12 +19,23 @@
 #ifndef JOINFUNC_HPP
 #define JOINFUNC_HPP
 
+#include <vector>
+
 #include <debug.h>
 
 #include <jointvecfunc.hpp>
 #include <vcg_stats.hpp>
 #include "brute_joinfunc.hpp"
 #include "fast_joinfunc.hpp"
+#include "ds_cache.hpp"
+#include "tiled_joinfunc.hpp"
+#include "pruned_joinfunc.hpp"
+#include "sweep_joinfunc.hpp"
+#include "concave_joinfunc.hpp"
+#include "lconcave_joinfunc.hpp"
+#include "separable_joinfunc.hpp"
+#include "max_joinfunc.hpp"
+#include "join_autotune.hpp"
 
 #include <upper_bound_ds.hpp>
 #include <binary_search_tree.hpp>
@@ -32,16 +43,46 @@
 #include <multi_binary_search_tree.hpp>
 #include <category_tree.hpp>
 
-//#include <upper_bound_transformed.hpp>
-//#include <upper_bound_scalar.hpp>
-//#include <upper_bound_randtree.hpp>
+
+// The DS of a join that exceeds the memory budget is built with a larger chunk size (doubled up
+// to this size), and then falls back to the leaner methods in order: fewer sub-dims, the lean
+// tree, the K-D tree and the simple DS. The last resort is the brute force (no DS).
+#define JOIN_VECFUNC_MEMORY_MAX_CHUNK_SIZE (256)
+#define JOIN_VECFUNC_MEMORY_FALLBACKS {9, 8, 16, 6, 1}
+
+// The method of the functions that are out of the domain of an engine (see SerialJoinFunc).
+#define JOIN_VECFUNC_DOMAIN_FALLBACK (7)
 
 
 #define JOIN_VECFUNC_CASE(id, DS, DESC) \
     case (id): \
         DEBUG_OUTPUT("USING: " << #DS); \
         stats->method = #DESC; \
-        FastJoinFunc<T,D,DS,G>::template join_vecfunc<FLAGS...>(a, b, res, chunkSize, stats); \
+        FastJoinFunc<T,D,DS,G>::template join_vecfunc<FLAGS...>(a, b, res, chunkSize, threadCount, stats); \
+        break
+
+#define JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC) \
+    case (id): \
+        DEBUG_OUTPUT("USING: " << #ENGINE); \
+        stats->method = #DESC; \
+        ENGINE<T,D>::template join_vecfunc<true>(a, b, res, threadCount, stats); \
+        break
+
+#define JOIN_VECFUNC_FAST_ENGINE_CASE(id, ENGINE, DESC) \
+    case (id): \
+        DEBUG_OUTPUT("USING: " << #ENGINE); \
+        stats->method = #DESC; \
+        ENGINE<T,D,G>::template join_vecfunc<FLAGS...>(a, b, res, chunkSize, threadCount, stats); \
+        break
+
+// Out of the domain, the fallback is selected within the memory budget, as any other method.
+#define JOIN_VECFUNC_DOMAIN_ENGINE_CASE(id, ENGINE, DESC) \
+    case (id): \
+        DEBUG_OUTPUT("USING: " << #ENGINE); \
+        stats->method = #DESC; \
+        if (!ENGINE<T,D,G>::join_domain(a, b, res, threadCount, stats)) \
+            join_vecfunc_method<T, D, G, FLAGS...>(a, b, res, JOIN_VECFUNC_DOMAIN_FALLBACK, chunkSize, \
+                    threadCount, memoryBudget, stats); \
         break
 
 
@@ -53,7 +94,14 @@
 		JOIN_VECFUNC_CASE(5, CategoryTree, Category Tree); \
         JOIN_VECFUNC_CASE(6, KDTreeFull, K-D Tree); \
         JOIN_VECFUNC_CASE(7, MultiBinarySearchTreeFull, Multi 2D Binary Search Tree (Full)); \
-        JOIN_VECFUNC_CASE(8, MultiBinarySearchTreeSingle, Multi 2D Binary Search Tree (Single));
+        JOIN_VECFUNC_CASE(8, MultiBinarySearchTreeSingle, Multi 2D Binary Search Tree (Single)); \
+        JOIN_VECFUNC_ENGINE_CASE(10, TiledBruteForceJoinFunc, Tiled Brute Force); \
+        JOIN_VECFUNC_FAST_ENGINE_CASE(11, SweepJoinFunc, Offline Sweep); \
+        JOIN_VECFUNC_DOMAIN_ENGINE_CASE(12, Concave1DJoinFunc, 1D Concave); \
+        JOIN_VECFUNC_DOMAIN_ENGINE_CASE(13, LNaturalJoinFunc, L-natural Concave); \
+        JOIN_VECFUNC_DOMAIN_ENGINE_CASE(14, SeparableJoinFunc, Separable); \
+        JOIN_VECFUNC_ENGINE_CASE(15, PrunedBruteForceJoinFunc, Pruned Brute Force); \
+        JOIN_VECFUNC_CASE(16, MultiBinarySearchTreeLean, Multi 2D Binary Search Tree (Lean));
 
 #if DIM > 1 || POINT_WITH_IND
 #define JOIN_VECFUNC_ALL_CASES \
@@ -67,15 +115,52 @@
 
 
 
+template<typename T, unsigned int D, unsigned int G, bool ... FLAGS>
+static void join_vecfunc_auto_select(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>& res,
+		unsigned int& method, unsigned int& chunkSize, unsigned int threadCount, unsigned long memoryBudget);
+
+template<typename T, unsigned int D, unsigned int G>
+static void join_vecfunc_memory_select(const VecFunc<T, D>& b, unsigned int& method,
+		unsigned int& chunkSize, unsigned long memoryBudget, VCGStats* stats);
+
+template<typename T, unsigned int D, unsigned int G, bool ... FLAGS>
+static void join_vecfunc_method(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>& res,
+		unsigned int method, unsigned int chunkSize, unsigned int threadCount, unsigned long memoryBudget,
+		VCGStats* stats);
+
+
+/*
+ * MEMORY_BUDGET limits the bytes of the DS of B (see JoinDS::memoryFootprint()), and of the
+ * DS cache (see DSCacheControl). Zero means no limit.
+ */
 template<typename T, unsigned int D, unsigned int G = 1, bool ... FLAGS>
 static void join_vecfunc(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>& res,
-		unsigned int method __attribute__((unused)), unsigned int chunkSize,
-		VCGStats* stats __attribute__((unused))) {
+		unsigned int method __attribute__((unused)), unsigned int chunkSize, unsigned int threadCount,
+		unsigned long memoryBudget, VCGStats* stats __attribute__((unused))) {
 	using namespace UpperBoundDS;
 
 	STATS_INIT(start_time);
 	STATS_START(start_time);
 
+	if (method == JOIN_VECFUNC_AUTO)
+		join_vecfunc_auto_select<T, D, G, FLAGS...>(a, b, res, method, chunkSize, threadCount, memoryBudget);
+	join_vecfunc_method<T, D, G, FLAGS...>(a, b, res, method, chunkSize, threadCount, memoryBudget, stats);
+
+    STATS_ADD_TIME(start_time, stats->totalRuntime);
+	stats->joinedFuncCount++;
+}
+
+
+// Joins A and B by METHOD, or by its replacement within MEMORY_BUDGET (see join_vecfunc()).
+template<typename T, unsigned int D, unsigned int G, bool ... FLAGS>
+static void join_vecfunc_method(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>& res,
+		unsigned int method, unsigned int chunkSize, unsigned int threadCount, unsigned long memoryBudget,
+		VCGStats* stats) {
+	using namespace UpperBoundDS;
+
+	join_vecfunc_memory_select<T, D, G>(b, method, chunkSize, memoryBudget, stats);
+	DSCacheControl::BudgetScope cacheBudget(memoryBudget);
+
     switch(method) {
     	JOIN_VECFUNC_ALL_CASES
 
@@ -86,9 +171,39 @@ static void join_vecfunc(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>&
 			BruteForceJoinFunc<T,D>::template join_vecfunc<true>(a, b, res, stats);
             break;
     }
+}
 
-    STATS_ADD_TIME(start_time, stats->totalRuntime);
+
+/*
+ * Joins a chain of functions: RES[k] = FUNCS[0] (+) ... (+) FUNCS[k+1].
+ * Each join uses the previous result (in the caller's memory) as its first function, and
+ * writes its statistics to STATS[k]. The joins share their scratch buffers (see JoinScratch).
+ */
+template<typename T, unsigned int D, unsigned int G = 1, bool ... FLAGS>
+static void join_chain(std::vector<VecFunc<T, D>>& funcs, std::vector<JointVecFunc<T, D>>& res,
+		unsigned int method, unsigned int chunkSize, unsigned int threadCount, unsigned long memoryBudget,
+		VCGStats* stats) {
+	typename JoinScratch<T, D>::Scope scratch;
+	for (unsigned int k=0; k < res.size() && k+1 < funcs.size(); k++) {
+		VecFunc<T, D>& a = k == 0 ? funcs[0] : res[k-1];
+		join_vecfunc<T, D, G, FLAGS...>(a, funcs[k+1], res[k], method, chunkSize, threadCount,
+				memoryBudget, stats + k);
+	}
+}
+
+
+template<typename T, unsigned int D>
+static T join_vecfunc_max(const VecFunc<T, D>& a, const VecFunc<T, D>& b,
+		const typename VecFunc<T, D>::index& res_size, VCGStats* stats) {
+	STATS_INIT(start_time);
+	STATS_START(start_time);
+
+	stats->method = "Max Only";
+	T ret = MaxJoinFunc<T,D>::join_max(a, b, res_size, stats);
+
+	STATS_ADD_TIME(start_time, stats->totalRuntime);
 	stats->joinedFuncCount++;
+	return ret;
 }
 
 
@@ -97,9 +212,22 @@ static void join_vecfunc(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>&
     case (id): \
         DEBUG_OUTPUT("USING: " << #DS); \
         stats->method = #DESC; \
-        FastJoinFunc<T,D,DS,G>::template build_ds<false, true>(v, chunkSize, stats); \
+        FastJoinFunc<T,D,DS,G>::template build_ds<false, true>(v, chunkSize, 1, stats); \
+        break
+
+// Engines without a data structure have nothing to build.
+#undef JOIN_VECFUNC_ENGINE_CASE
+#define JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC) \
+    case (id): \
+        DEBUG_OUTPUT("No output"); \
         break
 
+#undef JOIN_VECFUNC_FAST_ENGINE_CASE
+#define JOIN_VECFUNC_FAST_ENGINE_CASE(id, ENGINE, DESC) JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC)
+
+#undef JOIN_VECFUNC_DOMAIN_ENGINE_CASE
+#define JOIN_VECFUNC_DOMAIN_ENGINE_CASE(id, ENGINE, DESC) JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC)
+
 
 template<typename T, unsigned int D, unsigned int G = 1>
 static void test_ds_build_time(const VecFunc<T, D>& v, unsigned int method, unsigned int chunkSize, VCGStats* stats) {
@@ -122,4 +250,203 @@ static void test_ds_build_time(const VecFunc<T, D>& v, unsigned int method, unsi
 }
 
 
+#undef JOIN_VECFUNC_CASE
+#define JOIN_VECFUNC_CASE(id, DS, DESC) \
+    case (id): \
+        ret = FastJoinFunc<T,D,DS,G>::JoinDS::estimateFootprint(size, chunkSize); \
+        break
+
+#undef JOIN_VECFUNC_ENGINE_CASE
+#define JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC) \
+    case (id): \
+        ret = ENGINE<T,D>::estimateFootprint(size, chunkSize); \
+        break
+
+#undef JOIN_VECFUNC_FAST_ENGINE_CASE
+#define JOIN_VECFUNC_FAST_ENGINE_CASE(id, ENGINE, DESC) \
+    case (id): \
+        ret = ENGINE<T,D,G>::estimateFootprint(size, chunkSize); \
+        break
+
+#undef JOIN_VECFUNC_DOMAIN_ENGINE_CASE
+#define JOIN_VECFUNC_DOMAIN_ENGINE_CASE(id, ENGINE, DESC) JOIN_VECFUNC_FAST_ENGINE_CASE(id, ENGINE, DESC)
+
+
+/*
+ * The estimated bytes of the DS of METHOD for SIZE points of B (zero for the brute force).
+ * The engines estimate the structures they build on B. The engines of a domain build none (their
+ * fallback is estimated when it is selected, see JOIN_VECFUNC_DOMAIN_ENGINE_CASE).
+ */
+template<typename T, unsigned int D, unsigned int G = 1>
+static unsigned long join_vecfunc_estimate(unsigned int method, unsigned int size, unsigned int chunkSize) {
+	using namespace UpperBoundDS;
+
+	unsigned long ret = 0;
+    switch(method) {
+    	JOIN_VECFUNC_ALL_CASES
+
+        case 0:
+        default:
+            break;
+    }
+    return ret;
+}
+
+
+#undef JOIN_VECFUNC_CASE
+#define JOIN_VECFUNC_CASE(id, DS, DESC) \
+    case (id): \
+        cost = Tune::template probe_fast<FastJoinFunc<T,D,DS,G>, FLAGS...>(a, b, res, chunkSize); \
+        break
+
+// Only the DS methods are probed.
+#undef JOIN_VECFUNC_ENGINE_CASE
+#define JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC) \
+    case (id): \
+        break
+
+#undef JOIN_VECFUNC_FAST_ENGINE_CASE
+#define JOIN_VECFUNC_FAST_ENGINE_CASE(id, ENGINE, DESC) JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC)
+
+#undef JOIN_VECFUNC_DOMAIN_ENGINE_CASE
+#define JOIN_VECFUNC_DOMAIN_ENGINE_CASE(id, ENGINE, DESC) JOIN_VECFUNC_ENGINE_CASE(id, ENGINE, DESC)
+
+
+// The estimated runtime (seconds) of a join by METHOD, or a negative value if it is not probed.
+template<typename T, unsigned int D, unsigned int G = 1, bool ... FLAGS>
+static double join_vecfunc_probe(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>& res,
+		unsigned int method, unsigned int chunkSize) {
+	using namespace UpperBoundDS;
+	using Tune = JoinAutoTune<T,D,G>;
+
+	double cost = -1;
+    switch(method) {
+    	JOIN_VECFUNC_ALL_CASES
+
+        case 0:
+        	cost = Tune::probe_brute(a, b, res);
+            break;
+
+        default:
+            break;
+    }
+
+    DEBUG_OUTPUT("Probe method " << method << " (chunk " << chunkSize << "): " << cost);
+    return cost;
+}
+
+
+/*
+ * Replaces the auto METHOD by the fastest candidate (JOIN_VECFUNC_AUTO_CANDIDATES) and its
+ * fastest CHUNK_SIZE (JOIN_VECFUNC_AUTO_CHUNK_SIZES). The decision is kept per dim, type, size
+ * bucket, chunk size and thread count bucket (see JoinTuningFile), so the probing is done once
+ * per bucket. The probes are single threaded, so the decisions of the thread counts are apart.
+ * The candidates that exceed MEMORY_BUDGET are not probed, and then the decision is not kept.
+ * The candidates are probed on rising copies of the input functions (as the fast methods join
+ * them), so the input functions are left as is if the brute force is selected.
+ */
+template<typename T, unsigned int D, unsigned int G, bool ... FLAGS>
+static void join_vecfunc_auto_select(VecFunc<T, D>& a, VecFunc<T, D>& b, JointVecFunc<T, D>& res,
+		unsigned int& method, unsigned int& chunkSize, unsigned int threadCount, unsigned long memoryBudget) {
+	using Tune = JoinAutoTune<T,D,G>;
+
+	std::string key = Tune::template key<FLAGS...>(a, b, res, chunkSize, threadCount);
+	JoinTuningFile::Decision decision;
+	if (JoinTuningFile::lookup(key, decision)) {
+		method = decision.method;
+		chunkSize = decision.chunkSize;
+		return;
+	}
+
+	std::vector<T> aVal(a.m, a.m + a.total_size());
+	std::vector<T> bVal(b.m, b.m + b.total_size());
+	VecFunc<T, D> aRising(aVal.data(), a.size);
+	VecFunc<T, D> bRising(bVal.data(), b.size);
+	aRising.fix_rising();
+	bRising.fix_rising();
+
+	unsigned int size = b.total_size();
+	bool skipped = false;
+	auto overBudget = [&] (unsigned int m, unsigned int chunk) {
+		bool ret = memoryBudget > 0 && join_vecfunc_estimate<T, D, G>(m, size, chunk) > memoryBudget;
+		skipped = skipped || ret;
+		return ret;
+	};
+
+	decision.method = 0;
+	decision.chunkSize = chunkSize;
+	double best = -1;
+	for (unsigned int m : JOIN_VECFUNC_AUTO_CANDIDATES) {
+		if (overBudget(m, chunkSize))
+			continue;
+		double cost = join_vecfunc_probe<T, D, G, FLAGS...>(aRising, bRising, res, m, chunkSize);
+		if (cost >= 0 && (best < 0 || cost < best)) {
+			best = cost;
+			decision.method = m;
+		}
+	}
+
+	if (decision.method != 0) {
+		for (unsigned int chunk : JOIN_VECFUNC_AUTO_CHUNK_SIZES) {
+			if (chunk == chunkSize || overBudget(decision.method, chunk))
+				continue;
+			double cost = join_vecfunc_probe<T, D, G, FLAGS...>(aRising, bRising, res, decision.method,
+					chunk);
+			if (cost >= 0 && cost < best) {
+				best = cost;
+				decision.chunkSize = chunk;
+			}
+		}
+	}
+
+	DEBUG_OUTPUT("Auto: " << key << " -> method " << decision.method << " (chunk " << decision.chunkSize << ")");
+	if (!skipped)
+		JoinTuningFile::store(key, decision);
+	method = decision.method;
+	chunkSize = decision.chunkSize;
+}
+
+
+/*
+ * Replaces METHOD and CHUNK_SIZE if the DS of B does not fit MEMORY_BUDGET (see
+ * JOIN_VECFUNC_MEMORY_FALLBACKS). The replacement is recorded in the statistics.
+ */
+template<typename T, unsigned int D, unsigned int G>
+static void join_vecfunc_memory_select(const VecFunc<T, D>& b, unsigned int& method,
+		unsigned int& chunkSize, unsigned long memoryBudget, VCGStats* stats) {
+	if (memoryBudget == 0)
+		return;
+
+	unsigned int size = b.total_size();
+	std::vector<unsigned int> methods = JOIN_VECFUNC_MEMORY_FALLBACKS;
+	methods.insert(methods.begin(), method);
+	// A zero chunk size is built as a chunk of one point.
+	unsigned int effectiveChunkSize = std::max(chunkSize, 1u);
+	unsigned int fallbackMethod = 0, fallbackChunkSize = effectiveChunkSize;
+	bool found = false;
+	for (unsigned int i=0; i < methods.size() && !found; i++) {
+		for (unsigned int chunk = effectiveChunkSize; !found; chunk *= 2) {
+			if (join_vecfunc_estimate<T, D, G>(methods[i], size, chunk) <= memoryBudget) {
+				fallbackMethod = methods[i];
+				fallbackChunkSize = chunk;
+				found = true;
+			} else if (chunk >= JOIN_VECFUNC_MEMORY_MAX_CHUNK_SIZE) {
+				break;
+			}
+		}
+	}
+
+	if (fallbackMethod == method && fallbackChunkSize == effectiveChunkSize)
+		return;
+
+	DEBUG_OUTPUT("Memory budget " << memoryBudget << ": method " << method << " (chunk " << chunkSize
+			<< ") -> method " << fallbackMethod << " (chunk " << fallbackChunkSize << ")");
+	method = fallbackMethod;
+	chunkSize = fallbackChunkSize;
+	stats->memoryFallbacks++;
+	stats->memoryFallbackMethod = method;
+	stats->memoryFallbackChunkSize = chunkSize;
+}
+
+
 #endif //JOINFUNC_HPP
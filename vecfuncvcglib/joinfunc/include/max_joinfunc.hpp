@@ -0,0 +1,110 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef MAX_JOINFUNC_HPP_
+#define MAX_JOINFUNC_HPP_
+
+#include <vector>
+#include <algorithm>
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <jointvecfunc.hpp>
+
+
+/*
+ * Max only join: the maximal value of the joined function (in RES_SIZE), without the RES and
+ * ARG arrays. Used when only the maximal social welfare is needed (e.g., the VCG payments).
+ *
+ * The best B partner of A point i is the maximum of B in the box [0, RES_SIZE - i), which is
+ * the prefix maximum of B at the corner of the box. So B is replaced by its prefix maximums,
+ * and each A point takes a single lookup. An A point that cannot beat the current best, even
+ * with the maximal B value, is skipped.
+ *
+ * As the maximum of RES in the other methods, the result is zero if no sum is positive.
+ */
+template <typename T, unsigned int D>
+class MaxJoinFunc {
+public:
+	static const unsigned int dim = D;
+
+	using TDVecFunc = VecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	// PM[i] = max(B[j]) for all j <= i (per dim).
+	static void prefix_max(const TDVecFunc& b, std::vector<T>& pm) {
+		auto b_vec_size = b.total_size();
+		pm.assign(b.m, b.m + b_vec_size);
+
+		unsigned long stride[D];
+		unsigned long s = 1;
+		for (unsigned int d=D; d-- > 0;) {
+			stride[d] = s;
+			s *= b.size[d];
+		}
+
+		// Lexicographic order: the predecessors of a cell already hold their prefix maximum.
+		index i;
+		FOR_EACH_INDEX(i, b.size) {
+			auto ind = b.get_index(i);
+			FOR_EACH_DIM(d) {
+				if (i[d] > 0)
+					pm[ind] = std::max(pm[ind], pm[ind - stride[d]]);
+			}
+		}
+	}
+
+	static T join_max(const TDVecFunc& a, const TDVecFunc& b, const index& res_size,
+			VCGStats* stats __attribute__((unused))) {
+		T best = 0;
+		if (a.total_size() == 0 || b.total_size() == 0 || res_size.size() == 0)
+			return best;
+
+		std::vector<T> pm;
+		prefix_max(b, pm);
+		T b_max = pm.back();
+
+		unsigned long skipped = 0;
+		index i_a, a_limit, b_corner;
+		a_limit = a.size;
+		a_limit.min(res_size);
+		FOR_EACH_INDEX(i_a, a_limit) {
+			auto a_val = a[i_a];
+			if (!(best < a_val + b_max)) {
+				skipped++;
+				continue;
+			}
+
+			vec_dec(res_size, i_a, b_corner);
+			b_corner.min(b.size);
+			FOR_EACH_DIM(d)
+				b_corner[d]--;
+
+			auto val = a_val + pm[b.get_index(b_corner)];
+			if (best < val)
+				best = val;
+		}
+
+		stats->totalPts += b.total_size();
+		stats->totalQueries += a_limit.size() - skipped;
+		return best;
+	}
+};
+
+
+#endif /* MAX_JOINFUNC_HPP_ */
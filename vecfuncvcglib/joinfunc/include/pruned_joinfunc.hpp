@@ -0,0 +1,335 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PRUNED_JOINFUNC_HPP_
+#define PRUNED_JOINFUNC_HPP_
+
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <jointvecfunc.hpp>
+#include "brute_joinfunc.hpp"
+
+
+// Block edge of the lowest pyramid level (in cells, per dimension).
+#ifndef BRUTE_PRUNE_BLOCK_EDGE
+#define BRUTE_PRUNE_BLOCK_EDGE (8)
+#endif
+
+
+/*
+ * Branch and bound brute force.
+ *
+ * B is covered by a pyramid of blocks: the lowest level has blocks with an edge of
+ * BRUTE_PRUNE_BLOCK_EDGE, and each level doubles the edge. Each block holds the maximal B value
+ * in it. RES is covered by a similar pyramid that holds the minimal RES value of each tile.
+ * Each A point descends the B pyramid, and skips a block (and all its sub blocks) if
+ * A + max(B block) cannot beat the minimal RES value of the tiles the block maps to.
+ *
+ * RES values only rise, so a stale tile minimum is still a lower bound. The joined tiles are
+ * only marked as dirty, and their minimum is recomputed when it is needed.
+ * The rows of A are joined in parallel (see BruteForceJoinFunc::join_rows_parallel()), each
+ * worker with its own pyramids. The checks are ordered, and a block is skipped only if it is
+ * below the minimum (so it cannot update RES, even on a tie), so the results are identical to
+ * the brute force.
+ */
+template <typename T, unsigned int D>
+class PrunedBruteForceJoinFunc {
+public:
+	static const unsigned int dim = D;
+
+	using Brute = BruteForceJoinFunc<T,D>;
+	using TDVecFunc = VecFunc<T,D>;
+	using TDJoinedVecFunc = JointVecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	/*
+	 * Block aggregates (max or min) of a D dim array, per level.
+	 * The aggregate of a dirty block is recomputed on access. A dirty block has dirty ancestors.
+	 */
+	template<bool MAX>
+	class BlockPyramid {
+	private:
+		typedef struct {
+			index size;
+			unsigned int edge;
+			std::vector<T> val;
+			std::vector<char> dirty;
+		} Level;
+
+		const TDVecFunc& arr;
+		std::vector<Level> levels;
+
+		static inline T agg(T v1, T v2) {
+			return MAX ? std::max(v1, v2) : std::min(v1, v2);
+		}
+
+		static inline unsigned long block_index(const Level& lv, const index& t) {
+			unsigned long ind = 0;
+			FOR_EACH_DIM(d)
+				ind = ind*lv.size[d] + t[d];
+			return ind;
+		}
+
+		T compute(unsigned int l, const index& t) {
+			index lo, ext, i, c;
+			bool first = true;
+			T ret = 0;
+
+			if (l == 0) {
+				FOR_EACH_DIM(d) {
+					lo[d] = t[d] * levels[0].edge;
+					ext[d] = std::min(levels[0].edge, (unsigned int)(arr.size[d] - lo[d]));
+				}
+				FOR_EACH_INDEX(i, ext) {
+					vec_add(lo, i, c);
+					T v = arr[c];
+					ret = first ? v : agg(ret, v);
+					first = false;
+				}
+				return ret;
+			}
+
+			const Level& child = levels[l-1];
+			FOR_EACH_DIM(d) {
+				lo[d] = 2*t[d];
+				ext[d] = std::min(2u, (unsigned int)(child.size[d] - lo[d]));
+			}
+			FOR_EACH_INDEX(i, ext) {
+				vec_add(lo, i, c);
+				T v = get(l-1, c);
+				ret = first ? v : agg(ret, v);
+				first = false;
+			}
+			return ret;
+		}
+
+	public:
+		BlockPyramid(const TDVecFunc& arr, unsigned int levelCount) : arr(arr), levels(levelCount) {
+			unsigned int edge = BRUTE_PRUNE_BLOCK_EDGE;
+			for (auto& lv : levels) {
+				lv.edge = edge;
+				FOR_EACH_DIM(d)
+					lv.size[d] = (arr.size[d] + edge - 1) / edge;
+				lv.val.resize(lv.size.size());
+				lv.dirty.assign(lv.size.size(), 1);
+				edge *= 2;
+			}
+		}
+
+		// Number of levels until a single block covers all of SIZE.
+		static unsigned int level_count(const index& size) {
+			unsigned int count = 1;
+			unsigned int edge = BRUTE_PRUNE_BLOCK_EDGE;
+			FOR_EACH_DIM(d) {
+				while (edge < size[d]) {
+					edge *= 2;
+					count++;
+				}
+			}
+			return count;
+		}
+
+		unsigned int top() const {
+			return levels.size() - 1;
+		}
+
+		unsigned int edge(unsigned int l) const {
+			return levels[l].edge;
+		}
+
+		const index& size(unsigned int l) const {
+			return levels[l].size;
+		}
+
+		T get(unsigned int l, const index& t) {
+			Level& lv = levels[l];
+			auto ind = block_index(lv, t);
+			if (lv.dirty[ind]) {
+				lv.val[ind] = compute(l, t);
+				lv.dirty[ind] = 0;
+			}
+			return lv.val[ind];
+		}
+
+		// The aggregate of the level L blocks that intersect the cells box [LO, LO + EXT).
+		T bound(unsigned int l, const index& lo, const index& ext) {
+			index t_lo, t_ext, i, t;
+			unsigned int e = levels[l].edge;
+			FOR_EACH_DIM(d) {
+				t_lo[d] = lo[d] / e;
+				t_ext[d] = (lo[d] + ext[d] - 1) / e - t_lo[d] + 1;
+			}
+
+			bool first = true;
+			T ret = 0;
+			FOR_EACH_INDEX(i, t_ext) {
+				vec_add(t_lo, i, t);
+				T v = get(l, t);
+				ret = first ? v : agg(ret, v);
+				first = false;
+			}
+			return ret;
+		}
+
+		// Marks the blocks that intersect the cells box [LO, LO + EXT) as dirty.
+		void invalidate(const index& lo, const index& ext) {
+			index t_lo, t_ext, i, t;
+			unsigned int e = levels[0].edge;
+			FOR_EACH_DIM(d) {
+				t_lo[d] = lo[d] / e;
+				t_ext[d] = (lo[d] + ext[d] - 1) / e - t_lo[d] + 1;
+			}
+
+			FOR_EACH_INDEX(i, t_ext) {
+				vec_add(t_lo, i, t);
+				for (unsigned int l=0; l < levels.size(); l++) {
+					Level& lv = levels[l];
+					auto ind = block_index(lv, t);
+					if (lv.dirty[ind])
+						break;
+					lv.dirty[ind] = 1;
+					FOR_EACH_DIM(d)
+						t[d] /= 2;
+				}
+			}
+		}
+	};
+
+	using MaxPyramid = BlockPyramid<true>;
+	using MinPyramid = BlockPyramid<false>;
+
+	/*
+	 * The bytes of the B and RES pyramids, for SIZE cells of B. The shapes are not known before
+	 * the join, so both are taken as cubes of SIZE cells.
+	 */
+	static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize __attribute__((unused))) {
+		unsigned long cubeEdge = (unsigned long)std::ceil(std::pow((double)size, 1.0 / D));
+		unsigned long ret = 0;
+		for (unsigned long edge = BRUTE_PRUNE_BLOCK_EDGE; ; edge *= 2) {
+			unsigned long blocks = 1;
+			FOR_EACH_DIM(d)
+				blocks *= (cubeEdge + edge - 1) / edge;
+			ret += blocks * (sizeof(T) + sizeof(char));
+			if (edge >= cubeEdge)
+				break;
+		}
+		return 2 * ret;
+	}
+
+	template<bool COUNTERS>
+	static void join_vecfunc(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res,
+			unsigned int threadCount, VCGStats* stats __attribute__((unused))) {
+		Brute::reset_result_array(res);
+		if (a.total_size() == 0 || b.total_size() == 0 || res.total_size() == 0)
+			return;
+
+		unsigned int levelCount = std::max(MaxPyramid::level_count(b.size),
+				MinPyramid::level_count(res.size));
+		unsigned int rows = std::min(a.size[0], res.size[0]);
+		unsigned int poolSize = WorkStealingPool::shared(threadCount).size();
+		std::vector<std::unique_ptr<MaxPyramid>> b_max(poolSize);
+		std::vector<std::unique_ptr<MinPyramid>> res_min(poolSize);
+		std::vector<unsigned long> combinationCount(poolSize, 0);
+		std::vector<unsigned long> prunedCount(poolSize, 0);
+
+		Brute::join_rows_parallel(rows, res, threadCount, [&] (unsigned int lo, unsigned int hi,
+				unsigned int w, TDJoinedVecFunc& r) {
+			if (!b_max[w]) {
+				b_max[w].reset(new MaxPyramid(b, levelCount));
+				res_min[w].reset(new MinPyramid(r, levelCount));
+			}
+
+			index i, i_a, a_limit, b_limit, top;
+			FOR_EACH_DIM(d)
+				top[d] = 0;
+			a_limit = a.size;
+			a_limit.min(res.size);
+			a_limit[0] = hi - lo;
+			FOR_EACH_INDEX(i, a_limit) {
+				i_a = i;
+				i_a[0] += lo;
+				auto a_val = a[i_a];
+
+				vec_dec(res.size, i_a, b_limit);
+				b_limit.min(b.size);
+
+				join_block<COUNTERS>(b_max[w]->top(), top, i_a, a_val, b, b_limit, r, *b_max[w],
+						*res_min[w], combinationCount[w], prunedCount[w]);
+			}
+		});
+
+		if (COUNTERS) {
+			unsigned long combinations = std::accumulate(combinationCount.begin(), combinationCount.end(), 0ul);
+			unsigned long pruned = std::accumulate(prunedCount.begin(), prunedCount.end(), 0ul);
+			stats->comparedBruteForce += (double)combinations / (double)a.total_size();
+			stats->prunedBruteForce += (double)pruned / (double)a.total_size();
+		}
+	}
+
+private:
+	// Joins A point with the B cells of block T (of level L) in B_LIMIT, unless it is useless.
+	template<bool COUNTERS>
+	static void join_block(unsigned int l, const index& t, const index& i_a, T a_val,
+			const TDVecFunc& b, const index& b_limit, TDJoinedVecFunc& res,
+			MaxPyramid& b_max, MinPyramid& res_min,
+			unsigned long& combinationCount, unsigned long& prunedCount) {
+		index b_lo, b_ext, res_lo;
+		unsigned int e = b_max.edge(l);
+		FOR_EACH_DIM(d) {
+			b_lo[d] = t[d] * e;
+			if (b_lo[d] >= b_limit[d])
+				return;
+			b_ext[d] = std::min(e, (unsigned int)(b_limit[d] - b_lo[d]));
+		}
+		vec_add(i_a, b_lo, res_lo);
+
+		if (a_val + b_max.get(l, t) < res_min.bound(l, res_lo, b_ext)) {
+			if (COUNTERS)
+				prunedCount += b_ext.size();
+			return;
+		}
+
+		if (l == 0) {
+			Brute::template join_val_box<true>(i_a, a_val, b, b_lo, b_ext, res);
+			res_min.invalidate(res_lo, b_ext);
+			if (COUNTERS)
+				combinationCount += b_ext.size();
+			return;
+		}
+
+		index i, c, c_ext;
+		const index& c_size = b_max.size(l-1);
+		FOR_EACH_DIM(d)
+			c_ext[d] = std::min(2u, (unsigned int)(c_size[d] - 2*t[d]));
+		FOR_EACH_INDEX(i, c_ext) {
+			FOR_EACH_DIM(d)
+				c[d] = 2*t[d] + i[d];
+			join_block<COUNTERS>(l-1, c, i_a, a_val, b, b_limit, res, b_max, res_min,
+					combinationCount, prunedCount);
+		}
+	}
+};
+
+
+#endif /* PRUNED_JOINFUNC_HPP_ */
@@ -0,0 +1,191 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SEPARABLE_JOINFUNC_HPP_
+#define SEPARABLE_JOINFUNC_HPP_
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <type_traits>
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <jointvecfunc.hpp>
+#include "serial_joinfunc.hpp"
+#include "concave_joinfunc.hpp"
+
+
+// Tolerance of the separability check for floating point values, in units of the rounding
+// error of a sum of the function's values (integers are exact).
+#define SEPARABLE_EPS_ULPS (4)
+
+
+/*
+ * Join of two additively separable functions, per dim.
+ *
+ * A separable function is F(x) = F(0) + sum_d F_d(x_d), with F_d(t) = F(t*e_d) - F(0).
+ * The join of two such functions is separable as well, and its optimal split is the product
+ * of the per dim optimal splits. So each dim is joined as a 1D function (linear time if both
+ * are concave, otherwise brute force), and the D dim RES/ARG are only built at the end, in a
+ * single pass.
+ *
+ * The separability of both functions is checked at runtime (see SEPARABLE_EPS_ULPS).
+ * Otherwise, falls back to a DS method (see SerialJoinFunc).
+ */
+template <typename T, unsigned int D, unsigned int GRAD_INTERVAL = 1>
+class SeparableJoinFunc : public SerialJoinFunc<T, D> {
+public:
+	using Serial = SerialJoinFunc<T, D>;
+	using Concave1D = Concave1DJoinFunc<T, 1, GRAD_INTERVAL>;
+	using TDVecFunc = VecFunc<T,D>;
+	using TDJoinedVecFunc = JointVecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	// The join of a single dim: the value and the lowest split of each k.
+	struct DimJoin {
+		std::vector<T> val;
+		std::vector<unsigned int> arg;
+	};
+
+	/*
+	 * The rounding error of the expected value of a cell: D differences from V(0) and D sums,
+	 * with partial sums of up to (2D+1) times the largest magnitude of V.
+	 */
+	static T tolerance(const TDVecFunc& v) {
+		if (!std::is_floating_point<T>::value)
+			return 0;
+
+		double maxAbs = 0;
+		auto v_size = v.total_size();
+		for (unsigned int ind=0; ind < v_size; ind++)
+			maxAbs = std::max(maxAbs, std::fabs((double)v[ind]));
+		return (T)(SEPARABLE_EPS_ULPS * (2*D + 1) * std::numeric_limits<T>::epsilon() * maxAbs);
+	}
+
+	// The value of V on the axis of dim D (relative to V(0)).
+	static void axis_func(const TDVecFunc& v, unsigned int d, std::vector<T>& f) {
+		index i;
+		FOR_EACH_DIM(dd)
+			i[dd] = 0;
+		T origin = v[i];
+
+		f.resize(v.size[d]);
+		for (unsigned int t=0; t < v.size[d]; t++) {
+			i[d] = t;
+			f[t] = v[i] - origin;
+		}
+	}
+
+	// |V(x) - V(0) - sum_d V_d(x_d)| <= tolerance, for all x.
+	static bool is_separable(const TDVecFunc& v) {
+		if (v.total_size() == 0)
+			return false;
+
+		std::vector<T> axis[D];
+		FOR_EACH_DIM(d)
+			axis_func(v, d, axis[d]);
+
+		T eps = tolerance(v);
+		T origin = v.m[0];
+		index i;
+		FOR_EACH_INDEX(i, v.size) {
+			T expected = origin;
+			FOR_EACH_DIM(d)
+				expected += axis[d][i[d]];
+			T val = v[i];
+			if (val > expected + eps || expected > val + eps)
+				return false;
+		}
+
+		return true;
+	}
+
+	// The per dim joins are 1D, so there is not enough work to split between threads.
+	static bool join_domain(TDVecFunc& a, TDVecFunc& b, TDJoinedVecFunc& res, unsigned int threadCount,
+			VCGStats* stats) {
+		return Serial::join_domain(a, b, res, threadCount, stats,
+				[] (const TDVecFunc& v) { return is_separable(v); }, join_separable);
+	}
+
+	/*
+	 * RES[k] = max_{i+j=k} A[i] + B[j], and ARG[k] = i (the lowest one).
+	 * Only the positive values are written (RES is reset by the caller).
+	 */
+	static void join_separable(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res) {
+		if (a.total_size() == 0 || b.total_size() == 0)
+			return;
+
+		index k, k_limit;
+		DimJoin dims[D];
+		std::vector<T> a_axis, b_axis;
+		FOR_EACH_DIM(d) {
+			k_limit[d] = std::min(res.size[d], a.size[d] + b.size[d] - 1);
+			axis_func(a, d, a_axis);
+			axis_func(b, d, b_axis);
+			join_dim(a_axis, b_axis, k_limit[d], dims[d]);
+		}
+
+		T origin = a.m[0] + b.m[0];
+		FOR_EACH_INDEX(k, k_limit) {
+			T val = origin;
+			FOR_EACH_DIM(d)
+				val += dims[d].val[k[d]];
+			if (!(0 < val))
+				continue;
+
+			auto res_ind = res.get_index(k);
+			res[res_ind] = val;
+			FOR_EACH_DIM(d)
+				res.arg[res_ind][d] = dims[d].arg[k[d]];
+		}
+	}
+
+private:
+	static void join_dim(const std::vector<T>& a, const std::vector<T>& b, unsigned int k_limit,
+			DimJoin& out) {
+		out.val.resize(k_limit);
+		out.arg.resize(k_limit);
+
+		if (Concave1D::is_concave(a.data(), a.size()) && Concave1D::is_concave(b.data(), b.size())) {
+			Concave1D::split_concave(a.data(), a.size(), b.data(), b.size(), k_limit,
+					[&out] (unsigned int k, unsigned int i, T val) {
+				out.val[k] = val;
+				out.arg[k] = i;
+			});
+			return;
+		}
+
+		for (unsigned int k=0; k < k_limit; k++) {
+			unsigned int i_lo = k >= b.size() ? k - ((unsigned int)b.size() - 1) : 0;
+			unsigned int i_hi = std::min(k, (unsigned int)a.size() - 1);
+			out.val[k] = a[i_lo] + b[k - i_lo];
+			out.arg[k] = i_lo;
+			for (unsigned int i=i_lo+1; i <= i_hi; i++) {
+				T val = a[i] + b[k-i];
+				if (out.val[k] < val) {
+					out.val[k] = val;
+					out.arg[k] = i;
+				}
+			}
+		}
+	}
+};
+
+
+#endif /* SEPARABLE_JOINFUNC_HPP_ */
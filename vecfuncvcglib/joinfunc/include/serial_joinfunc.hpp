@@ -0,0 +1,91 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SERIAL_JOINFUNC_HPP_
+#define SERIAL_JOINFUNC_HPP_
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <jointvecfunc.hpp>
+#include <thread_pool.hpp>
+#include "brute_joinfunc.hpp"
+
+
+/*
+ * The joins of the engines that walk the functions on the calling thread (instead of querying a
+ * DS in parallel).
+ *
+ * Both functions are fixed to be rising (as the fast methods do), and RES is reset, so it holds
+ * only the positive values, as in the other methods. The join is counted as serial in the
+ * statistics if its pool has more than one thread, also with a thread count of zero (all the
+ * cores, see VCGStats::serialJoins).
+ *
+ * The engines of a domain of functions (e.g., the concave functions) derive from it: they join
+ * by their walk only if both functions are in their domain. Otherwise, the caller joins them by
+ * a DS method, within the memory budget (see JOIN_VECFUNC_DOMAIN_ENGINE_CASE). The walk needs no
+ * DS, so their estimate is zero.
+ */
+template <typename T, unsigned int D>
+class SerialJoinFunc {
+public:
+	using TDVecFunc = VecFunc<T,D>;
+	using TDJoinedVecFunc = JointVecFunc<T,D>;
+
+	static unsigned long estimateFootprint(unsigned int size __attribute__((unused)),
+			unsigned int chunkSize __attribute__((unused))) {
+		return 0;
+	}
+
+	// Joins A and B by JOIN(A, B, RES).
+	template<typename Join>
+	static void join_serial(TDVecFunc& a, TDVecFunc& b, TDJoinedVecFunc& res, unsigned int threadCount,
+			VCGStats* stats, Join join) {
+		a.fix_rising();
+		b.fix_rising();
+		run(a, b, res, threadCount, stats, join);
+	}
+
+	// Joins A and B by JOIN(A, B, RES) if both are in the domain (IN_DOMAIN(F)). Returns false otherwise.
+	template <typename InDomain, typename Join>
+	static bool join_domain(TDVecFunc& a, TDVecFunc& b, TDJoinedVecFunc& res, unsigned int threadCount,
+			VCGStats* stats, InDomain inDomain, Join join) {
+		a.fix_rising();
+		b.fix_rising();
+
+		if (!inDomain(a) || !inDomain(b)) {
+			DEBUG_OUTPUT("Out of the domain");
+			return false;
+		}
+
+		run(a, b, res, threadCount, stats, join);
+		return true;
+	}
+
+private:
+	template<typename Join>
+	static void run(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res, unsigned int threadCount,
+			VCGStats* stats, Join join) {
+		if (WorkStealingPool::shared(threadCount).size() > 1)
+			stats->serialJoins++;
+		BruteForceJoinFunc<T,D>::reset_result_array(res);
+		join(a, b, res);
+	}
+};
+
+
+#endif /* SERIAL_JOINFUNC_HPP_ */
@@ -0,0 +1,291 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SWEEP_JOINFUNC_HPP_
+#define SWEEP_JOINFUNC_HPP_
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <jointvecfunc.hpp>
+#include <upper_bound_ds.hpp>
+#include "fast_joinfunc.hpp"
+#include "serial_joinfunc.hpp"
+
+// A subproblem of the offline join with up to this number of (B point, query) pairs checks all
+// its pairs.
+#define SWEEP_LEAF_PAIRS (64)
+
+
+/*
+ * Offline dominance join.
+ *
+ * All the queries are known in advance (they are derived from A), so instead of querying a
+ * static DS one at a time, the B points and the queries are split together, one coordinate at
+ * a time (CDQ divide and conquer, see Dominance). Each B point is reported to exactly the
+ * queries it is below in all the coordinates (also the IND coordinates), so the candidates are
+ * exact, and they are not filtered (FILTER).
+ *
+ * The candidates of a query are only known once all the queries are done, so with BRUTE_OPT,
+ * an A point is brute forced only by the size of its box (before the query).
+ *
+ * Ties are resolved in favor of the lowest A index, so the result is identical to the other
+ * fast methods.
+ *
+ * The join is sequential: it runs on the calling thread, whatever the thread count (see
+ * SerialJoinFunc).
+ */
+template <typename T, unsigned int D, unsigned int GRAD_INTERVAL = 1>
+class SweepJoinFunc : public FastJoinFunc<T, D, UpperBoundDS::SimpleUpperBoundDataStruct, GRAD_INTERVAL> {
+public:
+	using Fast = FastJoinFunc<T, D, UpperBoundDS::SimpleUpperBoundDataStruct, GRAD_INTERVAL>;
+	using TDVecFunc = typename Fast::TDVecFunc;
+	using TDJoinedVecFunc = typename Fast::TDJoinedVecFunc;
+	using index = typename Fast::index;
+	using TDPoint = typename Fast::TDPoint;
+	using TDPointVec = typename Fast::TDPointVec;
+	using shared_points = typename Fast::shared_points;
+	using point_id = typename shared_points::point_id;
+	using JoinCounters = typename Fast::JoinCounters;
+
+	typedef struct {
+		TDPointVec upper;
+		index i_a;
+	} Query;
+
+	/*
+	 * Reports each pair of a B point and a query, such that the point is below the query in all
+	 * the coordinates, to REPORT(id, query).
+	 *
+	 * solve() gets the B points and the queries that are known to be paired in the coordinates
+	 * below K. It splits them by a pivot of the coordinate K: the low points and the high queries
+	 * are paired in K, so they continue to K+1. The low points and the low queries, and the high
+	 * points and the high queries, are split again in K. The high points and the low queries are
+	 * never paired. So each pair is in a single subproblem, and the small ones check their pairs.
+	 * The points and the queries are partitioned in place: a subproblem only reorders its own
+	 * ranges, so the ranges of the other subproblems keep their members.
+	 */
+	template<typename F>
+	class Dominance {
+	private:
+		const shared_points& pts;
+		const std::vector<Query>& queries;
+		F& report;
+
+	public:
+		Dominance(const shared_points& pts, const std::vector<Query>& queries, F& report) :
+				pts(pts), queries(queries), report(report) {}
+
+		void solve(point_id* b, unsigned int bCount, unsigned int* q, unsigned int qCount,
+				unsigned int k) {
+			while (bCount > 0 && qCount > 0) {
+				if (k == POINT_DIM || (unsigned long)bCount * qCount <= SWEEP_LEAF_PAIRS) {
+					solve_pairs(b, bCount, q, qCount, k);
+					return;
+				}
+
+				const T* col = pts.column(k);
+				T low, pivot;
+				if (!find_pivot(col, b, bCount, low, pivot)) {
+					// All the points have the same coordinate: the queries above it continue.
+					unsigned int* qHigh = std::partition(q, q + qCount, [&] (unsigned int i) {
+						return !(low < queries[i].upper[k]);
+					});
+					qCount -= qHigh - q;
+					q = qHigh;
+					k++;
+					continue;
+				}
+
+				point_id* bHigh = std::partition(b, b + bCount, [&] (point_id id) {
+					return col[id] < pivot;
+				});
+				unsigned int* qHigh = std::partition(q, q + qCount, [&] (unsigned int i) {
+					return !(pivot < queries[i].upper[k]);
+				});
+				unsigned int bLowCount = bHigh - b, qLowCount = qHigh - q;
+				solve(b, bLowCount, qHigh, qCount - qLowCount, k + 1);
+				solve(b, bLowCount, q, qLowCount, k);
+
+				b = bHigh;
+				bCount -= bLowCount;
+				q = qHigh;
+				qCount -= qLowCount;
+			}
+		}
+
+	private:
+		/*
+		 * Sets LOW to the lowest coordinate of the points, and PIVOT to their median coordinate,
+		 * or to the next coordinate above LOW if the median is LOW (so both sides are not empty).
+		 * Returns false if all the points have the same coordinate.
+		 */
+		static bool find_pivot(const T* col, point_id* b, unsigned int bCount, T& low, T& pivot) {
+			point_id* mid = b + bCount / 2;
+			std::nth_element(b, mid, b + bCount, [col] (point_id p1, point_id p2) {
+				return col[p1] < col[p2];
+			});
+			pivot = col[*mid];
+			low = pivot;
+			for (unsigned int i=0; i < bCount; i++)
+				low = std::min(low, col[b[i]]);
+			if (low < pivot)
+				return true;
+
+			bool found = false;
+			for (unsigned int i=0; i < bCount; i++) {
+				T v = col[b[i]];
+				if (low < v && (!found || v < pivot)) {
+					pivot = v;
+					found = true;
+				}
+			}
+			return found;
+		}
+
+		void solve_pairs(const point_id* b, unsigned int bCount, const unsigned int* q,
+				unsigned int qCount, unsigned int k) {
+			for (unsigned int j=0; j < qCount; j++) {
+				const TDPointVec& upper = queries[q[j]].upper;
+				for (unsigned int i=0; i < bCount; i++) {
+					bool below = true;
+					for (unsigned int d=k; d < POINT_DIM && below; d++)
+						below = pts.column(d)[b[i]] < upper[d];
+					if (below)
+						report(b[i], q[j]);
+				}
+			}
+		}
+	};
+
+	/*
+	 * The bytes of the points of B (as the simple DS), and their ids that are partitioned by the
+	 * join. The queries are of A (as the result).
+	 */
+	static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize __attribute__((unused))) {
+		return (unsigned long)size * (sizeof(TDPoint) + POINT_DIM * sizeof(T) + 2 * sizeof(point_id));
+	}
+
+	template <bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT, bool COUNTERS, bool BUILD_TIMING, bool QUERY_TIMING>
+	static void join_vecfunc(TDVecFunc& a, TDVecFunc& b, TDJoinedVecFunc& res,
+			unsigned int chunkSize __attribute__((unused)), unsigned int threadCount, VCGStats* stats) {
+		SerialJoinFunc<T, D>::join_serial(a, b, res, threadCount, stats,
+				[stats] (const TDVecFunc& x, const TDVecFunc& y, TDJoinedVecFunc& r) {
+			join_sweep<FILTER_GRAD, BRUTE_OPT, COUNTERS, BUILD_TIMING, QUERY_TIMING>(x, y, r, stats);
+		});
+	}
+
+	template <bool FILTER_GRAD, bool BRUTE_OPT, bool COUNTERS, bool BUILD_TIMING, bool QUERY_TIMING>
+	static void join_sweep(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res, VCGStats* stats) {
+		unsigned int b_vec_size = b.total_size();
+		STATS_INIT(stats_var);
+
+		if (BUILD_TIMING)
+			STATS_START(stats_var);
+		auto pts = Fast::template create_points<FILTER_GRAD>(b, b_vec_size);
+		stats->dsPts += pts.size();
+		stats->totalPts += b_vec_size;
+		if (BUILD_TIMING)
+			STATS_ADD_TIME(stats_var, stats->dsCreatePointsTime);
+
+		std::vector<point_id> ids(pts.get(), pts.get() + pts.size());
+
+		JoinCounters c;
+		index i_a, a_limit, b_limit;
+		a_limit = a.size;
+		a_limit.min(res.size);
+
+		// With BRUTE_OPT, some of the A points are timed to calibrate the cost model (as in
+		// FastJoinFunc::flush_batch()).
+		STATS_INIT(model_var);
+		bool timed;
+
+		std::vector<Query> queries;
+		queries.reserve(a_limit.size());
+		FOR_EACH_INDEX(i_a, a_limit) {
+			auto a_val = a[i_a];
+			vec_dec(res.size, i_a, b_limit);
+			b_limit.min(b.size);
+
+			// As in FastJoinFunc::prepare_point(), a small box is brute forced before the
+			// FILTER_GRAD check.
+			if (BRUTE_OPT && c.model.brute_before_query(b_limit.size())) {
+				timed = !FILTER_GRAD && c.model.next_batch();
+				if (timed)
+					STATS_START(model_var);
+				Fast::template join_val_inner<true>(i_a, a_val, b, b_limit, res);
+				if (timed)
+					c.model.add_brute(b_limit.size(), stats_elapsed(model_var));
+				if (COUNTERS) {
+					c.bruteForce += b_limit.size();
+					c.bruteForceCount++;
+				}
+				continue;
+			}
+
+			queries.push_back(Query());
+			Query& q = queries.back();
+			if (!Fast::template create_upper<FILTER_GRAD>(a, i_a, a_val, b_limit, q.upper)) {
+				queries.pop_back();
+				continue;
+			}
+			q.i_a = i_a;
+
+			if (COUNTERS)
+				c.totalCount++;
+		}
+
+		if (QUERY_TIMING)
+			STATS_START(stats_var);
+
+		std::vector<unsigned int> queryIds(queries.size());
+		for (unsigned int i=0; i < queryIds.size(); i++)
+			queryIds[i] = i;
+
+		auto report = [&] (point_id id, unsigned int queryId) {
+			const TDPoint& p = *pts.pointOf(id);
+			const Query& q = queries[queryId];
+			if (COUNTERS) {
+				c.expected++;
+				c.actual++;
+				c.actualInBound++;
+				if (b.is_edge(p.val.ind))
+					c.actualEdge++;
+			}
+			Fast::template join_val_check_point<true>(q.i_a, a[q.i_a], p.val.ind, p.val.val, res);
+		};
+		Dominance<decltype(report)> dominance(pts, queries, report);
+		dominance.solve(ids.data(), ids.size(), queryIds.data(), queryIds.size(), 0);
+
+		if (QUERY_TIMING) {
+			STATS_ADD_TIME(stats_var, c.queryTime);
+			stats->dsQueryTime += c.queryTime;
+		}
+
+		if (COUNTERS)
+			Fast::add_counters_stats(c, stats);
+		if (BRUTE_OPT)
+			c.model.add_stats(stats);
+	}
+};
+
+
+#endif /* SWEEP_JOINFUNC_HPP_ */
@@ -0,0 +1,194 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TILED_JOINFUNC_HPP_
+#define TILED_JOINFUNC_HPP_
+
+#include <unistd.h>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <jointvecfunc.hpp>
+#include "brute_joinfunc.hpp"
+
+
+// Tile edge (in cells, per dimension). 0: derive it from the L2 cache size.
+#ifndef BRUTE_TILE_EDGE
+#define BRUTE_TILE_EDGE (0)
+#endif
+
+// Used when the L2 cache size cannot be detected.
+#define BRUTE_TILE_DEFAULT_CACHE_SIZE (256*1024)
+
+
+/*
+ * Cache blocked brute force.
+ *
+ * The A points and the B points are split to tiles. Each A tile is joined with each B tile,
+ * so the joined RES region (a tile with twice the edge) and the B tile stays in the cache
+ * while all the A points of the tile are joined.
+ * The rows of A are joined in parallel (see BruteForceJoinFunc::join_rows_parallel()).
+ * The results are identical to the brute force, using ordered checks.
+ */
+template <typename T, unsigned int D>
+class TiledBruteForceJoinFunc {
+public:
+	static const unsigned int dim = D;
+
+	using Brute = BruteForceJoinFunc<T,D>;
+	using TDVecFunc = VecFunc<T,D>;
+	using TDJoinedVecFunc = JointVecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	static unsigned long cache_size() {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+		long sz = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		if (sz > 0)
+			return (unsigned long)sz;
+#endif
+		return BRUTE_TILE_DEFAULT_CACHE_SIZE;
+	}
+
+	// Cache footprint of a B tile and the RES region it is joined into.
+	static unsigned long tile_footprint(unsigned long edge) {
+		unsigned long b_cells = 1, res_cells = 1;
+		FOR_EACH_DIM(d) {
+			b_cells *= edge;
+			res_cells *= 2*edge;
+		}
+		return b_cells*sizeof(T) + res_cells*(sizeof(T) + sizeof(index));
+	}
+
+	// The largest edge for which the footprint fits in half of the L2 cache.
+	static unsigned int tile_edge() {
+		if (BRUTE_TILE_EDGE > 0)
+			return BRUTE_TILE_EDGE;
+
+		static const unsigned int edge = [] () -> unsigned int {
+			unsigned long budget = cache_size() / 2;
+			unsigned int e = 1;
+			while (tile_footprint(e+1) <= budget)
+				e++;
+			return e;
+		}();
+		return edge;
+	}
+
+	// The tiles are joined in place, without a copy of B.
+	static unsigned long estimateFootprint(unsigned int size __attribute__((unused)),
+			unsigned int chunkSize __attribute__((unused))) {
+		return 0;
+	}
+
+	template<bool COUNTERS>
+	static void join_vecfunc(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res,
+			unsigned int threadCount, VCGStats* stats __attribute__((unused))) {
+		Brute::reset_result_array(res);
+
+		unsigned int rows = std::min(a.size[0], res.size[0]);
+		std::vector<unsigned long> combinationCount(WorkStealingPool::shared(threadCount).size(), 0);
+		Brute::join_rows_parallel(rows, res, threadCount, [&] (unsigned int lo, unsigned int hi,
+				unsigned int w, TDJoinedVecFunc& r) {
+			combinationCount[w] += join_rows<COUNTERS>(a, b, r, lo, hi);
+		});
+
+		if (COUNTERS) {
+			unsigned long total = std::accumulate(combinationCount.begin(), combinationCount.end(), 0ul);
+			stats->comparedBruteForce += (double)total / (double)a.total_size();
+		}
+	}
+
+private:
+	// Joins the A points of rows [ROW_LO, ROW_HI). Returns the number of joined combinations.
+	template<bool COUNTERS>
+	static unsigned long join_rows(const TDVecFunc& a, const TDVecFunc& b, TDJoinedVecFunc& res,
+			unsigned int row_lo, unsigned int row_hi) {
+		unsigned int edge = tile_edge();
+		unsigned long combinationCount = 0;
+
+		index a_limit, b_size, a_tiles, b_tiles;
+		a_limit = a.size;
+		a_limit.min(res.size);
+		a_limit[0] = row_hi - row_lo;
+		b_size = b.size;
+		b_size.min(res.size);
+		FOR_EACH_DIM(d) {
+			a_tiles[d] = (a_limit[d] + edge - 1) / edge;
+			b_tiles[d] = (b_size[d] + edge - 1) / edge;
+		}
+
+		index t_a, t_b, a_lo, a_ext, b_lo, b_ext, i_tile, i_a, b_limit;
+		FOR_EACH_INDEX(t_a, a_tiles) {
+			tile_box(t_a, edge, a_limit, a_lo, a_ext);
+			a_lo[0] += row_lo;
+
+			FOR_EACH_INDEX(t_b, b_tiles) {
+				tile_box(t_b, edge, b_size, b_lo, b_ext);
+				if (!tile_reachable(a_lo, b_lo, res.size))
+					continue;
+
+				FOR_EACH_INDEX(i_tile, a_ext) {
+					vec_add(a_lo, i_tile, i_a);
+					if (!clip_b_tile(i_a, b_lo, b_ext, res.size, b_limit))
+						continue;
+
+					Brute::template join_val_box<true>(i_a, a[i_a], b, b_lo, b_limit, res);
+					if (COUNTERS)
+						combinationCount += b_limit.size();
+				}
+			}
+		}
+
+		return combinationCount;
+	}
+
+	static inline void tile_box(const index& t, unsigned int edge, const index& limit,
+			index& lo, index& ext) {
+		FOR_EACH_DIM(d) {
+			lo[d] = t[d] * edge;
+			ext[d] = std::min(edge, (unsigned int)(limit[d] - lo[d]));
+		}
+	}
+
+	// Whether the first A point of the tile can be joined with the first B point of the tile.
+	static inline bool tile_reachable(const index& a_lo, const index& b_lo, const index& res_size) {
+		FOR_EACH_DIM(d) {
+			if (a_lo[d] + b_lo[d] >= res_size[d])
+				return false;
+		}
+		return true;
+	}
+
+	// The extent of the B tile that A point can be joined with. False if it is empty.
+	static inline bool clip_b_tile(const index& i_a, const index& b_lo, const index& b_ext,
+			const index& res_size, index& b_limit) {
+		FOR_EACH_DIM(d) {
+			unsigned int avail = res_size[d] - i_a[d];
+			if (avail <= b_lo[d])
+				return false;
+			b_limit[d] = std::min((unsigned int)b_ext[d], avail - (unsigned int)b_lo[d]);
+		}
+		return true;
+	}
+};
+
+
+#endif /* TILED_JOINFUNC_HPP_ */
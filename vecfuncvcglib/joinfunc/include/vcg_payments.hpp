@@ -0,0 +1,202 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VCG_PAYMENTS_HPP_
+#define VCG_PAYMENTS_HPP_
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include <debug.h>
+#include <vcg_stats.hpp>
+#include <thread_pool.hpp>
+#include <jointvecfunc.hpp>
+#include "joinfunclib.hpp"
+
+
+/*
+ * VCG allocation and payments.
+ *
+ * The prefix chain P[k] = F[0] (+) ... (+) F[k] and the suffix chain S[k] = F[n-1] (+) ... (+) F[k]
+ * are joined one after the other, each with all the threads (the joins run on the single process
+ * wide pool, see WorkStealingPool::shared(), so concurrent chains would not share its workers).
+ * The allocation is recovered from the args of P[n-1]. The social welfare without player i is the
+ * maximum of P[i-1] (+) S[i+1], which is computed by a max only join (see MaxJoinFunc), for all the
+ * players in parallel.
+ *
+ * The input functions are not modified: each chain joins its own copies.
+ */
+template <typename T, unsigned int D, unsigned int G = 1>
+class VCGPayments {
+public:
+	using TDVecFunc = VecFunc<T,D>;
+	using TDJoinedVecFunc = JointVecFunc<T,D>;
+	using index = typename TDVecFunc::index;
+
+	// A joined function that owns its values and args.
+	class ChainFunc {
+	public:
+		std::vector<T> val;
+		std::vector<index> arg;
+		TDJoinedVecFunc f;
+
+		explicit ChainFunc(const index& size) :
+				val(size.size()), arg(size.size()), f(val.data(), arg.data(), size) {}
+	};
+
+	using Chain = std::vector<std::unique_ptr<ChainFunc>>;
+
+	// The maximal value of F in the box [0, LIMIT) (clipped to the size of F).
+	static T box_max(const TDVecFunc& f, const index& limit) {
+		index ext, i;
+		ext = f.size;
+		ext.min(limit);
+
+		bool first = true;
+		T ret = 0;
+		FOR_EACH_INDEX(i, ext) {
+			T v = f[i];
+			if (first || ret < v)
+				ret = v;
+			first = false;
+		}
+		return ret;
+	}
+
+	/*
+	 * Joins the functions in the order of POS: CHAIN[POS[0]] is a copy of F[POS[0]], and
+	 * CHAIN[POS[k]] = CHAIN[POS[k-1]] (+) F[POS[k]].
+	 * The B function of each join is a copy in a reused buffer (the fast methods modify it), and the
+	 * joins share their scratch buffers (see JoinScratch).
+	 */
+	template<bool ... FLAGS>
+	static void join_chain(const std::vector<TDVecFunc>& funcs, const std::vector<unsigned int>& pos,
+			const index& size_limit, unsigned int method, unsigned int chunkSize, unsigned int threadCount,
+			unsigned long memoryBudget, Chain& chain, VCGStats* stats) {
+		const TDVecFunc& first = funcs[pos[0]];
+		chain[pos[0]].reset(new ChainFunc(first.size));
+		std::copy(first.m, first.m + first.total_size(), chain[pos[0]]->val.begin());
+
+		std::vector<T> bVal;
+		typename JoinScratch<T, D>::Scope scratch;
+		index res_size;
+		for (unsigned int k=1; k < pos.size(); k++) {
+			const TDVecFunc& f = funcs[pos[k]];
+			bVal.assign(f.m, f.m + f.total_size());
+			TDVecFunc b(bVal.data(), f.size);
+
+			TDJoinedVecFunc& a = chain[pos[k-1]]->f;
+			FOR_EACH_DIM(d)
+				res_size[d] = std::min(a.size[d] + b.size[d] - 1, size_limit[d] + 1);
+			chain[pos[k]].reset(new ChainFunc(res_size));
+			join_vecfunc<T, D, G, FLAGS...>(a, b, chain[pos[k]]->f, method, chunkSize, threadCount,
+					memoryBudget, stats);
+		}
+	}
+
+	/*
+	 * ALLOCS[i] and PAYMENTS[i] of each player i, given the maximal allocation SIZE_LIMIT.
+	 * Returns the social welfare.
+	 */
+	template<bool ... FLAGS>
+	static T vcg_payments(const std::vector<TDVecFunc>& funcs, const index& size_limit,
+			unsigned int method, unsigned int chunkSize, unsigned int threadCount, unsigned long memoryBudget,
+			index* allocs, T* payments, VCGStats* stats) {
+		unsigned int n = funcs.size();
+		if (n < 2)
+			return 0;
+
+		std::vector<unsigned int> forward(n), backward(n-1);
+		for (unsigned int i=0; i < n; i++)
+			forward[i] = i;
+		for (unsigned int i=0; i < n-1; i++)
+			backward[i] = n-1-i;
+
+		Chain prefix(n), suffix(n);
+		join_chain<FLAGS...>(funcs, forward, size_limit, method, chunkSize, threadCount, memoryBudget,
+				prefix, stats);
+		join_chain<FLAGS...>(funcs, backward, size_limit, method, chunkSize, threadCount, memoryBudget,
+				suffix, stats);
+
+		// The allocation: the (first) maximum of P[n-1], and the args of the chain
+		TDJoinedVecFunc& total = prefix[n-1]->f;
+		index i_res, ind, i_limit;
+		T sw = 0;
+		bool first = true;
+		FOR_EACH_INDEX(i_res, total.size) {
+			T v = total[i_res];
+			if (first || sw < v) {
+				sw = v;
+				ind = i_res;
+			}
+			first = false;
+		}
+
+		for (unsigned int k=n-1; k > 0; k--) {
+			const index& a_ind = prefix[k]->f.arg[prefix[k]->f.get_index(ind)];
+			vec_dec(ind, a_ind, allocs[k]);
+			ind = a_ind;
+		}
+		allocs[0] = ind;
+
+		// Leave one out
+		std::vector<T> values(n);
+		for (unsigned int i=0; i < n; i++) {
+			FOR_EACH_DIM(d)
+				i_limit[d] = allocs[i][d] + 1;
+			values[i] = box_max(funcs[i], i_limit);
+		}
+		FOR_EACH_DIM(d)
+			i_limit[d] = size_limit[d] + 1;
+
+		WorkStealingPool::Shared pool = WorkStealingPool::shared(threadCount);
+		std::vector<VCGStats> workerStats(pool.size());
+		pool.run(n, [&] (unsigned int i, unsigned int w) {
+			bool allocated = false;
+			FOR_EACH_DIM(d)
+				allocated = allocated || allocs[i][d] > 0;
+			if (!allocated) {
+				payments[i] = 0;
+				return;
+			}
+
+			T others;
+			if (i == 0) {
+				others = box_max(suffix[1]->f, i_limit);
+			} else if (i == n-1) {
+				others = box_max(prefix[n-2]->f, i_limit);
+			} else {
+				const TDJoinedVecFunc& a = prefix[i-1]->f;
+				const TDJoinedVecFunc& b = suffix[i+1]->f;
+				index res_size;
+				FOR_EACH_DIM(d)
+					res_size[d] = std::min(a.size[d] + b.size[d] - 1, i_limit[d]);
+				others = join_vecfunc_max(a, b, res_size, &workerStats[w]);
+			}
+			payments[i] = others - (sw - values[i]);
+		});
+
+		for (auto& s : workerStats)
+			stats->add(s);
+		return sw;
+	}
+};
+
+
+#endif /* VCG_PAYMENTS_HPP_ */
@@ -17,6 +17,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <string>
+#include <vector>
 #include <cstdint>
 
 #include <stats.h>
@@ -24,6 +25,7 @@
 #include <vecfunc_types.hpp>
 #include <vcg_stats.hpp>
 #include <joinfunclib.hpp>
+#include <vcg_payments.hpp>
 
 typedef JointVecFunc<VALUE,DIM> TDJoinedVecFunc;
 
@@ -32,13 +34,13 @@ template<bool ... FLAGS>
 VCGStats template_vcg_join(VALUE* val_a, uint32_t* size_a,
              VALUE* val_b, uint32_t* size_b,
              VALUE* val_res, uint32_t* arg_res, uint32_t* size_res,
-             uint32_t method, uint32_t chunk_size) {
+             uint32_t method, uint32_t chunk_size, uint32_t thread_count, uint64_t memory_budget) {
     TDVecFunc a(val_a, size_a);
     TDVecFunc b(val_b, size_b);
     TDJoinedVecFunc res(val_res, (TDJoinedVecFunc::index*)arg_res, size_res);
     VCGStats stats;
 	join_vecfunc<VALUE, DIM, 1, FLAGS...>(a, b, res, method,
-			chunk_size, &stats);
+			chunk_size, thread_count, memory_budget, &stats);
     return stats;
 }
 
@@ -47,9 +49,65 @@ VCGStats template_vcg_join(VALUE* val_a, uint32_t* size_a,
 	VCGStats vcg_join_##N(VALUE* val_a, uint32_t* size_a, \
 				 VALUE* val_b, uint32_t* size_b, \
 				 VALUE* val_res, uint32_t* arg_res, uint32_t* size_res, \
-				 uint32_t method, uint32_t chunk_size) { \
+				 uint32_t method, uint32_t chunk_size, uint32_t thread_count, uint64_t memory_budget) { \
 		return template_vcg_join<__VA_ARGS__>(val_a, size_a, val_b, size_b, val_res, arg_res, size_res, \
-				method, chunk_size); \
+				method, chunk_size, thread_count, memory_budget); \
+	}
+
+
+template<bool ... FLAGS>
+void template_vcg_join_chain(VALUE** vals, uint32_t* sizes, uint32_t func_count,
+             VALUE** res_vals, uint32_t** res_args, uint32_t* res_sizes, VCGStats* res_stats,
+             uint32_t method, uint32_t chunk_size, uint32_t thread_count, uint64_t memory_budget) {
+    std::vector<TDVecFunc> funcs;
+    std::vector<TDJoinedVecFunc> res;
+    funcs.reserve(func_count);
+    for (uint32_t i=0; i < func_count; i++)
+        funcs.emplace_back(vals[i], sizes + i*DIM);
+    for (uint32_t k=0; k+1 < func_count; k++) {
+        res.emplace_back(res_vals[k], (TDJoinedVecFunc::index*)res_args[k], res_sizes + k*DIM);
+        res_stats[k] = VCGStats();
+    }
+
+    join_chain<VALUE, DIM, 1, FLAGS...>(funcs, res, method, chunk_size, thread_count, memory_budget,
+    		res_stats);
+}
+
+
+#define DEF_VCG_JOIN_CHAIN(N,...) \
+	void vcg_join_chain_##N(VALUE** vals, uint32_t* sizes, uint32_t func_count, \
+				 VALUE** res_vals, uint32_t** res_args, uint32_t* res_sizes, VCGStats* res_stats, \
+				 uint32_t method, uint32_t chunk_size, uint32_t thread_count, uint64_t memory_budget) { \
+		template_vcg_join_chain<__VA_ARGS__>(vals, sizes, func_count, res_vals, res_args, res_sizes, \
+				res_stats, method, chunk_size, thread_count, memory_budget); \
+	}
+
+
+template<bool ... FLAGS>
+VCGStats template_vcg_payments(VALUE** vals, uint32_t* sizes, uint32_t player_count, uint32_t* size_limit,
+             uint32_t method, uint32_t chunk_size, uint32_t thread_count, uint64_t memory_budget,
+             uint32_t* ret_allocs, VALUE* ret_payments, VALUE* ret_sw) {
+    std::vector<TDVecFunc> funcs;
+    funcs.reserve(player_count);
+    for (uint32_t i=0; i < player_count; i++)
+        funcs.emplace_back(vals[i], sizes + i*DIM);
+    TDVecFunc::index limit;
+    for (unsigned int d=0; d < DIM; d++)
+        limit[d] = size_limit[d];
+
+    VCGStats stats;
+    *ret_sw = VCGPayments<VALUE, DIM>::template vcg_payments<FLAGS...>(funcs, limit, method, chunk_size,
+            thread_count, memory_budget, (TDVecFunc::index*)ret_allocs, ret_payments, &stats);
+    return stats;
+}
+
+
+#define DEF_VCG_PAYMENTS(N,...) \
+	VCGStats vcg_payments_##N(VALUE** vals, uint32_t* sizes, uint32_t player_count, uint32_t* size_limit, \
+				 uint32_t method, uint32_t chunk_size, uint32_t thread_count, uint64_t memory_budget, \
+				 uint32_t* ret_allocs, VALUE* ret_payments, VALUE* ret_sw) { \
+		return template_vcg_payments<__VA_ARGS__>(vals, sizes, player_count, size_limit, \
+				method, chunk_size, thread_count, memory_budget, ret_allocs, ret_payments, ret_sw); \
 	}
 
 
@@ -70,6 +128,60 @@ DEF_VCG_JOIN(fg_count,     true, true,  false, true,  false, false)
 DEF_VCG_JOIN(fg_buildtime, true, true,  false, true,  true,  false)
 DEF_VCG_JOIN(fg_querytime, true, true,  false, true,  true,  true )
 
+DEF_VCG_JOIN_CHAIN(nofilter,  false, false, false, false, false, false)
+DEF_VCG_JOIN_CHAIN(filter,    false, true,  false, false, false, false)
+DEF_VCG_JOIN_CHAIN(brute_opt, false, true,  true,  false, false, false)
+DEF_VCG_JOIN_CHAIN(count,     false, true,  false, true,  false, false)
+DEF_VCG_JOIN_CHAIN(buildtime, false, true,  false, true,  true,  false)
+DEF_VCG_JOIN_CHAIN(querytime, false, true,  false, true,  true,  true )
+
+DEF_VCG_JOIN_CHAIN(fg_nofilter,  true, false, false, false, false, false)
+DEF_VCG_JOIN_CHAIN(fg_filter,    true, true,  false, false, false, false)
+DEF_VCG_JOIN_CHAIN(fg_brute_opt, true, true,  true,  false, false, false)
+DEF_VCG_JOIN_CHAIN(fg_count,     true, true,  false, true,  false, false)
+DEF_VCG_JOIN_CHAIN(fg_buildtime, true, true,  false, true,  true,  false)
+DEF_VCG_JOIN_CHAIN(fg_querytime, true, true,  false, true,  true,  true )
+
+DEF_VCG_PAYMENTS(nofilter,  false, false, false, false, false, false)
+DEF_VCG_PAYMENTS(filter,    false, true,  false, false, false, false)
+DEF_VCG_PAYMENTS(brute_opt, false, true,  true,  false, false, false)
+DEF_VCG_PAYMENTS(count,     false, true,  false, true,  false, false)
+DEF_VCG_PAYMENTS(buildtime, false, true,  false, true,  true,  false)
+DEF_VCG_PAYMENTS(querytime, false, true,  false, true,  true,  true )
+
+DEF_VCG_PAYMENTS(fg_nofilter,  true, false, false, false, false, false)
+DEF_VCG_PAYMENTS(fg_filter,    true, true,  false, false, false, false)
+DEF_VCG_PAYMENTS(fg_brute_opt, true, true,  true,  false, false, false)
+DEF_VCG_PAYMENTS(fg_count,     true, true,  false, true,  false, false)
+DEF_VCG_PAYMENTS(fg_buildtime, true, true,  false, true,  true,  false)
+DEF_VCG_PAYMENTS(fg_querytime, true, true,  false, true,  true,  true )
+
+VCGStats vcg_join_max(VALUE* val_a, uint32_t* size_a,
+             VALUE* val_b, uint32_t* size_b,
+             uint32_t* size_res, VALUE* ret_max) {
+    TDVecFunc a(val_a, size_a);
+    TDVecFunc b(val_b, size_b);
+    TDVecFunc::index res_size;
+    for (unsigned int d=0; d < DIM; d++)
+        res_size[d] = size_res[d];
+    VCGStats stats;
+    *ret_max = join_vecfunc_max(a, b, res_size, &stats);
+    return stats;
+}
+
+// The DS cache is shared by all the joins (see DSCacheControl). A zero capacity disables it.
+void vcg_ds_cache_set_capacity(uint64_t capacity_bytes) {
+    DSCacheControl::set_capacity(capacity_bytes);
+}
+
+void vcg_ds_cache_clear() {
+    DSCacheControl::clear();
+}
+
+uint64_t vcg_ds_cache_size() {
+    return DSCacheControl::size();
+}
+
 VCGStats vcg_test_ds_build_time(VALUE* val_v, uint32_t* size_v,
              uint32_t method, uint32_t chunk_size) {
     TDVecFunc v(val_v, size_v);
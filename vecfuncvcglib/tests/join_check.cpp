@@ -0,0 +1,871 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Differential checks of the join methods (also of the brute force) against a plain scalar join.
+ * The inputs are generated (rising functions), so no input file is needed.
+ * Returns non zero if any check failed.
+ */
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <initializer_list>
+#include <string>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <type_traits>
+
+#include <vecfunc_types.hpp>
+#include <vcg_stats.hpp>
+#include <vecfunc.hpp>
+#include <joinfunclib.hpp>
+#include <jointvecfunc.hpp>
+#include <vcg_payments.hpp>
+
+typedef VecFuncTest<VALUE,DIM> TDVecFuncTest;
+typedef JointVecFuncTest<VALUE,DIM> TDJointVecFuncTest;
+typedef TDVecFuncTest::index TDIndex;
+
+// The input size (about 600 cells), and the result size.
+#define CHECK_INPUT_CELLS (600)
+// The size of the large inputs (at least), above RADIX_SORT_MIN_SIZE and BUILD_TASK_MIN_SIZE.
+#define CHECK_LARGE_INPUT_CELLS (5000)
+#define CHECK_REPEAT (3)
+// The size of an input with more than RANK_NARROW_COUNT distinct coordinates (see checkRankKeys()).
+#define CHECK_WIDE_RANK_CELLS (90000)
+// The capacity of the DS cache in the cache checks (it is off by default).
+#define CHECK_DS_CACHE_CAPACITY (64ul << 20)
+
+typedef enum {CONCAVE=0, FLAT=1, LNATURAL=2} FuncKind;
+
+static unsigned int failures = 0;
+
+
+static TDIndex inputSize(unsigned int cells = CHECK_INPUT_CELLS) {
+	TDIndex ret;
+	unsigned int edge = std::max(2u, (unsigned int)std::ceil(std::pow(cells, 1.0 / DIM)));
+	FOR_EACH_DIM_D(d, DIM)
+		ret[d] = edge;
+	return ret;
+}
+
+
+static TDIndex resultSize(const TDIndex& a, const TDIndex& b) {
+	TDIndex ret;
+	FOR_EACH_DIM_D(d, DIM)
+		ret[d] = (a[d] + b[d]) * 3 / 4;
+	return ret;
+}
+
+
+/*
+ * A rising function. FLAT has plateaus, so it has many ties.
+ * CONCAVE is a separable sum of integer quadratics, so it is exactly concave (also in floating
+ * point), and the concave engines do not fall back.
+ * LNATURAL adds -(x_d - x_e)^2 for each pair of dims, so it is L-natural concave but not separable.
+ * Its quadratics are steeper with the dimension, so it is still rising.
+ */
+static void fillFunc(TDVecFuncTest& f, unsigned int seed, FuncKind kind) {
+	std::mt19937 gen(seed);
+	std::uniform_real_distribution<double> dist(0.5, 3);
+	double w[DIM];
+	FOR_EACH_DIM_D(d, DIM)
+		w[d] = dist(gen);
+
+	TDIndex i;
+	FOR_EACH_MAT_INDEX(f, i) {
+		double v = 0;
+		FOR_EACH_DIM_D(d, DIM) {
+			if (kind == FLAT)
+				v += std::floor(w[d] * std::sqrt((double)i[d])) * 5;
+			else if (kind == CONCAVE)
+				v += std::round(w[d]) * i[d] * (2.0 * f.size[d] - i[d]);
+			else
+				v += std::round(w[d]) * i[d] * (2.0 * DIM * f.size[d] - i[d]);
+		}
+		if (kind == LNATURAL) {
+			FOR_EACH_DIM_D(d, DIM) {
+				for (unsigned int e=d+1; e < DIM; e++)
+					v -= ((double)i[d] - i[e]) * ((double)i[d] - i[e]);
+			}
+		}
+		f[i] = kind == FLAT ? (VALUE)(std::round(v * 1000) / 1000) : (VALUE)v;
+	}
+}
+
+
+static void copyFunc(const TDVecFuncTest& src, TDVecFuncTest& dst) {
+	std::copy(src.m, src.m + src.total_size(), dst.m);
+}
+
+
+static bool sameIndex(const TDIndex& a, const TDIndex& b) {
+	FOR_EACH_DIM_D(d, DIM) {
+		if (a[d] != b[d])
+			return false;
+	}
+	return true;
+}
+
+
+static void report(const std::string& name, unsigned long mismatches) {
+	if (mismatches > 0)
+		failures++;
+	std::cout << (mismatches > 0 ? "FAIL " : "OK   ") << name;
+	if (mismatches > 0)
+		std::cout << " (" << mismatches << " mismatches)";
+	std::cout << std::endl;
+}
+
+
+/*
+ * The reference join: a plain nested loop over the splits of each cell, in the lexicographic
+ * order of the index of A (as the brute force, it keeps the first maximum).
+ */
+static void scalarJoin(const VecFunc<VALUE, DIM>& a, const VecFunc<VALUE, DIM>& b,
+		TDJointVecFuncTest& res) {
+	TDIndex i, i_a, i_b;
+	FOR_EACH_MAT_INDEX(res, i) {
+		auto k = res.get_index(i);
+		res[k] = 0;
+		FOR_EACH_DIM_D(d, DIM) {
+			res.arg[k][d] = 0;
+			i_a[d] = 0;
+		}
+		for (bool more = true; more;) {
+			bool valid = true;
+			FOR_EACH_DIM_D(d, DIM) {
+				i_b[d] = i[d] - i_a[d];
+				valid = valid && i_b[d] < b.size[d];
+			}
+			if (valid && res[k] < (VALUE)(a[i_a] + b[i_b])) {
+				res[k] = (VALUE)(a[i_a] + b[i_b]);
+				res.arg[k] = i_a;
+			}
+			more = false;
+			for (unsigned int d=DIM; d-- > 0 && !more;) {
+				if (i_a[d] < i[d] && i_a[d] + 1 < a.size[d]) {
+					i_a[d]++;
+					more = true;
+				} else {
+					i_a[d] = 0;
+				}
+			}
+		}
+	}
+}
+
+
+/*
+ * The cells of RES whose argument does not produce their value.
+ * With FILTER_GRAD, the cells that were not joined keep the reset value (zero).
+ */
+template<bool FILTER_GRAD>
+static unsigned long invalidArgs(const TDVecFuncTest& a, const TDVecFuncTest& b,
+		const TDJointVecFuncTest& res) {
+	unsigned long ret = 0;
+	TDIndex i, i_b;
+	FOR_EACH_MAT_INDEX(res, i) {
+		auto k = res.get_index(i);
+		const TDIndex& i_a = res.arg[k];
+		if (FILTER_GRAD && res[k] == 0)
+			continue;
+		bool valid = true;
+		FOR_EACH_DIM_D(d, DIM) {
+			valid = valid && i_a[d] <= i[d] && i_a[d] < a.size[d] && i[d] - i_a[d] < b.size[d];
+			i_b[d] = i[d] - i_a[d];
+		}
+		if (!valid || (VALUE)(a[i_a] + b[i_b]) != res[k])
+			ret++;
+	}
+	return ret;
+}
+
+
+/*
+ * Joins A and B by METHOD (repeated, with the flags FILTER_GRAD, FILTER and BRUTE_OPT), and
+ * checks that:
+ *  - The result is the same on every run (the values and the arguments).
+ *  - The arguments produce the values.
+ *  - The values and the arguments are of the scalar join. With FILTER_GRAD, the flat points are
+ *    not joined, so only the maximum is compared.
+ */
+template<bool FILTER_GRAD, bool FILTER, bool BRUTE_OPT>
+static void checkMethod(const std::string& name, unsigned int method, const TDVecFuncTest& a,
+		const TDVecFuncTest& b, const TDJointVecFuncTest& ref, unsigned int threadCount) {
+	TDIndex res_size = ref.size;
+	TDJointVecFuncTest first(res_size);
+	unsigned long mismatches = 0;
+	for (unsigned int r=0; r < CHECK_REPEAT; r++) {
+		TDVecFuncTest a_copy(a.size), b_copy(b.size);
+		copyFunc(a, a_copy);
+		copyFunc(b, b_copy);
+		TDJointVecFuncTest res(res_size);
+		VCGStats stats;
+		join_vecfunc<VALUE, DIM, 1, FILTER_GRAD, FILTER, BRUTE_OPT, false, false, false>(a_copy, b_copy,
+				res, method, 8, threadCount, 0, &stats);
+
+		mismatches += invalidArgs<FILTER_GRAD>(a, b, res);
+		TDIndex i;
+		VALUE resMax = 0, refMax = 0;
+		FOR_EACH_MAT_INDEX(res, i) {
+			auto k = res.get_index(i);
+			resMax = std::max(resMax, res[k]);
+			refMax = std::max(refMax, ref[k]);
+			if (!FILTER_GRAD && (res[k] != ref[k] || !sameIndex(res.arg[k], ref.arg[k])))
+				mismatches++;
+			if (r == 0) {
+				first[k] = res[k];
+				first.arg[k] = res.arg[k];
+			} else if (first[k] != res[k] || !sameIndex(first.arg[k], res.arg[k])) {
+				mismatches++;
+			}
+		}
+		if (resMax != refMax)
+			mismatches++;
+	}
+
+	report(name + (FILTER_GRAD ? " fg" : "") + (FILTER ? "" : " no filter") +
+			(BRUTE_OPT ? "" : " no brute opt"), mismatches);
+}
+
+
+/*
+ * Without BRUTE_OPT, the queries are not budgeted (queryBatch()), and without FILTER the
+ * candidates of the queries are not filtered (unless both FILTER_GRAD and BRUTE_OPT are set).
+ */
+template<bool FILTER, bool BRUTE_OPT>
+static void checkFlags(const std::string& name, unsigned int method, const TDVecFuncTest& a,
+		const TDVecFuncTest& b, const TDJointVecFuncTest& ref, unsigned int threadCount) {
+	checkMethod<false, FILTER, BRUTE_OPT>(name, method, a, b, ref, threadCount);
+	checkMethod<true, FILTER, BRUTE_OPT>(name, method, a, b, ref, threadCount);
+}
+
+
+/*
+ * The concave inputs are in the domain of the concave engines, so their checks do not only
+ * check the fallback.
+ */
+static void checkDomains() {
+	TDVecFuncTest a(inputSize()), b(inputSize());
+	fillFunc(a, 1, CONCAVE);
+	fillFunc(b, 2, CONCAVE);
+
+	typedef Concave1DJoinFunc<VALUE, DIM> Concave1D;
+	report("concave 1d domain", DIM == 1 && !(Concave1D::is_concave(a) && Concave1D::is_concave(b)));
+
+	typedef SeparableJoinFunc<VALUE, DIM> Separable;
+	report("separable domain", !(Separable::is_separable(a) && Separable::is_separable(b)));
+	if (std::is_floating_point<VALUE>::value) {
+		// Rounding the values keeps them separable (up to the tolerance), but a step does not
+		// (in 1D, every function is separable).
+		TDVecFuncTest r(inputSize());
+		TDIndex i;
+		FOR_EACH_MAT_INDEX(r, i)
+			r[i] = (VALUE)(a[i] / 3.0);
+		report("separable domain (rounded)", !Separable::is_separable(r));
+		r.m[r.total_size() - 1] *= (VALUE)1.001;
+		report("separable domain (step)", DIM > 1 && Separable::is_separable(r));
+	}
+
+	typedef LNaturalJoinFunc<VALUE, DIM> LNatural;
+	report("l-natural domain", !(LNatural::is_l_natural_concave(a) && LNatural::is_l_natural_concave(b)));
+	fillFunc(a, 1, LNATURAL);
+	fillFunc(b, 2, LNATURAL);
+	report("l-natural domain (not separable)", !(LNatural::is_l_natural_concave(a) &&
+			LNatural::is_l_natural_concave(b)));
+}
+
+
+static void checkMethods(const char* kindName, FuncKind kind, unsigned int threadCount,
+		std::initializer_list<unsigned int> methods, unsigned int cells = CHECK_INPUT_CELLS) {
+	TDVecFuncTest a(inputSize(cells)), b(inputSize(cells));
+	fillFunc(a, 1, kind);
+	fillFunc(b, 2, kind);
+	TDJointVecFuncTest ref(resultSize(a.size, b.size));
+	scalarJoin(a, b, ref);
+
+	for (unsigned int method : methods) {
+		std::string name = std::string(kindName) + " method " + std::to_string(method) +
+				" threads " + std::to_string(threadCount);
+		checkFlags<true, true>(name, method, a, b, ref, threadCount);
+		checkFlags<true, false>(name, method, a, b, ref, threadCount);
+		checkFlags<false, true>(name, method, a, b, ref, threadCount);
+		checkFlags<false, false>(name, method, a, b, ref, threadCount);
+	}
+}
+
+
+/*
+ * A budget below the estimate of every method (also with a zero chunk size) falls back to the
+ * brute force, except for the brute forces that join in place, and the engines of a domain
+ * that need no DS for the functions in their domain. Out of their domain, their fallback falls
+ * back to the brute force. A budget above the estimate does not fall back.
+ */
+static void checkMemoryBudget() {
+	typedef Concave1DJoinFunc<VALUE, DIM> Concave1D;
+	typedef LNaturalJoinFunc<VALUE, DIM> LNatural;
+	typedef SeparableJoinFunc<VALUE, DIM> Separable;
+
+	for (FuncKind kind : {CONCAVE, FLAT}) {
+		TDVecFuncTest a(inputSize()), b(inputSize());
+		fillFunc(a, 1, kind);
+		fillFunc(b, 2, kind);
+		TDIndex res_size = resultSize(a.size, b.size);
+		TDJointVecFuncTest ref(res_size);
+		scalarJoin(a, b, ref);
+
+		for (unsigned long budget : {1ul, 1ul << 40}) {
+			for (unsigned int chunkSize : {0, 8}) {
+				for (unsigned int method : {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}) {
+					TDJointVecFuncTest res(res_size);
+					VCGStats stats;
+					join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, b, res, method,
+							chunkSize, 1, budget, &stats);
+
+					bool inPlace = method == 0 || method == 10 ||
+							(method == 12 && Concave1D::is_concave(a) && Concave1D::is_concave(b)) ||
+							(method == 13 && LNatural::is_l_natural_concave(a) &&
+									LNatural::is_l_natural_concave(b)) ||
+							(method == 14 && Separable::is_separable(a) && Separable::is_separable(b));
+					unsigned long mismatches = budget == 1 && !inPlace ?
+							(stats.memoryFallbacks != 1) + (stats.memoryFallbackMethod != 0) :
+							stats.memoryFallbacks;
+					TDIndex i;
+					FOR_EACH_MAT_INDEX(res, i) {
+						auto k = res.get_index(i);
+						if (res[k] != ref[k])
+							mismatches++;
+					}
+					report(std::string(kind == CONCAVE ? "concave" : "flat") + " memory budget " +
+							std::to_string(budget) + " method " + std::to_string(method) + " chunk " +
+							std::to_string(chunkSize), mismatches);
+				}
+			}
+		}
+	}
+}
+
+
+/*
+ * The DS cache is off by default (DS_CACHE_DEFAULT_CAPACITY). Once enabled, it reuses the DS of
+ * the same B (and not of another B of the same size), and a budgeted join keeps at most its
+ * budget in it. It evicts the least recently used DS of all the DS types first. Clearing it
+ * releases all.
+ */
+static void checkDSCache() {
+	TDVecFuncTest a(inputSize()), b(inputSize());
+	fillFunc(a, 1, CONCAVE);
+	fillFunc(b, 2, CONCAVE);
+	TDJointVecFuncTest res(resultSize(a.size, b.size));
+
+	unsigned long mismatches = DSCacheControl::capacity() != DS_CACHE_DEFAULT_CAPACITY;
+	DSCacheControl::set_capacity(CHECK_DS_CACHE_CAPACITY);
+	DSCacheControl::clear();
+	VCGStats stats;
+	for (unsigned int r=0; r < 2; r++)
+		join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, b, res, 7, 8, 1, 0, &stats);
+	mismatches += (stats.dsCacheHits != 1) + (stats.dsCacheMisses != 1) + (DSCacheControl::size() == 0);
+
+	// Another B of the same size is a miss.
+	TDVecFuncTest c(b.size);
+	copyFunc(b, c);
+	c.m[c.total_size() - 1] += 1;
+	join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, c, res, 7, 8, 1, 0, &stats);
+	mismatches += (stats.dsCacheHits != 1) + (stats.dsCacheMisses != 2);
+
+	unsigned long budget = stats.dsMemoryBytes * 2;
+	join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, b, res, 6, 8, 1, budget, &stats);
+	mismatches += DSCacheControl::size() > budget;
+
+	// The DS of method 6 was registered first, but it is the most recently used one.
+	DSCacheControl::clear();
+	for (unsigned int method : {6, 7, 6})
+		join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, b, res, method, 8, 1, 0, &stats);
+	DSCacheControl::set_capacity(DSCacheControl::size() - 1);
+	stats = VCGStats();
+	join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, b, res, 6, 8, 1, 0, &stats);
+	mismatches += stats.dsCacheHits != 1;
+
+	DSCacheControl::set_capacity(0);
+	stats = VCGStats();
+	for (unsigned int r=0; r < 2; r++)
+		join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, b, res, 7, 8, 1, 0, &stats);
+	mismatches += stats.dsCacheHits + stats.dsCacheMisses + DSCacheControl::size();
+
+	DSCacheControl::set_capacity(DS_CACHE_DEFAULT_CAPACITY);
+	DSCacheControl::clear();
+	mismatches += DSCacheControl::size() != 0;
+	report("ds cache", mismatches);
+}
+
+
+/*
+ * The DS of B is built on the narrow ranks if every coordinate has fewer than RANK_NARROW_COUNT
+ * distinct values, and on the wide ranks otherwise. Both join as the scalar join.
+ * The steps of B are distinct (noise over a rising plane), so its gradients are distinct too.
+ */
+static void checkRankKeys() {
+	typedef UpperBoundDS::RankKey<VALUE> Key;
+	typedef FastJoinFunc<VALUE, DIM, UpperBoundDS::MultiBinarySearchTreeFull> Fast;
+	if (std::is_same<Key::type, Key::narrow>::value)
+		return;
+
+	std::mt19937 gen(5);
+	std::uniform_real_distribution<double> noise(0, 1 << 21);
+	for (unsigned int cells : {CHECK_INPUT_CELLS, CHECK_WIDE_RANK_CELLS}) {
+		bool wide = cells == CHECK_WIDE_RANK_CELLS;
+		TDVecFuncTest a(inputSize()), b(inputSize(cells));
+		fillFunc(a, 1, CONCAVE);
+		TDIndex i;
+		FOR_EACH_MAT_INDEX(b, i) {
+			double v = noise(gen);
+			FOR_EACH_DIM_D(d, DIM)
+				v += (double)i[d] * (1 << 22);
+			b[i] = (VALUE)std::round(v);
+		}
+		TDJointVecFuncTest ref(resultSize(a.size, b.size));
+		scalarJoin(a, b, ref);
+
+		VCGStats stats;
+		auto r = Fast::template build_ds<false, false>(b, 8, 1, &stats);
+		report(std::string(wide ? "wide" : "narrow") + " rank keys", wide ? !r.wide : !r.narrow);
+		for (unsigned int threadCount : {1, 4})
+			checkMethod<false, true, true>(std::string(wide ? "wide" : "narrow") + " rank keys threads " +
+					std::to_string(threadCount), 7, a, b, ref, threadCount);
+	}
+}
+
+
+/*
+ * The offline sweep and the concave engines (in their domain) join on a single thread, and
+ * count it if their pool has more than one thread. The other methods use the threads.
+ */
+static void checkSerialJoins() {
+	TDVecFuncTest a(inputSize()), b(inputSize());
+	fillFunc(a, 1, CONCAVE);
+	fillFunc(b, 2, CONCAVE);
+	TDIndex res_size = resultSize(a.size, b.size);
+
+	// A thread count of zero is all the cores.
+	for (unsigned int threadCount : {0, 1, 4}) {
+		for (unsigned int method : {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}) {
+			TDJointVecFuncTest res(res_size);
+			VCGStats stats;
+			join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a, b, res, method,
+					8, threadCount, 0, &stats);
+
+			bool serial = WorkStealingPool::shared(threadCount).size() > 1 && (method == 11 || (method == 12 && DIM == 1) ||
+					method == 13 || method == 14);
+			report("serial joins method " + std::to_string(method) + " threads " +
+					std::to_string(threadCount), stats.serialJoins != (serial ? 1u : 0u));
+		}
+	}
+}
+
+
+/*
+ * The joins of concurrent threads share the process wide pool (a run that is concurrent with
+ * another one is serial), and get the values of the scalar join.
+ */
+static void checkConcurrentJoins() {
+	TDVecFuncTest a(inputSize()), b(inputSize());
+	fillFunc(a, 1, CONCAVE);
+	fillFunc(b, 2, CONCAVE);
+	TDIndex res_size = resultSize(a.size, b.size);
+	TDJointVecFuncTest ref(res_size);
+	scalarJoin(a, b, ref);
+
+	const unsigned int n = 4;
+	std::vector<std::unique_ptr<TDJointVecFuncTest>> res;
+	std::vector<std::thread> threads;
+	for (unsigned int t=0; t < n; t++)
+		res.emplace_back(new TDJointVecFuncTest(res_size));
+	for (unsigned int t=0; t < n; t++) {
+		threads.emplace_back([&, t] () {
+			TDVecFuncTest a_copy(a.size), b_copy(b.size);
+			copyFunc(a, a_copy);
+			copyFunc(b, b_copy);
+			VCGStats stats;
+			join_vecfunc<VALUE, DIM, 1, false, true, true, false, false, false>(a_copy, b_copy, *res[t],
+					t % 2 == 0 ? 7 : 10, 8, 4, 0, &stats);
+		});
+	}
+	for (auto& th : threads)
+		th.join();
+
+	unsigned long mismatches = 0;
+	TDIndex i;
+	for (unsigned int t=0; t < n; t++) {
+		FOR_EACH_MAT_INDEX(ref, i) {
+			if ((*res[t])[i] != ref[i])
+				mismatches++;
+		}
+	}
+	report("concurrent joins", mismatches);
+}
+
+
+/*
+ * A run that is nested in a task of a run (on the calling thread or on a worker) is serial, and
+ * runs all its tasks.
+ */
+static void checkNestedRuns() {
+	const unsigned int n = 16;
+	WorkStealingPool::Shared pool = WorkStealingPool::shared(4);
+	std::vector<unsigned int> counts(n, 0);
+	std::vector<unsigned int> workers(n, 0);
+	pool.run(n, [&] (unsigned int task, unsigned int) {
+		pool.run(n, [&] (unsigned int, unsigned int w) {
+			counts[task]++;
+			workers[task] = std::max(workers[task], w);
+		});
+	});
+
+	unsigned long mismatches = 0;
+	for (unsigned int t=0; t < n; t++)
+		mismatches += (counts[t] != n) + (workers[t] != 0);
+	report("nested runs", mismatches);
+}
+
+
+/*
+ * A task that throws on the calling thread ends its run (after the workers are done), and the
+ * next run is parallel again.
+ */
+static void checkRunException() {
+	const unsigned int n = 16;
+	WorkStealingPool::Shared pool = WorkStealingPool::shared(4);
+	bool thrown = false;
+	try {
+		// The workers are slow, so the calling thread runs tasks of its own.
+		pool.run(n, [&] (unsigned int, unsigned int w) {
+			if (w == 0)
+				throw std::runtime_error("task");
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		});
+	} catch (const std::runtime_error&) {
+		thrown = true;
+	}
+
+	std::vector<unsigned int> counts(n, 0);
+	unsigned int maxWorker = 0;
+	std::mutex lock;
+	pool.run(n, [&] (unsigned int task, unsigned int w) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		std::lock_guard<std::mutex> guard(lock);
+		counts[task]++;
+		maxWorker = std::max(maxWorker, w);
+	});
+
+	unsigned long mismatches = !thrown + (maxWorker == 0);
+	for (unsigned int t=0; t < n; t++)
+		mismatches += counts[t] != 1;
+	report("run exception", mismatches);
+}
+
+
+/*
+ * The auto selection probes the methods on copies of the input functions, so it leaves them as
+ * they are, also if they are not rising. Its decisions are kept apart per chunk size and thread
+ * count.
+ */
+static void checkAutoSelect() {
+	TDVecFuncTest a(inputSize()), b(inputSize());
+	fillFunc(a, 1, CONCAVE);
+	fillFunc(b, 2, CONCAVE);
+	a.m[a.total_size() - 1] = 0;
+	b.m[b.total_size() - 1] = 0;
+
+	TDVecFuncTest a_copy(a.size), b_copy(b.size);
+	copyFunc(a, a_copy);
+	copyFunc(b, b_copy);
+	TDJointVecFuncTest res(resultSize(a.size, b.size));
+	unsigned int method = JOIN_VECFUNC_AUTO, chunkSize = 8;
+	join_vecfunc_auto_select<VALUE, DIM, 1, false, true, true, false, false, false>(a_copy, b_copy, res,
+			method, chunkSize, 1, 0);
+
+	unsigned long mismatches = method == JOIN_VECFUNC_AUTO;
+	TDIndex i;
+	FOR_EACH_MAT_INDEX(a, i) {
+		if (a_copy[i] != a[i] || b_copy[i] != b[i])
+			mismatches++;
+	}
+	report("auto select inputs", mismatches);
+
+	typedef JoinAutoTune<VALUE, DIM> Tune;
+	std::string key = Tune::key<false, true, true>(a, b, res, 8, 1);
+	report("auto select key", (key == Tune::key<false, true, true>(a, b, res, 16, 1)) +
+			(key == Tune::key<false, true, true>(a, b, res, 8, 8)));
+}
+
+
+/*
+ * The max only join of A and B is the maximum of their scalar join in RES_SIZE. The result sizes
+ * are the full join, smaller than A + B, and smaller than A. The unsigned case joins copies of the
+ * inputs in uint32 (their values are small integers, so the copies are exact).
+ */
+static void checkMaxJoin() {
+	TDIndex aSize = inputSize(), bSize = inputSize(CHECK_INPUT_CELLS / 2);
+	TDIndex fullSize, smallSize;
+	FOR_EACH_DIM_D(d, DIM) {
+		fullSize[d] = aSize[d] + bSize[d] - 1;
+		smallSize[d] = std::max(1u, aSize[d] / 2);
+	}
+
+	for (FuncKind kind : {CONCAVE, FLAT}) {
+		TDVecFuncTest a(aSize), b(bSize);
+		fillFunc(a, 1, kind);
+		fillFunc(b, 2, kind);
+		VecFuncTest<uint32_t, DIM> a32(aSize), b32(bSize);
+		std::copy(a.m, a.m + a.total_size(), a32.m);
+		std::copy(b.m, b.m + b.total_size(), b32.m);
+
+		for (const TDIndex& resSize : {fullSize, resultSize(aSize, bSize), smallSize}) {
+			TDJointVecFuncTest res(resSize);
+			scalarJoin(a, b, res);
+			VALUE ref = 0;
+			TDIndex i;
+			FOR_EACH_MAT_INDEX(res, i)
+				ref = std::max(ref, res[i]);
+
+			VCGStats stats;
+			unsigned long mismatches = join_vecfunc_max(a, b, resSize, &stats) != ref;
+			mismatches += join_vecfunc_max(a32, b32, resSize, &stats) != (uint32_t)ref;
+			report(std::string("max join ") + (kind == CONCAVE ? "concave" : "flat") + " res " +
+					std::to_string(resSize.size()), mismatches);
+		}
+	}
+}
+
+
+/*
+ * The private values are the maximum of each function in the box of its allocation (as the joins
+ * fix the functions to be rising, and as private_value() in Python), so they sum to the social
+ * welfare also if the functions are not rising. The social welfare is that of a scalar join
+ * chain of the rising functions, and the inputs are not modified.
+ * The inputs have integer (or half) values, so the sums are exact also in floating point.
+ */
+static void checkPayments() {
+	const unsigned int n = 3;
+	TDIndex limit = inputSize();
+	std::vector<std::unique_ptr<TDVecFuncTest>> orig, input, rising;
+	std::vector<VecFunc<VALUE, DIM>> funcs;
+	for (unsigned int i=0; i < n; i++) {
+		orig.emplace_back(new TDVecFuncTest(inputSize()));
+		input.emplace_back(new TDVecFuncTest(inputSize()));
+		rising.emplace_back(new TDVecFuncTest(inputSize()));
+		TDVecFuncTest& f = *orig[i];
+		fillFunc(f, i + 1, CONCAVE);
+		for (unsigned long k=0; k < f.total_size(); k++) {
+			if (k % 7 == 3)
+				f.m[k] /= 2;
+		}
+		copyFunc(f, *input[i]);
+		copyFunc(f, *rising[i]);
+		rising[i]->fix_rising();
+		funcs.push_back(VecFunc<VALUE, DIM>(input[i]->m, input[i]->size));
+	}
+
+	TDIndex allocs[n];
+	VALUE payments[n];
+	VCGStats stats;
+	VALUE sw = VCGPayments<VALUE, DIM>::template vcg_payments<false, true, true, false, false, false>(
+			funcs, limit, 7, 8, 1, 0, allocs, payments, &stats);
+
+	TDIndex size, i;
+	FOR_EACH_DIM_D(d, DIM)
+		size[d] = std::min(2 * limit[d] - 1, limit[d] + 1);
+	TDJointVecFuncTest ab(size);
+	scalarJoin(*rising[0], *rising[1], ab);
+	FOR_EACH_DIM_D(d, DIM)
+		size[d] = std::min(ab.size[d] + limit[d] - 1, limit[d] + 1);
+	TDJointVecFuncTest abc(size);
+	scalarJoin(ab, *rising[2], abc);
+	VALUE refSw = 0;
+	FOR_EACH_MAT_INDEX(abc, i)
+		refSw = std::max(refSw, abc[i]);
+
+	unsigned long mismatches = sw != refSw;
+	VALUE valuesSum = 0;
+	for (unsigned int k=0; k < n; k++) {
+		TDIndex boxLimit;
+		FOR_EACH_DIM_D(d, DIM)
+			boxLimit[d] = allocs[k][d] + 1;
+		VALUE value = VCGPayments<VALUE, DIM>::box_max(*orig[k], boxLimit);
+		valuesSum += value;
+		if (value != (*rising[k])[allocs[k]] || value < payments[k])
+			mismatches++;
+		FOR_EACH_MAT_INDEX(*orig[k], i) {
+			if ((*orig[k])[i] != (*input[k])[i])
+				mismatches++;
+		}
+	}
+	if (valuesSum != sw)
+		mismatches++;
+	report("payments private values", mismatches);
+}
+
+
+/*
+ * The maximal social welfare of FUNCS (rising) up to LIMIT: the maximum of their scalar join chain.
+ */
+static VALUE scalarChainMax(const std::vector<const TDVecFuncTest*>& funcs, const TDIndex& limit) {
+	TDIndex boxLimit, size;
+	FOR_EACH_DIM_D(d, DIM)
+		boxLimit[d] = limit[d] + 1;
+	if (funcs.size() == 1)
+		return VCGPayments<VALUE, DIM>::box_max(*funcs[0], boxLimit);
+
+	std::unique_ptr<TDJointVecFuncTest> chain;
+	for (unsigned int k=1; k < funcs.size(); k++) {
+		const VecFunc<VALUE, DIM>& a = k == 1 ? (const VecFunc<VALUE, DIM>&)*funcs[0] : *chain;
+		FOR_EACH_DIM_D(d, DIM)
+			size[d] = std::min(a.size[d] + funcs[k]->size[d] - 1, boxLimit[d]);
+		std::unique_ptr<TDJointVecFuncTest> res(new TDJointVecFuncTest(size));
+		scalarJoin(a, *funcs[k], *res);
+		chain = std::move(res);
+	}
+
+	VALUE ret = 0;
+	TDIndex i;
+	FOR_EACH_MAT_INDEX(*chain, i)
+		ret = std::max(ret, (*chain)[i]);
+	return ret;
+}
+
+
+/*
+ * The payment of each allocated player is the social welfare of the others (a scalar join chain
+ * without it) minus the social welfare of the others in the allocation, and zero otherwise.
+ */
+static void checkPaymentsReference() {
+	TDIndex limit = inputSize();
+	for (unsigned int n=2; n <= 6; n++) {
+		std::vector<std::unique_ptr<TDVecFuncTest>> input;
+		std::vector<VecFunc<VALUE, DIM>> funcs;
+		for (unsigned int i=0; i < n; i++) {
+			input.emplace_back(new TDVecFuncTest(inputSize()));
+			fillFunc(*input[i], i + 1, CONCAVE);
+			for (unsigned long k=0; k < input[i]->total_size(); k++)
+				input[i]->m[k] += (VALUE)i;
+			funcs.push_back(VecFunc<VALUE, DIM>(input[i]->m, input[i]->size));
+		}
+
+		for (unsigned int threadCount : {1, 4}) {
+			std::vector<TDIndex> allocs(n);
+			std::vector<VALUE> payments(n);
+			VCGStats stats;
+			VALUE sw = VCGPayments<VALUE, DIM>::template vcg_payments<false, true, true, false, false, false>(
+					funcs, limit, 7, 8, threadCount, 0, allocs.data(), payments.data(), &stats);
+
+			std::vector<const TDVecFuncTest*> all;
+			for (auto& f : input)
+				all.push_back(f.get());
+			unsigned long mismatches = sw != scalarChainMax(all, limit);
+			for (unsigned int i=0; i < n; i++) {
+				std::vector<const TDVecFuncTest*> others;
+				for (unsigned int k=0; k < n; k++) {
+					if (k != i)
+						others.push_back(input[k].get());
+				}
+				TDIndex boxLimit;
+				bool allocated = false;
+				FOR_EACH_DIM_D(d, DIM) {
+					boxLimit[d] = allocs[i][d] + 1;
+					allocated = allocated || allocs[i][d] > 0;
+				}
+				VALUE value = VCGPayments<VALUE, DIM>::box_max(*input[i], boxLimit);
+				VALUE ref = allocated ? (VALUE)(scalarChainMax(others, limit) - (sw - value)) : 0;
+				if (payments[i] != ref)
+					mismatches++;
+			}
+			report("payments reference players " + std::to_string(n) + " threads " +
+					std::to_string(threadCount), mismatches);
+		}
+	}
+}
+
+
+/*
+ * The chains of the payments join each player in a buffer of their own, so the DS cache is keyed
+ * by the content: the suffix chain reuses the DSs of the prefix chain.
+ */
+static void checkPaymentsDSCache() {
+	const unsigned int n = 6;
+	std::vector<std::unique_ptr<TDVecFuncTest>> input;
+	std::vector<VecFunc<VALUE, DIM>> funcs;
+	for (unsigned int i=0; i < n; i++) {
+		input.emplace_back(new TDVecFuncTest(inputSize()));
+		fillFunc(*input[i], i + 1, CONCAVE);
+		// The seeds may give the same rounded weights, so each player gets an offset of its own.
+		for (unsigned long k=0; k < input[i]->total_size(); k++)
+			input[i]->m[k] += (VALUE)i;
+		funcs.push_back(VecFunc<VALUE, DIM>(input[i]->m, input[i]->size));
+	}
+
+	TDIndex allocs[n];
+	VALUE payments[n];
+	VCGStats stats;
+	DSCacheControl::set_capacity(CHECK_DS_CACHE_CAPACITY);
+	DSCacheControl::clear();
+	VCGPayments<VALUE, DIM>::template vcg_payments<false, true, true, false, false, false>(
+			funcs, inputSize(), 7, 8, 1, 0, allocs, payments, &stats);
+	DSCacheControl::set_capacity(DS_CACHE_DEFAULT_CAPACITY);
+	DSCacheControl::clear();
+	report("payments ds cache", (stats.dsCacheHits != n-2) + (stats.dsCacheMisses != n-1));
+}
+
+
+int main() {
+	std::cout << "DIM: " << DIM << " VALUE: " << sizeof(VALUE) * 8 << " bits" << std::endl;
+	checkDomains();
+	for (unsigned int threadCount : {1, 4}) {
+		for (FuncKind kind : {CONCAVE, FLAT, LNATURAL}) {
+			checkMethods(kind == CONCAVE ? "concave" : kind == FLAT ? "flat" : "l-natural", kind,
+					threadCount, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16});
+		}
+		// The DS methods sort and build in tasks only above a size. The flat values stay exact.
+		checkMethods("large flat", FLAT, threadCount, {2, 3, 4, 5, 6, 7, 8, 9, 16},
+				CHECK_LARGE_INPUT_CELLS);
+	}
+	checkRankKeys();
+	checkMemoryBudget();
+	checkDSCache();
+	checkSerialJoins();
+	checkConcurrentJoins();
+	checkNestedRuns();
+	checkRunException();
+	checkAutoSelect();
+	checkMaxJoin();
+	checkPayments();
+	checkPaymentsReference();
+	checkPaymentsDSCache();
+
+	std::cout << (failures > 0 ? "FAILED: " : "PASSED") ;
+	if (failures > 0)
+		std::cout << failures;
+	std::cout << std::endl;
+	return failures > 0 ? 1 : 0;
+}
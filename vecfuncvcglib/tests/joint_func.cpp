@@ -60,13 +60,14 @@ TDVecFuncTest readVal(std::ifstream& infile) {
 
 int main(int argc, char **argv) {
 	if (argc < 2) {
-		std::cout << "Required arguments: <input path> [<repeat>, <method>, <chunk size>]" << std::endl;
+		std::cout << "Required arguments: <input path> [<repeat>, <method>, <chunk size>, <threads>]" << std::endl;
 		return 1;
 	}
     std::ifstream infile(argv[1]);
     unsigned int repeat = 1;
     unsigned int chunkSize = 512;
     unsigned int method = 0;
+    unsigned int threadCount = 1;
 
     if (argc > 2)
         repeat = (unsigned int)strtoul(argv[2], NULL, 10);
@@ -74,6 +75,8 @@ int main(int argc, char **argv) {
     	method = (unsigned int)strtoul(argv[3], NULL, 10);
     if (argc > 4)
     	chunkSize = (unsigned int)strtoul(argv[4], NULL, 10);
+    if (argc > 5)
+    	threadCount = (unsigned int)strtoul(argv[5], NULL, 10);
 
     unsigned int input_ndim;
 	infile >> input_ndim;
@@ -91,7 +94,7 @@ int main(int argc, char **argv) {
     VCGStats stats("TEST");
     for (unsigned int i=0; i<repeat; i++)
     	join_vecfunc<VALUE, DIM, 1, true, true, false, true, true, true>(a, b, res,
-    			(unsigned int)method, chunkSize, &stats);
+    			(unsigned int)method, chunkSize, threadCount, 0, &stats);
     stats.print();
 
     double total_sum = res.sum<double>();
@@ -0,0 +1,130 @@
+"""
+Author: Liran Funaro <liran.funaro@gmail.com>
+
+Copyright (C) 2006-2018 Liran Funaro
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+"""
+import sys
+import numpy as np
+
+from vecfunc_vcg import joint_func, native_joint_func
+from vecfunc_vcg.vecfuncvcglib import join_max
+
+
+failures = 0
+
+
+def report(name, mismatches):
+    global failures
+    if mismatches > 0:
+        failures += 1
+    print(("FAIL " if mismatches > 0 else "OK   ") + name + (" (%s mismatches)" % mismatches if mismatches else ""))
+
+
+def rising_func(rng, dtype, ndim=2):
+    """ A rising function with integer values, so the sums are exact also in floating point """
+    f = rng.integers(0, 50, size=tuple(rng.integers(3, 10, size=ndim))).astype(dtype)
+    for d in range(ndim):
+        f = np.maximum.accumulate(f, axis=d)
+    return f
+
+
+def scalar_join_max(funcs, max_alloc):
+    """ The maximal social welfare of the (rising) functions up to MAX_ALLOC, by a plain max-plus join chain """
+    limit = np.add(np.broadcast_to(max_alloc, (funcs[0].ndim,)), 1)
+    res = funcs[0][tuple(slice(0, l) for l in limit)]
+    for f in funcs[1:]:
+        shape = tuple(np.minimum(np.add(res.shape, f.shape) - 1, limit))
+        joined = np.full(shape, np.iinfo(f.dtype).min if f.dtype.kind in 'iu' else -np.inf, dtype=f.dtype)
+        for i in np.ndindex(res.shape):
+            box = tuple(slice(a, min(a + s, l)) for a, s, l in zip(i, f.shape, shape))
+            part = f[tuple(slice(0, b.stop - b.start) for b in box)]
+            joined[box] = np.maximum(joined[box], res[i] + part)
+        res = joined
+    return res.max()
+
+
+def reference_payments(funcs, max_alloc, allocs, sw):
+    """
+    The payment of each allocated player: the social welfare of the others minus the social welfare of
+    the others in the allocation. Zero otherwise.
+    """
+    payments = []
+    for i, (f, a) in enumerate(zip(funcs, allocs)):
+        if all(x == 0 for x in a):
+            payments.append(0)
+            continue
+        value = np.max(f[tuple(slice(0, x + 1) for x in a)])
+        payments.append(scalar_join_max(funcs[:i] + funcs[i+1:], max_alloc) - (sw - value))
+    return payments
+
+
+def check_join_max(seed=0):
+    """
+    The max only join (vcg_join_max) is the maximum of the scalar join of the two functions.
+    The small limits give a result smaller than the sum of the shapes.
+    """
+    rng = np.random.default_rng(seed)
+    for dtype in ('float64', 'int64', 'uint32'):
+        for small in (False, True):
+            f1, f2 = rising_func(rng, dtype), rising_func(rng, dtype)
+            if small:
+                max_alloc = tuple(rng.integers(1, np.minimum(f1.shape, f2.shape)))
+            else:
+                max_alloc = tuple(np.add(f1.shape, f2.shape))
+            ret, _ = join_max(f1, f2, max_alloc)
+            report("join max %s%s" % (dtype, " small" if small else ""),
+                   int(ret != scalar_join_max([f1, f2], max_alloc)))
+
+
+def check_payments(seed=0):
+    """ The 'chain' strategy and the native payments are the payments of the scalar joins """
+    rng = np.random.default_rng(seed)
+    for n in range(2, 7):
+        for dtype in ('float64', 'int64'):
+            funcs = [rising_func(rng, dtype) for _ in range(n)]
+            max_alloc = tuple(rng.integers(4, 12, size=2))
+            ref_sw = scalar_join_max(funcs, max_alloc)
+            for name, solve in (('chain', joint_func), ('native', native_joint_func)):
+                ret = solve(funcs, max_alloc, join_method=7)
+                ref = reference_payments(funcs, max_alloc, ret['allocations'], ret['sw'])
+                mismatches = int(not np.isclose(ret['sw'], ref_sw)) + \
+                    int(np.sum(~np.isclose(ret['payments'], ref)))
+                report("%s payments players %s %s" % (name, n, dtype), mismatches)
+
+
+def check_divide_payments(seed=0):
+    """
+    The 'divide' strategy (leave_one_out_max()) gives the payments of the 'chain' strategy, for two
+    players (a single split) and for odd and even numbers of players (unbalanced and balanced trees).
+    """
+    rng = np.random.default_rng(seed)
+    for n in range(2, 8):
+        for dtype in ('float64', 'int64'):
+            funcs = [rising_func(rng, dtype) for _ in range(n)]
+            max_alloc = tuple(rng.integers(4, 12, size=2))
+            chain = joint_func(funcs, max_alloc, join_method=7, payment_strategy='chain')
+            divide = joint_func(funcs, max_alloc, join_method=7, payment_strategy='divide')
+            mismatches = int(not np.isclose(chain['sw'], divide['sw'])) + \
+                int(np.sum(~np.isclose(chain['payments'], divide['payments'])))
+            report("divide payments players %s %s" % (n, dtype), mismatches)
+
+
+if __name__ == '__main__':
+    check_join_max()
+    check_payments()
+    check_divide_payments()
+    print("FAILED: %s" % failures if failures > 0 else "PASSED")
+    sys.exit(1 if failures > 0 else 0)
@@ -40,6 +40,7 @@ class UpperBound1DF : public BaseUpperBoundRangeDS<T,S,D> {
 public:
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
 
 private:
@@ -55,20 +56,47 @@ public:
 		this->sortHelperByDim(0, cmpDim, 0, this->size);
 	}
 
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize __attribute__((unused))) {
+    	return (unsigned long)size * sizeof(point_id);
+    }
+
     unsigned int query(const point_vec& upper) {
     	auto arr = this->helperArray(0);
-		if (!(arr[0]->vector[cmpDim] < upper[cmpDim]))
+		if (!(this->key(arr[0], cmpDim) < upper[cmpDim]))
 			res_h = 0;
-		else if (arr[this->size-1]->vector[cmpDim] < upper[cmpDim])
+		else if (this->key(arr[this->size-1], cmpDim) < upper[cmpDim])
 			res_h = this->size;
 		else
 			res_h = this->binarySearchUpper(arr, 0, this->size, upper, cmpDim);
         return res_h;
     }
 
+    // The count is over BUDGET if the point in the BUDGET position is below UPPER.
+    unsigned int queryBudget(const point_vec& upper, unsigned int budget) {
+    	auto arr = this->helperArray(0);
+    	if (budget < this->size && this->key(arr[budget], cmpDim) < upper[cmpDim]) {
+    		res_h = 0;
+    		return QUERY_OVER_BUDGET;
+    	}
+    	return query(upper);
+    }
+
+    static void queryBatchBudget(UpperBound1DF* const* lanes, const point_vec* uppers,
+    		const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = lanes[i]->queryBudget(uppers[i], budgets[i]);
+    }
+
+    // The result is below UPPER in CMP_DIM, so it is certified if the box is below in the other dims.
+	template <bool FILTER, class F>
+    void forEachCandidate(const point_vec& upper, F& f) {
+        this->template visitHelperRange<FILTER>(0, 0, res_h, upper,
+        		this->boxBelow(this->boxMax, upper, 1u << cmpDim), f);
+    }
+
 	template <bool FILTER>
     unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-        return this->template appendMultipleResultPoint<FILTER>(0, 0, res_h, ret, 0, upper);
+        return this->template fetchCandidates<FILTER>(*this, upper, ret);
     }
 };
 
@@ -82,6 +110,7 @@ class UpperBound1DFMulti : public BaseUpperBoundRangeDS<T,S,D> {
 public:
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
 
 private:
@@ -92,17 +121,29 @@ public:
     UpperBound1DFMulti(const shared_points& pts, unsigned int chunkSize) :
 		BaseUpperBoundRangeDS<T, S, D>(pts, chunkSize) {
 		this->allocHelperArrays(D);
-		for (unsigned int dim=0; dim<D; dim++) {
+		BuildThreads::run(D, [this] (unsigned int dim) {
 			this->fillHelperArray(dim);
 			this->sortHelperByDim(dim, dim, 0, this->size);
-		}
+		});
+    }
+
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize __attribute__((unused))) {
+    	return (unsigned long)size * D * sizeof(point_id);
     }
 
     unsigned int query(const point_vec& upper) {
+    	return queryBudget(upper, QUERY_NO_BUDGET);
+    }
+
+    /*
+     * The points below L are below UPPER in the chosen dim, so the search stops as soon as L
+     * passes the BUDGET.
+     */
+    unsigned int queryBudget(const point_vec& upper, unsigned int budget) {
         // Optimization: Check first if all the dims have value lower than upper.
         for (unsigned int i=0; i<D; i++) {
         	auto arr = this->helperArray(i);
-            if (!(arr[0]->vector[i] < upper[i])){
+            if (!(this->key(arr[0], i) < upper[i])){
                 res_h = 0;
                 res_dim = 0;
                 return 0;
@@ -128,7 +169,7 @@ public:
             for (unsigned int i=0; i<participatingDimsCount; i++) {
                 unsigned int curDim = participatingDims[i];
                 auto arr = this->helperArray(curDim);
-                if (!(arr[mid]->vector[curDim] < upper[curDim])) {
+                if (!(this->key(arr[mid], curDim) < upper[curDim])) {
                 	nextParticipatingDims[nextParticipatingDimsCount++] = curDim;
                 }
             }
@@ -138,23 +179,46 @@ public:
             	participatingDimsCount = nextParticipatingDimsCount;
 
                 h = mid; // Go left
-            } else
+            } else {
                 l = mid+1; // Go right
+                if (l > budget)
+                	break;
+            }
         }
 
         res_dim = participatingDims[0];
+        if (l > budget) {
+        	res_h = 0;
+        	return QUERY_OVER_BUDGET;
+        }
         if (l < h)
         	res_h = this->binarySearchUpperHelperByDim(res_dim, l, h, upper, res_dim);
 		else
 			res_h = h;
 
+        if (res_h > budget) {
+        	res_h = 0;
+        	return QUERY_OVER_BUDGET;
+        }
         return res_h;
     }
 
+    static void queryBatchBudget(UpperBound1DFMulti* const* lanes, const point_vec* uppers,
+    		const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = lanes[i]->queryBudget(uppers[i], budgets[i]);
+    }
+
+    // The result is below UPPER in RES_DIM, so it is certified if the box is below in the other dims.
+	template <bool FILTER, class F>
+    void forEachCandidate(const point_vec& upper, F& f) {
+        this->template visitHelperRange<FILTER>(res_dim, 0, res_h, upper,
+        		this->boxBelow(this->boxMax, upper, 1u << res_dim), f);
+    }
+
 	template <bool FILTER>
     unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-        return this->template appendMultipleResultPoint<FILTER>(res_dim, 0, res_h,
-        		ret, 0, upper);
+        return this->template fetchCandidates<FILTER>(*this, upper, ret);
     }
 };
 
@@ -167,11 +231,16 @@ public:
     using point = typename BaseUpperBoundDataStruct<T,S,D>::point;
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
+    using Range = typename BaseUpperBoundRangeDS<T,S,D>::Range;
+    using BatchSearch = typename BaseUpperBoundRangeDS<T,S,D>::BatchSearch;
 
 private:
     unsigned int d1 = 0, d2 = 1;
-    std::unique_ptr<T[]> sortedD1;
+    SharedArray<T> sortedD1;
+    // The upper corners of the bounding boxes of the nodes (see nodeIndex()).
+    SharedArray<point_vec> nodeBoxes;
 
 public:
     UpperBoundBinarySearchTree2DF(const shared_points& pts, unsigned int chunkSize,
@@ -182,6 +251,17 @@ public:
 
     UpperBoundBinarySearchTree2DF() : BaseUpperBoundRangeDS<T, S, D>() {}
 
+    unsigned long memoryFootprint() const {
+    	return estimateFootprint(this->size, this->chunkSize);
+    }
+
+    // The merge levels, the sorted coordinates of D1, and the boxes of the nodes.
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize) {
+    	unsigned int maxDepth = BaseUpperBoundDataStruct<T,S,D>::treeDepth(size, chunkSize);
+    	return (unsigned long)size * ((maxDepth + 1) * sizeof(point_id) + sizeof(T)) +
+    			BaseUpperBoundRangeDS<T,S,D>::nodeCount(maxDepth) * sizeof(point_vec);
+    }
+
 	void init(const shared_points& pts, unsigned int chunkSize,
 			unsigned int d1, unsigned int d2) {
 		this->baseInit(pts, chunkSize);
@@ -196,6 +276,7 @@ private:
 
 		this->allocHelperArrays(this->maxDepth+1);
 		sortedD1.reset(new T[this->size]);
+		nodeBoxes.reset(new point_vec[BaseUpperBoundRangeDS<T,S,D>::nodeCount(this->maxDepth)]);
 		buildTree();
 	}
 
@@ -207,93 +288,166 @@ private:
     	this->fillHelperArray(this->maxDepth);
 		this->sortHelperByDim(this->maxDepth, d1, 0, this->size);
 
-		p_point* helper_arr = this->helperArray(this->maxDepth);
+		point_id* helper_arr = this->helperArray(this->maxDepth);
 		for (unsigned int i=0; i<this->size; i++)
-			sortedD1[i] = helper_arr[i]->vector[d1];
+			sortedD1[i] = this->key(helper_arr[i], d1);
+		this->buildNodeBoxes(helper_arr, nodeBoxes.get());
 
     	auto arr = this->helperArray(this->maxDepth);
-    	for (unsigned int i=0; i < splitCount; i++)
-    		this->sortPointsByDim(arr+splits[i], arr+splits[i+1], d2);
+    	this->sortLeavesParallel(arr, splits.get(), splitCount, d2);
 
+    	// The split pairs of a level are merged in parallel (see mergeParallel()).
+    	std::vector<typename BaseUpperBoundRangeDS<T,S,D>::MergeJob> jobs;
     	unsigned int splitJump = 1;
     	for (unsigned int depth=this->maxDepth; depth > 0; depth--) {
     		auto arrSrc = this->helperArray(depth);
 			auto arrDst = this->helperArray(depth-1);
+			jobs.clear();
     		for (unsigned int i=0; i < splitCount; i += 2*splitJump) {
     			auto left = arrSrc + splits[i];
 				auto mid = arrSrc + splits[i + splitJump];
 				auto top = arrSrc + splits[i + 2 * splitJump];
 				auto dst = arrDst + splits[i];
-				this->mergePointsByDim(left, mid, mid, top, dst, d2);
+				jobs.push_back({left, mid, top, dst, d2});
     		}
+    		this->mergeParallel(jobs);
 
     		splitJump *= 2;
     	}
 	}
 
-	void addResultRange(const point_vec& upper, unsigned int lo, unsigned int hi,
-			unsigned int depth) {
-		hi = this->binarySearchUpperHelperByDim(depth, lo, hi, upper, d2);
-		if (lo < hi)
-			this->res.pushRange(lo, hi, depth);
-	}
-
-public:
-    unsigned int query(const point_vec& upper) {
-    	this->res.reset();
-        unsigned int l = 0;
-        unsigned int h = this->size;
-        unsigned int depth = 0;
+    /*
+     * A single step of the query's descent on D1.
+     * The left ranges are pushed with an unresolved upper limit (see resolveRanges()). They are
+     * below UPPER in D1, so they are pushed as certified (in D1 only, until they are resolved).
+     * Returns false when the descent is done.
+     */
+    inline bool descendStep(const point_vec& upper, unsigned int& l, unsigned int& h,
+    		unsigned int& depth) {
+        if (depth >= this->maxDepth)
+        	return false;
 
         T d1_pivot = upper[d1];
         auto sortedD1_raw = sortedD1.get();
 
-        while (depth < this->maxDepth) {
-            // Optimization
-            if (sortedD1_raw[h-1] < d1_pivot)
-            	// If the right most is smaller, than we include all the points in the range.
-                break;
-            if (!(sortedD1_raw[l] < d1_pivot)) {
-            	// If the left most is bigger, than we don't include anything from that range.
-                l = h;
-                break;
-            }
+        // Optimization
+        if (sortedD1_raw[h-1] < d1_pivot) {
+        	// If the right most is smaller, than we include all the points in the range.
+        	this->res.pushRange(l, h, depth, UpperBoundRangeDSResults::None, true);
+        	l = h;
+            return false;
+        }
+        if (!(sortedD1_raw[l] < d1_pivot)) {
+        	// If the left most is bigger, than we don't include anything from that range.
+            l = h;
+            return false;
+        }
 
-            unsigned int mid = this->calcMid(l, h);
+        unsigned int mid = this->calcMid(l, h);
+
+        /*
+		 * If the the middle point is smaller than the upper limit,
+		 * than there might be some points on the right part that
+		 * might also be smaller.
+		 * We need to add the right range as well.
+		 */
+        if(sortedD1_raw[mid] < d1_pivot) {
+            this->res.pushRange(l, mid+1, depth+1, UpperBoundRangeDSResults::None, true); // Add left
+            l = mid+1; // Go right
+        } else
+            h = mid+1; // Go left
+
+        depth++;
+        if (depth < this->maxDepth)
+        	PREFETCH(sortedD1_raw + this->calcMid(l, h));
+        return true;
+    }
 
-            /*
-			 * If the the middle point is smaller than the upper limit,
-			 * than there might be some points on the right part that
-			 * might also be smaller.
-			 * We need to add the right range as well.
-			 */
-            if(sortedD1_raw[mid] < d1_pivot) {
-                addResultRange(upper, l, mid+1, depth+1); // Add left
-                l = mid+1; // Go right
-            } else
-                h = mid+1; // Go left
+    /*
+     * Binary search the upper limit of each range on D2 (in the sorted array of its depth).
+     * A resolved range that is below UPPER in D1 is certified if the box of its node is below in
+     * the other dims.
+     */
+    static void resolveRanges(UpperBoundBinarySearchTree2DF* const* lanes, const point_vec* uppers,
+    		unsigned int count, const unsigned int* budgets, bool* over) {
+    	BaseUpperBoundRangeDS<T,S,D>::resolveRangesBatch(lanes, uppers, count,
+    			[lanes, uppers] (unsigned int i, const Range& r, BatchSearch& q, Range& out) {
+    		auto ds = lanes[i];
+    		q.arr = ds->helperArray(r.depth);
+    		q.cmpDim = ds->d2;
+    		out.sortDim = UpperBoundRangeDSResults::None;
+    		out.certified = r.certified && ds->boxBelow(ds->nodeBoxes[ds->nodeIndex(r.lo, r.depth)],
+    				uppers[i], (1u << ds->d1) | (1u << ds->d2));
+    	}, budgets, over);
+    }
 
-            depth++;
-        }
+public:
+    unsigned int query(const point_vec& upper) {
+    	UpperBoundBinarySearchTree2DF* self = this;
+    	unsigned int count;
+    	queryBatch(&self, &upper, 1, &count);
+    	return count;
+    }
 
-        if (l < h)
-            addResultRange(upper, l, h, depth);
+    unsigned int queryBudget(const point_vec& upper, unsigned int budget) {
+    	UpperBoundBinarySearchTree2DF* self = this;
+    	unsigned int count;
+    	queryBatchBudget(&self, &upper, &budget, 1, &count);
+    	return count;
+    }
 
-        return this->res.getPointCount();
+    static void queryBatch(UpperBoundBinarySearchTree2DF* const* lanes, const point_vec* uppers,
+    		unsigned int count, unsigned int* counts) {
+    	queryBatchBudget(lanes, uppers, NULL, count, counts);
     }
 
-    template <bool FILTER>
-    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-        unsigned int retCount = 0;
+    /*
+     * Interleaves the descents of the queries, and then the binary searches of their ranges.
+     * With BUDGETS, the binary searches of a query stop once its resolved ranges exceed its budget.
+     */
+    static void queryBatchBudget(UpperBoundBinarySearchTree2DF* const* lanes, const point_vec* uppers,
+    		const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+    	unsigned int l[QUERY_BATCH_SIZE], h[QUERY_BATCH_SIZE], depth[QUERY_BATCH_SIZE];
+    	bool active[QUERY_BATCH_SIZE];
+    	for (unsigned int i=0; i < count; i++) {
+    		lanes[i]->res.reset();
+    		l[i] = 0;
+    		h[i] = lanes[i]->size;
+    		depth[i] = 0;
+    		active[i] = true;
+    	}
 
+    	bool anyActive = true;
+    	while (anyActive) {
+    		anyActive = false;
+    		for (unsigned int i=0; i < count; i++) {
+    			if (!active[i])
+    				continue;
+    			active[i] = lanes[i]->descendStep(uppers[i], l[i], h[i], depth[i]);
+    			if (active[i])
+    				anyActive = true;
+    			else if (l[i] < h[i])
+    				lanes[i]->res.pushRange(l[i], h[i], depth[i]);
+    		}
+    	}
+
+    	bool over[QUERY_BATCH_SIZE];
+    	resolveRanges(lanes, uppers, count, budgets, over);
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = budgets && over[i] ? QUERY_OVER_BUDGET : lanes[i]->res.getPointCount();
+    }
+
+    template <bool FILTER, class F>
+    void forEachCandidate(const point_vec& upper, F& f) {
         while (!this->res.empty()) {
 			auto& r = this->res.popRange();
-			retCount = this->template appendMultipleResultPoint<FILTER>(r.depth, r.lo, r.hi, ret,
-					retCount, upper);
+			this->template visitHelperRange<FILTER>(r.depth, r.lo, r.hi, upper, r.certified, f);
         }
+    }
 
-
-        return retCount;
+    template <bool FILTER>
+    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
+        return this->template fetchCandidates<FILTER>(*this, upper, ret);
     }
 };
 
@@ -304,10 +458,16 @@ class UpperBoundBinarySearchTree2DFMuti : public BaseUpperBoundDataStruct<T,S,D>
 public:
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
 
 protected:
     RANGETREE_2D q[D];
+    // The dims (d1, d2) of each tree.
+    struct {
+    	unsigned int d1;
+    	unsigned int d2;
+    } qDims[D];
     unsigned int qCount = 0;
     unsigned int bestResult = 0;
 
@@ -316,7 +476,8 @@ public:
     		std::vector<unsigned int> cmpDim) :
 			BaseUpperBoundDataStruct<T, S, D>(pts, chunkSize) {
 		for (unsigned int i = 0; i < cmpDim.size(); i += J)
-			q[qCount++].init(pts, chunkSize, cmpDim[i], cmpDim[(i+1)%cmpDim.size()]);
+			qDims[qCount++] = {cmpDim[i], cmpDim[(i+1)%cmpDim.size()]};
+		initTrees(pts, chunkSize);
     }
 
     UpperBoundBinarySearchTree2DFMuti(const shared_points& pts, unsigned int chunkSize) :
@@ -332,10 +493,32 @@ public:
 				j = (i-m) % D;
 				break;
 			}
-			q[qCount++].init(pts, chunkSize, i, j);
+			qDims[qCount++] = {i, j};
 		}
+		initTrees(pts, chunkSize);
 	}
 
+private:
+    // The trees are built in parallel (see BuildThreads).
+    void initTrees(const shared_points& pts, unsigned int chunkSize) {
+    	BuildThreads::run(qCount, [&] (unsigned int k) {
+    		q[k].init(pts, chunkSize, qDims[k].d1, qDims[k].d2);
+    	});
+    }
+
+public:
+    unsigned long memoryFootprint() const {
+    	unsigned long ret = 0;
+    	for (unsigned int i = 0; i < qCount; i++)
+    		ret += q[i].memoryFootprint();
+    	return ret;
+    }
+
+    // A tree per J dims.
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize) {
+    	return ((D + J - 1) / J) * RANGETREE_2D::estimateFootprint(size, chunkSize);
+    }
+
     unsigned int query(const point_vec& upper) {
         unsigned int count = this->size+1;
         bestResult = 0;
@@ -351,6 +534,73 @@ public:
         return count;
     }
 
+    // Batches the queries of each sub tree across the lanes.
+    static void queryBatch(UpperBoundBinarySearchTree2DFMuti* const* lanes, const point_vec* uppers,
+    		unsigned int count, unsigned int* counts) {
+    	if (count == 0)
+    		return;
+
+    	RANGETREE_2D* subLanes[QUERY_BATCH_SIZE];
+    	unsigned int subCounts[QUERY_BATCH_SIZE];
+
+    	for (unsigned int j=0; j < count; j++) {
+    		counts[j] = lanes[j]->size+1;
+    		lanes[j]->bestResult = 0;
+    	}
+
+    	for (unsigned int i = 0; i < lanes[0]->qCount; i++) {
+    		for (unsigned int j=0; j < count; j++)
+    			subLanes[j] = &lanes[j]->q[i];
+    		RANGETREE_2D::queryBatch(subLanes, uppers, count, subCounts);
+
+    		for (unsigned int j=0; j < count; j++) {
+    			if (subCounts[j] < counts[j]) {
+    				counts[j] = subCounts[j];
+    				lanes[j]->bestResult = i;
+    			}
+    		}
+    	}
+    }
+
+    /*
+     * As queryBatch(), but each sub tree is queried with the best count so far as its budget,
+     * so a sub tree that cannot have the least results stops early.
+     */
+    static void queryBatchBudget(UpperBoundBinarySearchTree2DFMuti* const* lanes, const point_vec* uppers,
+    		const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+    	if (count == 0)
+    		return;
+
+    	RANGETREE_2D* subLanes[QUERY_BATCH_SIZE];
+    	unsigned int subBudgets[QUERY_BATCH_SIZE];
+    	unsigned int subCounts[QUERY_BATCH_SIZE];
+
+    	for (unsigned int j=0; j < count; j++) {
+    		counts[j] = QUERY_OVER_BUDGET;
+    		subBudgets[j] = budgets[j];
+    		lanes[j]->bestResult = 0;
+    	}
+
+    	for (unsigned int i = 0; i < lanes[0]->qCount; i++) {
+    		for (unsigned int j=0; j < count; j++)
+    			subLanes[j] = &lanes[j]->q[i];
+    		RANGETREE_2D::queryBatchBudget(subLanes, uppers, subBudgets, count, subCounts);
+
+    		for (unsigned int j=0; j < count; j++) {
+    			if (subCounts[j] < counts[j]) {
+    				counts[j] = subCounts[j];
+    				subBudgets[j] = subCounts[j];
+    				lanes[j]->bestResult = i;
+    			}
+    		}
+    	}
+    }
+
+    template <bool FILTER, class F>
+    void forEachCandidate(const point_vec& upper, F& f) {
+        q[bestResult].template forEachCandidate<FILTER>(upper, f);
+    }
+
     template <bool FILTER>
     unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
         return q[bestResult].template fetchQuery<FILTER>(upper, ret);
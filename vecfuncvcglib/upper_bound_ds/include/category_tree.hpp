@@ -57,6 +57,7 @@ public:
     using point = typename BaseUpperBoundDataStruct<T,S,D>::point;
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
 
 private:
@@ -71,15 +72,23 @@ private:
     std::vector<f2_ds> f2;
     std::vector<f_all_ds> f_all;
     std::vector<unsigned int> take_all;
+    // The upper corner of the bounding box of each take all category.
+    std::vector<point_vec> take_all_box;
 
-    std::map<unsigned int, std::vector<p_point>> m;
+    std::map<unsigned int, std::vector<point_id>> m;
 
 public:
+    /*
+     * The DSs of the categories are independent, so they are built in parallel (see
+     * BuildThreads), and kept in the order of their categories.
+     */
     CategoryTree(const shared_points& pts, unsigned int chunkSize) :
     			BaseUpperBoundRangeDS<T, S, D>(pts, chunkSize) {
     	findPointsMinimum();
     	allocateToCategories();
 
+    	std::vector<unsigned int> built;
+    	std::vector<std::vector<unsigned int>> builtIdx;
     	for (auto& it : m) {
     		auto r = it.first;
     		auto count = it.second.size();
@@ -87,7 +96,7 @@ public:
     			continue;
     		}
 			if (count <= chunkSize || r == 0) {
-				take_all.push_back(r);
+				addTakeAll(r);
 				continue;
 			}
 
@@ -101,32 +110,60 @@ public:
     		std::cout << std::endl;
 #endif
 
-    		shared_points sr(this->p_pts, this->p_helper_arr, it.second.data(), count);
+    		if (idx.size() == 0) {
+    			addTakeAll(r);
+    			continue;
+    		}
+    		built.push_back(r);
+    		builtIdx.push_back(idx);
+    	}
+
+    	std::vector<std::unique_ptr<f1_ds>> b1(built.size());
+    	std::vector<std::unique_ptr<f2_ds>> b2(built.size());
+    	std::vector<std::unique_ptr<f_all_ds>> bAll(built.size());
+    	BuildThreads::run(built.size(), [&] (unsigned int k) {
+    		auto& ids = m.at(built[k]);
+    		auto& idx = builtIdx[k];
+    		shared_points sr(this->p_pts, this->p_helper_arr, ids.data(), ids.size());
     		switch(idx.size()) {
-    		case 0:
-    			take_all.push_back(r);
-    			break;
     		case 1:
-				f1.push_back(f1_ds(sr, chunkSize, idx[0]));
+				b1[k].reset(new f1_ds(sr, chunkSize, idx[0]));
     			break;
     		case 2:
-				f2.push_back(f2_ds(sr, chunkSize, idx[0], idx[1]));
+				b2[k].reset(new f2_ds(sr, chunkSize, idx[0], idx[1]));
 				break;
     		default:
 //    			std::random_shuffle(idx.begin(), idx.end());
 //    			idx.resize(6);
-				f_all.push_back(f_all_ds(sr, chunkSize, idx));
+				bAll[k].reset(new f_all_ds(sr, chunkSize, idx));
 				break;
     		}
+    	});
+
+    	for (unsigned int k=0; k < built.size(); k++) {
+    		if (b1[k])
+    			f1.push_back(*b1[k]);
+    		else if (b2[k])
+    			f2.push_back(*b2[k]);
+    		else
+    			f_all.push_back(*bAll[k]);
     	}
     }
 
 private:
+    void addTakeAll(unsigned int r) {
+    	auto& pts = m[r];
+    	point_vec box;
+    	this->boundingBox(pts.data(), 0, pts.size(), box);
+    	take_all.push_back(r);
+    	take_all_box.push_back(box);
+    }
+
     void findPointsMinimum() {
     	for (unsigned int d=0; d<D; d++) {
     		switch(d%3) {
     		case 1:
-				minimum[d] = -MAX_VALUE;
+				minimum[d] = (T)-MAX_VALUE;
 				break;
     		case 0:
     		case 2:
@@ -154,16 +191,17 @@ private:
     void allocateToCategories() {
 		auto pts = this->p_pts.get();
 		for (unsigned int i = 0; i < this->size; i++) {
-			unsigned int r = getPointIndex(pts[i]->vector);
+			unsigned int r = getPointIndex(pts[i]);
 			m[r].push_back(pts[i]);
 		}
 	}
 
-    unsigned int getPointIndex(const point_vec& p) {
+    // The category of the point ID: the dims in which it is above the minimum.
+    unsigned int getPointIndex(point_id id) {
     	unsigned int r = 0;
 
     	for (unsigned int d=0; d < D; d++) {
-    		if (p[d] > minimum[d])
+    		if (this->key(id, d) > minimum[d])
     			r |= 1<<d;
     	}
 
@@ -171,6 +209,25 @@ private:
     }
 
 public:
+    unsigned long memoryFootprint() const {
+    	unsigned long ret = take_all_box.size() * sizeof(point_vec);
+    	for (auto& it : m)
+    		ret += it.second.size() * sizeof(point_id);
+    	for (auto& it : f1)
+    		ret += it.memoryFootprint();
+    	for (auto& it : f2)
+    		ret += it.memoryFootprint();
+    	for (auto& it : f_all)
+    		ret += it.memoryFootprint();
+    	return ret;
+    }
+
+    // The categories are only known once the points are allocated to them. At most, all the
+    // points are in a single category of all the dims.
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize) {
+    	return (unsigned long)size * sizeof(point_id) + f_all_ds::estimateFootprint(size, chunkSize);
+    }
+
     unsigned int query(const point_vec& upper) {
 		unsigned int resultCount = 0;
 		for (auto& it : take_all)
@@ -184,23 +241,61 @@ public:
 		return resultCount;
 	}
 
-	template <bool FILTER>
-	unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-		unsigned retCount = 0;
+	// Each category is queried with the budget that is left by the previous ones.
+	unsigned int queryBudget(const point_vec& upper, unsigned int budget) {
+		unsigned int resultCount = 0;
+		for (auto& it : take_all)
+			resultCount += m[it].size();
+		if (resultCount > budget)
+			return QUERY_OVER_BUDGET;
+
+		unsigned int c;
+		for (auto& it : f1) {
+			c = it.queryBudget(upper, budget - resultCount);
+			if (c == QUERY_OVER_BUDGET)
+				return c;
+			resultCount += c;
+		}
+		for (auto& it : f2) {
+			c = it.queryBudget(upper, budget - resultCount);
+			if (c == QUERY_OVER_BUDGET)
+				return c;
+			resultCount += c;
+		}
+		for (auto& it : f_all) {
+			c = it.queryBudget(upper, budget - resultCount);
+			if (c == QUERY_OVER_BUDGET)
+				return c;
+			resultCount += c;
+		}
+		return resultCount;
+	}
+
+	static void queryBatchBudget(CategoryTree* const* lanes, const point_vec* uppers,
+			const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+		for (unsigned int i=0; i < count; i++)
+			counts[i] = lanes[i]->queryBudget(uppers[i], budgets[i]);
+	}
 
-		for (auto& it : take_all) {
-			for (auto& vecIt : m[it])
-				retCount = this->template appendResultPoint<FILTER>(ret, retCount, vecIt, upper);
+	template <bool FILTER, class F>
+	void forEachCandidate(const point_vec& upper, F& f) {
+		for (unsigned int i=0; i < take_all.size(); i++) {
+			auto& pts = m[take_all[i]];
+			this->template visitResultRange<FILTER>(pts.data(), 0, pts.size(), upper,
+					this->boxBelow(take_all_box[i], upper), f);
 		}
 
 		for (auto& it : f1)
-			retCount += it.template fetchQuery<FILTER>(upper, ret+retCount);
+			it.template forEachCandidate<FILTER>(upper, f);
 		for (auto& it : f2)
-			retCount += it.template fetchQuery<FILTER>(upper, ret+retCount);
+			it.template forEachCandidate<FILTER>(upper, f);
 		for (auto& it : f_all)
-			retCount += it.template fetchQuery<FILTER>(upper, ret+retCount);
+			it.template forEachCandidate<FILTER>(upper, f);
+	}
 
-		return retCount;
+	template <bool FILTER>
+	unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
+		return this->template fetchCandidates<FILTER>(*this, upper, ret);
 	}
 };
 
@@ -40,6 +40,7 @@ public:
     using point = typename BaseUpperBoundDataStruct<T,S,D>::point;
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
 
 private:
@@ -47,11 +48,13 @@ private:
     unsigned int groupsCount=0;
     unsigned int d1=0, d2=0;
 
-    std::unique_ptr<T[]> sortedD1;
-    std::unique_ptr<T[]> sortedD2;
-    std::unique_ptr<unsigned int[]> fractional;
-    std::unique_ptr<unsigned int[]> g_ind;
-    std::unique_ptr<unsigned int[]> g_end;
+    SharedArray<T> sortedD1;
+    SharedArray<T> sortedD2;
+    SharedArray<unsigned int> fractional;
+    SharedArray<unsigned int> g_ind;
+    SharedArray<unsigned int> g_end;
+    // The upper corner of the bounding box of each group.
+    SharedArray<point_vec> g_box;
     unsigned int fractionalCount=0;
 
 
@@ -67,6 +70,24 @@ public:
 
     UpperBoundRangeTree2DFC() : BaseUpperBoundRangeDS<T, S, D>() {}
 
+    unsigned long memoryFootprint() const {
+    	return estimateFootprint(this->size, this->chunkSize);
+    }
+
+    // The number of groups of CHUNK_SIZE points (a zero chunk size is a chunk of one point).
+    static unsigned int groupsOf(unsigned int size, unsigned int chunkSize) {
+    	chunkSize = std::max(chunkSize, 1u);
+    	return (size + (chunkSize - 1)) / chunkSize;
+    }
+
+    // The fractional array has an entry per point and group, so it grows quadratically.
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize) {
+    	unsigned long groupsCount = groupsOf(size, chunkSize);
+    	return (unsigned long)size * sizeof(point_id) +
+    			groupsCount * (sizeof(T) + 2 * sizeof(unsigned int) + sizeof(point_vec)) +
+    			((unsigned long)size + 1) * (sizeof(T) + groupsCount * sizeof(unsigned int));
+    }
+
     void init(const shared_points& pts, unsigned int chunkSize,
     		unsigned int d1, unsigned int d2) {
     	this->baseInit(pts, chunkSize);
@@ -79,7 +100,7 @@ private:
 	void init() {
 		this->allocHelperArrays(1);
 
-		groupsCount = (this->size + (this->chunkSize - 1)) / this->chunkSize;
+		groupsCount = groupsOf(this->size, this->chunkSize);
 		groupsSize = (this->size + (groupsCount - 1)) / groupsCount;
 
 		sortedD1.reset(new T[groupsCount]);
@@ -87,12 +108,13 @@ private:
 		fractional.reset(new unsigned int[(this->size + 1) * groupsCount]);
 		g_ind.reset(new unsigned int[groupsCount]);
 		g_end.reset(new unsigned int[groupsCount]);
+		g_box.reset(new point_vec[groupsCount]);
 		buildTree();
 	}
 
     void buildTree() {
     	this->fillHelperArray(0);
-        p_point* depth_arr = this->helperArray(0);
+        point_id* depth_arr = this->helperArray(0);
 
         for(unsigned int g=0; g<groupsCount; g++) {
             g_ind[g] = g * groupsSize;
@@ -102,15 +124,16 @@ private:
         this->sortHelperByDim(0, d1, 0, this->size);
 
         for(unsigned int g=0; g<groupsCount; g++) {
-            sortedD1[g] = depth_arr[g_ind[g]]->vector[d1];
+            sortedD1[g] = this->key(depth_arr[g_ind[g]], d1);
             this->sortHelperByDim(0, d2, g_ind[g], g_end[g]);
+            this->boundingBox(depth_arr, g_ind[g], g_end[g], g_box[g]);
         }
 
         fractionalCascading();
     }
 
     void shortFractionalCascading() {
-        p_point* depth_arr = this->helperArray(0);
+        point_id* depth_arr = this->helperArray(0);
 
         unsigned int gc = groupsCount;
         auto in_g = std::unique_ptr<unsigned int []>(new unsigned int[groupsCount]);
@@ -121,7 +144,7 @@ private:
         unsigned int min_g = groupsCount;
 
         for(unsigned int g=0; g<groupsCount; g++) {
-            T cur_v = depth_arr[g_ind[g]]->vector[d2];
+            T cur_v = this->key(depth_arr[g_ind[g]], d2);
             if (cur_v < min_v) {
                 min_v = cur_v;
                 min_g = g;
@@ -135,11 +158,11 @@ private:
             auto g1 = in_g[0];
 
             if (gc == 1)
-                min_v = depth_arr[g_ind[g1]]->vector[d2];
+                min_v = this->key(depth_arr[g_ind[g1]], d2);
             else {
                 auto g2 = in_g[1 + std::rand() % (gc-1)];
-                T v1 = depth_arr[g_ind[g1]]->vector[d2];
-                T v2 = depth_arr[g_ind[g2]]->vector[d2];
+                T v1 = this->key(depth_arr[g_ind[g1]], d2);
+                T v2 = this->key(depth_arr[g_ind[g2]], d2);
                 min_v = v1 < v2 ? v1 : v2;
                 min_g = v1 < v2 ? g1 : g2;
                 std::swap(in_g[min_g], in_g[0]);
@@ -148,7 +171,7 @@ private:
             sortedD2[i] = min_v;
             for(unsigned int ig=0; ig<gc; ) {
                 auto g = in_g[ig];
-                while(g_ind[g] < g_end[g] && depth_arr[g_ind[g]]->vector[d2] <= min_v)
+                while(g_ind[g] < g_end[g] && this->key(depth_arr[g_ind[g]], d2) <= min_v)
                     g_ind[g]++;
 
                 if (g_ind[g] < g_end[g])
@@ -171,11 +194,11 @@ private:
     }
 
     void fractionalCascading() {
-        p_point* depth_arr = this->helperArray(0);
+        point_id* depth_arr = this->helperArray(0);
 
         T min_v = std::numeric_limits<T>::max();
         for(unsigned int g=0; g<groupsCount; g++) {
-            T cur_v = depth_arr[g_ind[g]]->vector[d2];
+            T cur_v = this->key(depth_arr[g_ind[g]], d2);
             if (cur_v < min_v)
                 min_v = cur_v;
         }
@@ -188,12 +211,15 @@ private:
             for(unsigned int g=0; g<groupsCount; g++) {
                 T cur_v = std::numeric_limits<T>::max();
                 while(g_ind[g] < g_end[g]) {
-                    cur_v = depth_arr[g_ind[g]]->vector[d2];
+                    cur_v = this->key(depth_arr[g_ind[g]], d2);
                     if (cur_v > min_v)
                         break;
                     else
                         g_ind[g]++;
                 }
+                // An exhausted group has no next value
+                if (g_ind[g] == g_end[g])
+                    cur_v = std::numeric_limits<T>::max();
                 if (cur_v < new_min_v)
                     new_min_v = cur_v;
             }
@@ -214,6 +240,11 @@ private:
 
 public:
     unsigned int query(const point_vec& upper) {
+        return queryBudget(upper, QUERY_NO_BUDGET);
+    }
+
+    // Stops summing the groups once the count exceeds BUDGET.
+    unsigned int queryBudget(const point_vec& upper, unsigned int budget) {
         auto sortedD1_raw = sortedD1.get();
         res_group = std::upper_bound(sortedD1_raw, sortedD1_raw+groupsCount,
                                  upper[d1]) - sortedD1_raw;
@@ -223,25 +254,45 @@ public:
                                  upper[d2]) - sortedD2_raw;
 
         unsigned int retCount = 0;
-        for(unsigned int g=0; g<res_group; g++)
+        for(unsigned int g=0; g<res_group; g++) {
             retCount += fractional[res_ind*groupsCount + g] - g_ind[g];
+            if (retCount > budget) {
+            	res_group = 0;
+            	return QUERY_OVER_BUDGET;
+            }
+        }
 
         return retCount;
     }
 
-    template <bool FILTER>
-    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-        p_point* depth_arr = this->helperArray(0);
-        unsigned int retCount = 0;
+    static void queryBatchBudget(UpperBoundRangeTree2DFC* const* lanes, const point_vec* uppers,
+    		const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = lanes[i]->queryBudget(uppers[i], budgets[i]);
+    }
+
+    /*
+     * The range of a group is sorted by D2, so it is certified if its last point is below UPPER
+     * in D2, and the group's box is below UPPER in the other dims.
+     */
+    template <bool FILTER, class F>
+    void forEachCandidate(const point_vec& upper, F& f) {
+        point_id* depth_arr = this->helperArray(0);
 
         for(unsigned int g=0; g<res_group; g++) {
             auto l = g_ind[g];
             auto h = fractional[res_ind*groupsCount + g];
-            for (auto i=l; i<h; i++)
-            	retCount = this->template appendResultPoint<FILTER>(ret, retCount, depth_arr[i], upper);
+            if (h <= l)
+            	continue;
+            bool certified = this->key(depth_arr[h-1], d2) < upper[d2] &&
+            		this->boxBelow(g_box[g], upper, 1u << d2);
+            this->template visitResultRange<FILTER>(depth_arr, l, h, upper, certified, f);
         }
+    }
 
-        return retCount;
+    template <bool FILTER>
+    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
+        return this->template fetchCandidates<FILTER>(*this, upper, ret);
     }
 };
 
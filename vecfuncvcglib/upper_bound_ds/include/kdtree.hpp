@@ -36,12 +36,18 @@ public:
     using point = typename BaseUpperBoundDataStruct<T,S,D>::point;
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
 
 private:
-    std::unique_ptr<T[]> medianArr;
+    SharedArray<T> medianArr;
+    // The upper corner of the bounding box of each node (by its mid, as the medians).
+    SharedArray<point_vec> boxArr;
     std::vector<unsigned int> cmpDim;
 
+    // The points of the leaf ranges of the current query (they are final).
+    unsigned int resolvedCount = 0;
+
 public:
     KDTree(const shared_points& pts, unsigned int chunkSize) :
 			BaseUpperBoundRangeDS<T, S, D>(pts, chunkSize) {
@@ -53,6 +59,7 @@ public:
 
 		this->allocHelperArrays(1);
 		medianArr.reset(new T[this->size]);
+		boxArr.reset(new point_vec[this->size]);
 		buildTree();
 	}
 
@@ -62,9 +69,19 @@ public:
 
         this->allocHelperArrays(1);
         medianArr.reset(new T[this->size]);
+        boxArr.reset(new point_vec[this->size]);
         buildTree();
     }
 
+    unsigned long memoryFootprint() const {
+    	return estimateFootprint(this->size, this->chunkSize);
+    }
+
+    // The ids, and the median and the box of each node.
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize __attribute__((unused))) {
+    	return (unsigned long)size * (sizeof(point_id) + sizeof(T) + sizeof(point_vec));
+    }
+
 private:
 	inline unsigned int sortAxis(unsigned int depth) {
 		if (PARTIAL)
@@ -75,77 +92,227 @@ private:
 
     void buildTree() {
     	this->fillHelperArray(0);
-        for (unsigned int i=0; i<this->size; i++)
+        for (unsigned int i=0; i<this->size; i++) {
         	medianArr[i] = 0;
+        	// A single point node has no box of its own (its mid might be of its parent), so it
+        	// falls back to a box that bounds it.
+        	boxArr[i] = this->boxMax;
+        }
+
+        point_vec box;
+        unsigned int threads = BuildThreads::size();
+        if (threads <= 1) {
+        	buildTree(0, this->size, 0, box);
+        	return;
+        }
+
+        // The top levels are partitioned here, and their subtrees are built in parallel.
+        unsigned int topDepth = 0;
+        while ((1u << topDepth) < threads * BUILD_TASKS_PER_THREAD)
+        	topDepth++;
+        std::vector<Subtree> subtrees;
+        partitionTop(0, this->size, 0, topDepth, subtrees);
+        std::vector<point_vec> boxes(subtrees.size());
+        BuildThreads::run(subtrees.size(), [&] (unsigned int i) {
+        	buildTree(subtrees[i].l, subtrees[i].h, subtrees[i].depth, boxes[i]);
+        });
+
+        unsigned int next = 0;
+        boxTop(0, this->size, 0, topDepth, boxes, next, box);
+    }
+
+    typedef struct {
+    	unsigned int l;
+    	unsigned int h;
+    	unsigned int depth;
+    } Subtree;
 
-        buildTree(0, this->size, 0);
+    inline bool isTopNode(unsigned int l, unsigned int h, unsigned int depth,
+    		unsigned int topDepth) {
+    	return depth < topDepth && depth < this->maxDepth && h-l > 1;
     }
 
-    void buildTree(unsigned int l, unsigned int h, unsigned int depth) {
-        if (h-l <= 1)
+    // Partitions the nodes above TOP_DEPTH (as buildTree()), and lists the subtrees below them.
+    void partitionTop(unsigned int l, unsigned int h, unsigned int depth, unsigned int topDepth,
+    		std::vector<Subtree>& subtrees) {
+    	if (!isTopNode(l, h, depth, topDepth)) {
+    		subtrees.push_back(Subtree{l, h, depth});
+    		return;
+    	}
+
+    	auto axis = sortAxis(depth);
+    	unsigned int mid = this->calcMid(l, h);
+    	point_id midPoint = this->partitionHelperByDim(0, axis, mid, l, h);
+    	medianArr[mid] = this->key(midPoint, axis);
+    	partitionTop(l,     mid+1, depth+1, topDepth, subtrees);
+    	partitionTop(mid+1, h,     depth+1, topDepth, subtrees);
+    }
+
+    // Sets the boxes of the nodes above TOP_DEPTH from the boxes of the subtrees below them.
+    void boxTop(unsigned int l, unsigned int h, unsigned int depth, unsigned int topDepth,
+    		const std::vector<point_vec>& boxes, unsigned int& next, point_vec& box) {
+    	if (!isTopNode(l, h, depth, topDepth)) {
+    		box = boxes[next++];
+    		return;
+    	}
+
+    	unsigned int mid = this->calcMid(l, h);
+    	point_vec rightBox;
+    	boxTop(l,     mid+1, depth+1, topDepth, boxes, next, box);
+    	boxTop(mid+1, h,     depth+1, topDepth, boxes, next, rightBox);
+    	this->expandBox(box, rightBox);
+    	boxArr[mid] = box;
+    }
+
+    // Builds the node [L, H), and sets BOX to its bounding box.
+    void buildTree(unsigned int l, unsigned int h, unsigned int depth, point_vec& box) {
+        if (h-l <= 1) {
+        	this->boundingBox(this->helperArray(0), l, h, box);
             return;
+        }
 
         auto axis = sortAxis(depth);
+        unsigned int mid = this->calcMid(l, h);
         if (depth == this->maxDepth) {
             this->sortHelperByDim(0, axis, l, h);
+            this->boundingBox(this->helperArray(0), l, h, box);
+            boxArr[mid] = box;
             return;
         }
 
-        unsigned int mid = this->calcMid(l, h);
-        p_point midPoint = this->partitionHelperByDim(0, axis, mid, l, h);
-        medianArr[mid] = (*midPoint)[axis];
+        point_id midPoint = this->partitionHelperByDim(0, axis, mid, l, h);
+        medianArr[mid] = this->key(midPoint, axis);
 
 		// Left tree include mid point
-        buildTree(l,     mid+1, depth+1); // Build left tree
-        buildTree(mid+1, h,     depth+1); // Build right tree
+        point_vec rightBox;
+        buildTree(l,     mid+1, depth+1, box);      // Build left tree
+        buildTree(mid+1, h,     depth+1, rightBox); // Build right tree
+        this->expandBox(box, rightBox);
+        boxArr[mid] = box;
+    }
+
+    /*
+     * Processes a single range of the query, and prefetches the median of the next one.
+     * Returns false when the query is done.
+     */
+    inline bool queryStep(const point_vec& upper) {
+    	if (this->res.empty() || this->res.lookupDepth() > this->maxDepth)
+    		return false;
+
+    	point_id* arr = this->helperArray(0);
+    	auto& r = this->res.popRange();
+    	auto axis = sortAxis(r.depth);
+    	unsigned int mid = this->calcMid(r.lo, r.hi);
+    	if (r.certified) {
+    		// Already counted. Pushed to the next depth to keep the order of the depths.
+    		this->res.pushRange(r.lo, r.hi, r.depth+1, UpperBoundRangeDSResults::None, true);
+    	} else if (r.depth == this->maxDepth) {
+    		// The leaf is sorted by the axis, so the search range is below UPPER in the axis
+    		auto h = this->binarySearchUpper(arr, r.lo, r.hi, upper, axis);
+    		if (h-r.lo > 0)
+    			this->res.pushRange(r.lo, h, r.depth+1, UpperBoundRangeDSResults::None,
+    					this->boxBelow(boxArr[mid], upper, 1u << axis));
+    		resolvedCount += h - r.lo;
+    	} else if (this->boxBelow(boxArr[mid], upper)) {
+    		// The node is contained in the query: no need to descend into it.
+    		this->res.pushRange(r.lo, r.hi, r.depth+1, UpperBoundRangeDSResults::None, true);
+    		resolvedCount += r.hi - r.lo;
+    	} else {
+
+    		/*
+			 * If the the middle point is smaller than the upper limit,
+			 * than there might be some points on the right part that
+			 * might also be smaller.
+			 * We need to add the right range as well.
+			 */
+			if(medianArr[mid] < upper[axis])
+				this->res.pushRange(mid+1, r.hi, r.depth+1);
+
+			/*
+			 * In any way, we need to add the left range as there might be smaller items
+			 */
+			this->res.pushRange(r.lo, mid+1, r.depth+1);
+    	}
+
+    	if (!this->res.empty() && this->res.lookupDepth() < this->maxDepth) {
+    		auto& next = this->res.lookupRange();
+    		auto nextMid = this->calcMid(next.lo, next.hi);
+    		PREFETCH(medianArr.get() + nextMid);
+    		PREFETCH(boxArr.get() + nextMid);
+    	}
+    	return true;
     }
 
 public:
     unsigned int query(const point_vec& upper) {
         this->res.reset();
         this->res.pushRange(0, this->size, 0);
+        resolvedCount = 0;
 
-        p_point* arr = this->helperArray(0);
-        while (!this->res.empty() && this->res.lookupDepth() <= this->maxDepth) {
-        	auto& r = this->res.popRange();
-        	auto axis = sortAxis(r.depth);
-        	if (r.depth == this->maxDepth) {
-        		auto h = this->binarySearchUpper(arr, r.lo, r.hi, upper, axis);
-        		if (h-r.lo > 0)
-        			this->res.pushRange(r.lo, h, r.depth+1);
-        	} else {
-        		unsigned int mid = this->calcMid(r.lo, r.hi);
-
-        		/*
-				 * If the the middle point is smaller than the upper limit,
-				 * than there might be some points on the right part that
-				 * might also be smaller.
-				 * We need to add the right range as well.
-				 */
-				if(medianArr[mid] < upper[axis])
-					this->res.pushRange(mid+1, r.hi, r.depth+1);
-
-				/*
-				 * In any way, we need to add the left range as there might be smaller items
-				 */
-				this->res.pushRange(r.lo, mid+1, r.depth+1);
-        	}
-        }
+        while (queryStep(upper));
 
         return this->res.getPointCount();
     }
 
-    template <bool FILTER>
-    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-        unsigned int retCount = 0;
+    unsigned int queryBudget(const point_vec& upper, unsigned int budget) {
+    	KDTree* self = this;
+    	unsigned int count;
+    	queryBatchBudget(&self, &upper, &budget, 1, &count);
+    	return count;
+    }
 
+    static void queryBatch(KDTree* const* lanes, const point_vec* uppers, unsigned int count,
+    		unsigned int* counts) {
+    	queryBatchBudget(lanes, uppers, NULL, count, counts);
+    }
+
+    /*
+     * Interleaves the traversals of the queries, a single range of each query at a time.
+     * With BUDGETS, the traversal of a query stops once its leaf ranges exceed its budget.
+     */
+    static void queryBatchBudget(KDTree* const* lanes, const point_vec* uppers,
+    		const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+    	bool active[QUERY_BATCH_SIZE];
+    	bool over[QUERY_BATCH_SIZE];
+    	for (unsigned int i=0; i < count; i++) {
+    		lanes[i]->res.reset();
+    		lanes[i]->res.pushRange(0, lanes[i]->size, 0);
+    		lanes[i]->resolvedCount = 0;
+    		active[i] = true;
+    		over[i] = false;
+    	}
+
+    	bool anyActive = true;
+    	while (anyActive) {
+    		anyActive = false;
+    		for (unsigned int i=0; i < count; i++) {
+    			if (!active[i])
+    				continue;
+    			active[i] = lanes[i]->queryStep(uppers[i]);
+    			if (budgets && lanes[i]->resolvedCount > budgets[i]) {
+    				active[i] = false;
+    				over[i] = true;
+    			}
+    			if (active[i])
+    				anyActive = true;
+    		}
+    	}
+
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = over[i] ? QUERY_OVER_BUDGET : lanes[i]->res.getPointCount();
+    }
+
+    template <bool FILTER, class F>
+    void forEachCandidate(const point_vec& upper, F& f) {
         while (!this->res.empty()) {
         	auto& r = this->res.popRange();
-			retCount = this->template appendMultipleResultPoint<FILTER>(0, r.lo, r.hi, ret,
-					retCount, upper);
+			this->template visitHelperRange<FILTER>(0, r.lo, r.hi, upper, r.certified, f);
         }
+    }
 
-        return retCount;
+    template <bool FILTER>
+    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
+        return this->template fetchCandidates<FILTER>(*this, upper, ret);
     }
 };
 
@@ -20,6 +20,7 @@
 #define MULTI_BINARY_SEARCH_TREE_HPP_
 
 #include <cmath>
+#include <cstdint>
 #include <memory>
 #include <algorithm>
 #include <utility>
@@ -33,7 +34,66 @@
 namespace UpperBoundDS {
 
 
-template<typename T, typename S, unsigned int D, unsigned int SD = D-1>
+/*
+ * Bit vectors of the same length, with their ranks: the number of set bits before each 64-bit
+ * word is kept, so a rank is a lookup and a popcount of a single word.
+ */
+class RankBitVectors {
+private:
+	SharedArray<uint64_t> words;
+	SharedArray<unsigned int> ranks;
+	unsigned long count = 0;
+	// The words of each vector
+	unsigned long stride = 0;
+
+public:
+	void init(unsigned int count, unsigned int length) {
+		this->count = count;
+		stride = length / 64 + 1;
+		words.reset(new uint64_t[this->count * stride]());
+		ranks.reset(new unsigned int[this->count * stride]);
+	}
+
+	inline void set(unsigned int v, unsigned int i) {
+		words[v * stride + i / 64] |= (uint64_t)1 << (i % 64);
+	}
+
+	// Counts the ranks of the vector V, once its bits are set.
+	void buildRanks(unsigned int v) {
+		unsigned int sum = 0;
+		for (unsigned long w = v * stride; w < (v+1) * stride; w++) {
+			ranks[w] = sum;
+			sum += __builtin_popcountll(words[w]);
+		}
+	}
+
+	// The number of set bits of the vector V before the bit I.
+	inline unsigned int rank1(unsigned int v, unsigned int i) const {
+		unsigned long w = v * stride + i / 64;
+		return ranks[w] + __builtin_popcountll(words[w] & (((uint64_t)1 << (i % 64)) - 1));
+	}
+
+	unsigned long memoryFootprint() const {
+		return count * stride * (sizeof(uint64_t) + sizeof(unsigned int));
+	}
+
+	// Of COUNT vectors of LENGTH bits.
+	static unsigned long estimateFootprint(unsigned long count, unsigned int length) {
+		return count * (length / 64 + 1) * (sizeof(uint64_t) + sizeof(unsigned int));
+	}
+};
+
+
+/*
+ * The levels of the sub dims are the merge levels of the points: (maxDepth+1) arrays of ids
+ * per main and sub dim.
+ * A LEAN tree keeps the ids sorted by each dim, and a bit vector per level (except the last)
+ * instead of its ids: the bit of an id marks that it is in the left child of its node (see
+ * buildLevels()). The count of a node below the query in a sub dim is then mapped from the
+ * root down to the node by ranks of the bits (see levelCount()), and its ids are visited
+ * by mapping it down to the leaves (see visitLevelRange()).
+ */
+template<typename T, typename S, unsigned int D, unsigned int SD = D-1, bool LEAN = false>
 class MultiBinarySearchTree : public BaseUpperBoundRangeDS<T,S,D> {
 	static_assert(SD > 0, "SD must be at least 1.");
 
@@ -41,12 +101,15 @@ public:
     using point = typename BaseUpperBoundDataStruct<T,S,D>::point;
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
+    using Range = typename BaseUpperBoundRangeDS<T,S,D>::Range;
+    using BatchSearch = typename BaseUpperBoundRangeDS<T,S,D>::BatchSearch;
 
 private:
-    std::unique_ptr<T[]> sortedD;
+    SharedArray<T> sortedD;
 
-    std::unique_ptr<unsigned int[]> splits;
+    SharedArray<unsigned int> splits;
     unsigned int splitCount = 0;
 
     unsigned int cmpDim[D];
@@ -55,6 +118,24 @@ private:
     unsigned int subD[D][SD];
     unsigned int subDimCount;
 
+    // LEAN: the ids sorted by each dim, and the levels of each main and sub dim.
+    SharedArray<point_id> sortedIds;
+    RankBitVectors levels;
+    // LEAN: the main dim of the last query.
+    unsigned int queryMainD = 0;
+
+    // The upper corners of the bounding boxes of the nodes of each main dim (see nodeBox()).
+    SharedArray<point_vec> nodeBoxes;
+
+    // LEAN: a node of the query's path, and the count of its ids that are below the query in a
+    // sub dim.
+    typedef struct {
+    	unsigned int lo;
+    	unsigned int hi;
+    	unsigned int depth;
+    	unsigned int count;
+    } LevelNode;
+
 public:
     MultiBinarySearchTree(const shared_points& pts, unsigned int chunkSize,
     		const std::vector<unsigned int>& cmpDim) :
@@ -75,16 +156,43 @@ public:
 		init();
 	}
 
+    unsigned long memoryFootprint() const {
+    	unsigned long ret = BaseUpperBoundRangeDS<T,S,D>::memoryFootprint() +
+    			(unsigned long)this->size * D * sizeof(T) +
+    			D * BaseUpperBoundRangeDS<T,S,D>::nodeCount(this->maxDepth) * sizeof(point_vec);
+    	if (LEAN)
+    		ret += (unsigned long)this->size * D * sizeof(point_id) + levels.memoryFootprint();
+    	return ret;
+    }
+
+    // Of a tree of all the dims.
+    static unsigned long estimateFootprint(unsigned int size, unsigned int chunkSize) {
+    	unsigned long maxDepth = BaseUpperBoundDataStruct<T,S,D>::treeDepth(size, chunkSize);
+    	unsigned long ret = (unsigned long)size * D * sizeof(T) +
+    			D * BaseUpperBoundRangeDS<T,S,D>::nodeCount(maxDepth) * sizeof(point_vec);
+    	if (LEAN)
+    		return ret + (unsigned long)size * D * sizeof(point_id) +
+    				RankBitVectors::estimateFootprint(D * std::min(D-1, SD) * maxDepth, size);
+    	return ret + (maxDepth + 1) * D * SD * size * sizeof(point_id);
+    }
+
 private:
     void init() {
     	this->res.init(this->maxDepth+2);
 
-		this->allocHelperArrays((this->maxDepth+1) * D * SD);
 		sortedD.reset(new T[this->size * D]);
+		nodeBoxes.reset(new point_vec[D * BaseUpperBoundRangeDS<T,S,D>::nodeCount(this->maxDepth)]);
 
 		subDimCount = std::min(cmpDimCount-1, SD);
 
-		buildTree();
+		if (LEAN) {
+			sortedIds.reset(new point_id[(unsigned long)this->size * D]);
+			levels.init(D * subDimCount * this->maxDepth, this->size);
+			buildLeanTree();
+		} else {
+			this->allocHelperArrays((this->maxDepth+1) * D * SD);
+			buildTree();
+		}
     }
 
 private:
@@ -96,6 +204,23 @@ private:
 		return sortedD.get() + (this->size * d);
 	}
 
+	inline point_id* getSortedIds(unsigned int d) {
+		return sortedIds.get() + ((unsigned long)this->size * d);
+	}
+
+	inline point_vec* getNodeBoxes(unsigned int d) {
+		return nodeBoxes.get() + BaseUpperBoundRangeDS<T,S,D>::nodeCount(this->maxDepth) * d;
+	}
+
+	// The upper corner of the bounding box of the node of the main dim D at DEPTH that starts at LO.
+	inline const point_vec& nodeBox(unsigned int d, unsigned int lo, unsigned int depth) {
+		return getNodeBoxes(d)[this->nodeIndex(lo, depth)];
+	}
+
+	inline unsigned int levelIndex(unsigned int depth, unsigned dim, unsigned int subDim) {
+		return ((subDimCount * dim) + subDim) * this->maxDepth + depth;
+	}
+
 	// Initiate the sub dim for each sub dim index.
 	// VERIFIED: (D*SD)
 	void buildSubD() {
@@ -111,20 +236,38 @@ private:
 		}
 	}
 
+    /*
+     * The main dims are built in parallel (see BuildThreads), and then the merge levels of all
+     * the sub dims are merged level by level (see mergeParallel()).
+     */
     void buildTree() {
     	buildSubD();
-    	this->buildSplits(splits, splitCount);
-
-        // O(D) * buildTreeNoRec()
-    	for(unsigned int i=0; i < cmpDimCount; i++)
-			buildTreeNoRec(cmpDim[i]);
-
-    	splits.release();
+    	std::unique_ptr<unsigned int[]> newSplits;
+    	this->buildSplits(newSplits, splitCount);
+    	splits.reset(newSplits.release());
+
+        // O(D) * buildMainDim()
+    	BuildThreads::run(cmpDimCount, [this] (unsigned int i) {
+    		buildMainDim(cmpDim[i]);
+    	});
+    	mergeSubDimLevels();
+
+    	// The splits are only required during the build
+    	splits.reset(NULL);
     }
 
+    // Sorts the points by MAIN_D into the array of the last depth. A large tree is sorted at
+    // once (a radix sort), instead of sorting its leaves and merging them up.
     inline void pointArrMergeSort(unsigned int mainD) {
 		unsigned int helperInd = dimHelperArray(0, mainD, 0);
 		auto arr = this->helperArray(helperInd);
+		if (this->size >= RADIX_SORT_MIN_SIZE) {
+			unsigned int sortedInd = dimHelperArray(this->maxDepth, mainD, 0);
+			this->copyHelperArray(helperInd, sortedInd);
+			this->sortHelperByDim(sortedInd, mainD, 0, this->size);
+			return;
+		}
+
 		for (unsigned int i=0; i < splitCount; i++)
 			this->sortPointsByDim(arr+splits[i], arr+splits[i+1], mainD);
 
@@ -146,7 +289,8 @@ private:
 		}
     }
 
-    void buildTreeNoRec(unsigned int mainD) {
+    // Sorts the points by MAIN_D, and the leaves of its last depth by each of its sub dims.
+    void buildMainDim(unsigned int mainD) {
 		auto helperInd = dimHelperArray(0, mainD, 0);
 		this->fillHelperArray(helperInd);
 		pointArrMergeSort(mainD);
@@ -156,7 +300,8 @@ private:
 		auto arr = this->helperArray(helperInd);
 		T* sorted_arr = getSortedArray(mainD);
 		for (unsigned int i=0; i<this->size; i++)
-			sorted_arr[i] = arr[i]->vector[mainD];
+			sorted_arr[i] = this->key(arr[i], mainD);
+		this->buildNodeBoxes(arr, getNodeBoxes(mainD));
 
 		for (unsigned int sdInd=1; sdInd < subDimCount; sdInd++) {
 			auto subHelperInd = dimHelperArray(this->maxDepth, mainD, sdInd);
@@ -170,26 +315,102 @@ private:
 
 			for (unsigned int i=0; i < splitCount; i++)
 				this->sortPointsByDim(arr+splits[i], arr+splits[i+1], sd);
+		}
+	}
 
-			unsigned int splitJump = 1;
-			for (unsigned int depth=this->maxDepth; depth > 0; depth--) {
-				helperInd = dimHelperArray(depth, mainD, sdInd);
-				auto arr = this->helperArray(helperInd);
-				helperInd = dimHelperArray(depth-1, mainD, sdInd);
-				auto arrDst = this->helperArray(helperInd);
-				for (unsigned int i=0; i < splitCount; i += 2*splitJump) {
-					auto left = arr + splits[i];
-					auto mid = arr + splits[i+splitJump];
-					auto top = arr + splits[i+2*splitJump];
-					auto dst = arrDst + splits[i];
-					this->mergePointsByDim(left, mid, mid, top, dst, sd);
+    // Merges the sub dims' levels up from the last depth: the merges of a level (of all the
+    // main and sub dims) are independent.
+    void mergeSubDimLevels() {
+    	std::vector<typename BaseUpperBoundRangeDS<T,S,D>::MergeJob> jobs;
+		unsigned int splitJump = 1;
+		for (unsigned int depth=this->maxDepth; depth > 0; depth--) {
+			jobs.clear();
+			for (unsigned int i=0; i < cmpDimCount; i++) {
+				unsigned int mainD = cmpDim[i];
+				for (unsigned int sdInd=0; sdInd < subDimCount; sdInd++) {
+					unsigned int sd = subD[mainD][sdInd];
+					auto arr = this->helperArray(dimHelperArray(depth, mainD, sdInd));
+					auto arrDst = this->helperArray(dimHelperArray(depth-1, mainD, sdInd));
+					for (unsigned int s=0; s < splitCount; s += 2*splitJump) {
+						auto mid = arr + splits[s+splitJump];
+						jobs.push_back({arr + splits[s], mid, arr + splits[s+2*splitJump],
+								arrDst + splits[s], sd});
+					}
 				}
-
-				splitJump *= 2;
 			}
+			this->mergeParallel(jobs);
+
+			splitJump *= 2;
 		}
 	}
 
+    /*
+     * LEAN: the ids are sorted once per dim (in parallel). The levels of each main and sub dim
+     * are built top down (see buildLevels()).
+     */
+    void buildLeanTree() {
+    	buildSubD();
+    	std::unique_ptr<unsigned int[]> newSplits;
+    	this->buildSplits(newSplits, splitCount);
+    	splits.reset(newSplits.release());
+
+    	BuildThreads::run(cmpDimCount, [this] (unsigned int i) {
+    		unsigned int d = cmpDim[i];
+    		point_id* ids = getSortedIds(d);
+    		this->fillPointsArray(ids);
+    		this->sortPointsByDim(ids, ids + this->size, d);
+    		T* sorted_arr = getSortedArray(d);
+    		for (unsigned int j=0; j < this->size; j++)
+    			sorted_arr[j] = this->key(ids[j], d);
+    		this->buildNodeBoxes(ids, getNodeBoxes(d));
+    	});
+    	BuildThreads::run(cmpDimCount * subDimCount, [this] (unsigned int t) {
+    		buildLevels(cmpDim[t / subDimCount], t % subDimCount);
+    	});
+
+    	// The splits are only required during the build
+    	splits.reset(NULL);
+    }
+
+    /*
+     * The ids of each node (sorted by the sub dim) are stably partitioned to its children, so
+     * the ids of each child stay sorted by the sub dim. The bit of an id is set if it goes to
+     * the left child: if it is left of the node's mid in the main dim's order.
+     */
+    void buildLevels(unsigned int mainD, unsigned int sdIdx) {
+    	const point_id* mainIds = getSortedIds(mainD);
+    	std::unique_ptr<unsigned int[]> pos(new unsigned int[this->size]);
+    	for (unsigned int i=0; i < this->size; i++)
+    		pos[mainIds[i]] = i;
+
+    	std::unique_ptr<point_id[]> cur(new point_id[this->size]);
+    	std::unique_ptr<point_id[]> next(new point_id[this->size]);
+    	const point_id* sdIds = getSortedIds(subD[mainD][sdIdx]);
+    	std::copy(sdIds, sdIds + this->size, cur.get());
+
+    	unsigned int splitJump = splitCount;
+    	for (unsigned int depth=0; depth < this->maxDepth; depth++) {
+    		unsigned int v = levelIndex(depth, mainD, sdIdx);
+    		for (unsigned int s=0; s < splitCount; s += splitJump) {
+    			unsigned int mid = splits[s + splitJump/2];
+    			unsigned int l = splits[s];
+    			unsigned int r = mid;
+    			for (unsigned int i=splits[s]; i < splits[s+splitJump]; i++) {
+    				point_id id = cur[i];
+    				if (pos[id] < mid) {
+    					levels.set(v, i);
+    					next[l++] = id;
+    				} else
+    					next[r++] = id;
+    			}
+    		}
+    		levels.buildRanks(v);
+
+    		cur.swap(next);
+    		splitJump /= 2;
+    	}
+    }
+
     inline unsigned int findLeftMostBinarySearch(unsigned int mainD, unsigned int depth,
 			unsigned int lo, unsigned int & hi,
 			const point_vec& upper) {
@@ -206,13 +427,13 @@ private:
 			auto sd = subD[mainD][sdIdx];
 			auto helperInd = dimHelperArray(depth, mainD, sdIdx);
 			auto arr = this->helperArray(helperInd);
-			if (!(arr[lo]->vector[sd] < upper[sd])){
+			if (!(this->key(arr[lo], sd) < upper[sd])){
 				hi = lo;
 				return sdIdx;
 			}
 		}
 
-		unsigned int participatingDims1[SD];
+		unsigned int participatingDims1[SD] = {};
 		unsigned int participatingDims2[SD];
 		unsigned int * oldParticipatingDims = participatingDims1;
 		unsigned int * newParticipatingDims = participatingDims2;
@@ -232,7 +453,7 @@ private:
 				auto sd = subD[mainD][sdIdx];
 				auto helperInd = dimHelperArray(depth, mainD, sdIdx);
 				auto arr = this->helperArray(helperInd);
-				if (!(arr[mid]->vector[sd] < upper[sd]))
+				if (!(this->key(arr[mid], sd) < upper[sd]))
 					newParticipatingDims[newParticipatingDimsCount++] = sdIdx;
 			}
 
@@ -305,7 +526,8 @@ public:
 				oldParticipatingDimsCount = newParticipatingDimsCount;
 				hi = mid+1; // Go left
 			} else {
-				this->res.pushRange(lo, mid+1, depth+1);
+				// Below UPPER in all the participating dims (the main dim is one of them)
+				this->res.pushRange(lo, mid+1, depth+1, UpperBoundRangeDSResults::None, true);
 				lo = mid + 1; // Go right
 			}
 
@@ -318,48 +540,191 @@ public:
 		retDepth = depth;
 	}
 
-    unsigned int query(const point_vec& upper) {
-    	this->res.reset();
-    	unsigned int l, h, d, depth;
-    	findLeftMost(upper, l, h, d, depth);
+private:
+    /*
+     * A single step of the query's descent on the sorted array of the main dim.
+     * The ranges that are below the pivot are pushed as certified (in the main dim only, until
+     * they are resolved).
+     * Returns false when the descent is done.
+     */
+    inline bool descendStep(const T* curSortedD, T pivot, unsigned int& l, unsigned int& h,
+    		unsigned int& depth) {
+        if (!(depth < this->maxDepth && l != h))
+        	return false;
+
+        // Optimization
+        if (curSortedD[h-1] < pivot) {
+        	// If the right most is smaller, than we include all the points in the range.
+        	this->res.pushRange(l, h, depth, UpperBoundRangeDSResults::None, true);
+        	l = h;
+            return false;
+        }
+        if (curSortedD[l] >= pivot) {
+        	// If the left most is bigger, than we don't include anything from that range.
+            l = h;
+            return false;
+        }
 
-        T pivot = upper[d];
+        unsigned int mid = this->calcMid(l, h);
+
+        /*
+		 * If the the middle point is smaller than the upper limit,
+		 * than there might be some points on the right part that
+		 * might also be smaller.
+		 * We need to add the right range as well.
+		 */
+        if(curSortedD[mid] < pivot) {
+        	this->res.pushRange(l, mid+1, depth+1, UpperBoundRangeDSResults::None, true); // Add left
+            l = mid+1; // Go right
+        } else
+            h = mid+1; // Go left
+
+        depth++;
+        if (depth < this->maxDepth && l != h)
+        	PREFETCH(curSortedD + this->calcMid(l, h));
+        return true;
+    }
 
-        auto curSortedD = getSortedArray(d);
-        // Multidimensional binary search in which we only continue with the
-        // dimensions that continues left (less).
-        while (depth < this->maxDepth && l != h) {
-            // Optimization
-            if (curSortedD[h-1] < pivot)
-            	// If the right most is smaller, than we include all the points in the range.
-                break;
-            if (curSortedD[l] >= pivot) {
-            	// If the left most is bigger, than we don't include anything from that range.
-                l = h;
-                break;
-            }
-
-            unsigned int mid = this->calcMid(l, h);
-
-            /*
-			 * If the the middle point is smaller than the upper limit,
-			 * than there might be some points on the right part that
-			 * might also be smaller.
-			 * We need to add the right range as well.
-			 */
-            if(curSortedD[mid] < pivot) {
-            	this->res.pushRange(l, mid+1, depth+1); // Add left
-                l = mid+1; // Go right
-            } else
-                h = mid+1; // Go left
-
-            depth++;
+    // A resolved range that is below UPPER in the main dim D and in its sub dim SD is certified
+    // if the box of its node is below in the other dims.
+    inline bool certifyRange(const Range& r, const point_vec& upper, unsigned int d,
+    		unsigned int sd) {
+    	return r.certified && this->boxBelow(nodeBox(d, r.lo, r.depth), upper, (1u << d) | (1u << sd));
+    }
+
+    // LEAN: the count of the ids of the left child of the node at LO, among its COUNT first ids
+    // at the level V.
+    inline unsigned int leftCount(unsigned int v, unsigned int lo, unsigned int count) const {
+    	return levels.rank1(v, lo + count) - levels.rank1(v, lo);
+    }
+
+    // The upper limit of the node at DEPTH that starts at LO.
+    inline unsigned int nodeHi(unsigned int lo, unsigned int depth) {
+    	unsigned int l = 0;
+    	unsigned int h = this->size;
+    	for (unsigned int k=0; k < depth; k++) {
+    		unsigned int mid = this->calcMid(l, h) + 1;
+    		if (lo < mid)
+    			h = mid;
+    		else
+    			l = mid;
+    	}
+    	return h;
+    }
+
+    /*
+     * LEAN: the count of the ids of the node [LO, HI) at DEPTH that are below the query in the
+     * sub dim SD_IDX of MAIN_D.
+     * NODE is moved down to the parent of the node, so the next nodes of the query (its ranges
+     * are children of the nodes of its path, by their depth) continue from there. It restarts
+     * from the root (with ROOT_COUNT) if the node is not below it.
+     */
+    inline unsigned int levelCount(LevelNode& node, unsigned int rootCount, unsigned int mainD,
+    		unsigned int sdIdx, unsigned int lo, unsigned int hi, unsigned int depth) {
+    	if (depth < node.depth || lo < node.lo || node.hi < hi)
+    		node = {0, this->size, 0, rootCount};
+
+    	while (node.depth < depth) {
+    		unsigned int mid = this->calcMid(node.lo, node.hi) + 1;
+    		unsigned int left = leftCount(levelIndex(node.depth, mainD, sdIdx), node.lo, node.count);
+    		if (node.depth + 1 == depth)
+    			return lo < mid ? left : node.count - left;
+
+    		if (lo < mid) {
+    			node.hi = mid;
+    			node.count = left;
+    		} else {
+    			node.lo = mid;
+    			node.count -= left;
+    		}
+    		node.depth++;
+    	}
+    	return node.count;
+    }
+
+    /*
+     * LEAN: the count of each range is the least count of its sub dims (see levelCount()). The
+     * resolved range keeps its depth, and its sub dim index as the sort dim.
+     */
+    bool resolveLevelRanges(const point_vec& upper, unsigned int d, unsigned int budget) {
+    	LevelNode nodes[SD];
+    	unsigned int rootCounts[SD];
+    	for (unsigned int sdIdx = 0; sdIdx < subDimCount; sdIdx++) {
+    		auto sd = subD[d][sdIdx];
+    		const T* s = getSortedArray(sd);
+    		rootCounts[sdIdx] = (unsigned int)(std::lower_bound(s, s + this->size, upper[sd]) - s);
+    		nodes[sdIdx] = {0, this->size, 0, rootCounts[sdIdx]};
+    	}
+    	queryMainD = d;
+
+        const unsigned int c = this->res.getRangeCount();
+        unsigned int resolved = 0;
+        for (unsigned int i=0; i < c; i++) {
+        	// Copy, as the resolved range might be pushed to the same slot
+        	const Range r = this->res.popRange();
+        	unsigned int count = r.hi - r.lo;
+        	unsigned int sdIdx = 0;
+        	for (unsigned int k = 0; k < subDimCount && count > 0; k++) {
+        		unsigned int kc = levelCount(nodes[k], rootCounts[k], d, k, r.lo, r.hi, r.depth);
+        		if (kc < count) {
+        			count = kc;
+        			sdIdx = k;
+        		}
+        	}
+
+			if (count > 0) {
+				auto sd = subD[d][sdIdx];
+				this->res.pushRange(r.lo, r.lo + count, r.depth, sdIdx, certifyRange(r, upper, d, sd));
+				resolved += count;
+				if (resolved > budget)
+					return false;
+			}
         }
+        return true;
+    }
+
+    /*
+     * LEAN: visits the COUNT first ids (by the sub dim SD_IDX) of the node [LO, HI) at DEPTH, by
+     * mapping them down to a whole node or a leaf.
+     */
+    template <bool FILTER, class F>
+    void visitLevelRange(unsigned int sdIdx, unsigned int depth, unsigned int lo, unsigned int hi,
+    		unsigned int count, const point_vec& upper, bool certified, F& f) {
+    	if (count == 0)
+    		return;
+    	const point_id* ids = getSortedIds(queryMainD);
+    	if (count == hi - lo) {
+    		this->template visitResultRange<FILTER>(ids, lo, hi, upper, certified, f);
+    		return;
+    	}
 
-        if (l != h)
-        	this->res.pushRange(l, h, depth);
+    	if (depth == this->maxDepth) {
+    		// The ids of a leaf are only sorted by the main dim: its first ids by the sub dim are
+    		// the ones below the query in it.
+    		auto sd = subD[queryMainD][sdIdx];
+    		for (unsigned int i=lo; i < hi; i++) {
+    			if (this->key(ids[i], sd) < upper[sd])
+    				this->template visitResultRange<FILTER>(ids, i, i+1, upper, certified, f);
+    		}
+    		return;
+    	}
+
+    	unsigned int mid = this->calcMid(lo, hi) + 1;
+    	unsigned int left = leftCount(levelIndex(depth, queryMainD, sdIdx), lo, count);
+    	visitLevelRange<FILTER>(sdIdx, depth+1, lo, mid, left, upper, certified, f);
+    	visitLevelRange<FILTER>(sdIdx, depth+1, mid, hi, count - left, upper, certified, f);
+    }
+
+    /*
+     * Search the upper limit of each range on the sub dims of the main dim D.
+     * Returns false if the resolved ranges exceed BUDGET (the rest are not resolved).
+     */
+    bool resolveRanges(const point_vec& upper, unsigned int d, unsigned int budget) {
+    	if (LEAN)
+    		return resolveLevelRanges(upper, d, budget);
 
         const unsigned int c = this->res.getRangeCount();
+        unsigned int resolved = 0;
         for (unsigned int i=0; i < c; i++) {
         	const auto& r = this->res.popRange();
         	unsigned int hi = r.hi;
@@ -368,23 +733,118 @@ public:
 			if (hi > r.lo) {
 				auto helperInd = dimHelperArray(r.depth, d, sdIdx);
 				auto sd = subD[d][sdIdx];
-				this->res.pushRange(r.lo, hi, helperInd, sd);
+				this->res.pushRange(r.lo, hi, helperInd, sd, certifyRange(r, upper, d, sd));
+				resolved += hi - r.lo;
+				if (resolved > budget)
+					return false;
 			}
         }
+        return true;
+    }
+
+    // With a single sub dim, the ranges of all the lanes are resolved by interleaved binary searches
+    // (unless LEAN).
+    static void resolveRanges(MultiBinarySearchTree* const* lanes, const point_vec* uppers,
+    		const unsigned int* mainD, unsigned int count, const unsigned int* budgets, bool* over) {
+    	if (LEAN || (SD != 1 && lanes[0]->subDimCount != 1)) {
+    		for (unsigned int i=0; i < count; i++)
+    			over[i] = !lanes[i]->resolveRanges(uppers[i], mainD[i], budgets ? budgets[i] : QUERY_NO_BUDGET);
+    		return;
+    	}
 
-        return this->res.getPointCount();
+    	BaseUpperBoundRangeDS<T,S,D>::resolveRangesBatch(lanes, uppers, count,
+    			[lanes, uppers, mainD] (unsigned int i, const Range& r, BatchSearch& q, Range& out) {
+    		auto ds = lanes[i];
+    		auto d = mainD[i];
+    		auto helperInd = ds->dimHelperArray(r.depth, d, 0);
+    		q.arr = ds->helperArray(helperInd);
+    		q.cmpDim = ds->subD[d][0];
+    		out.depth = helperInd;
+    		out.sortDim = q.cmpDim;
+    		out.certified = ds->certifyRange(r, uppers[i], d, q.cmpDim);
+    	}, budgets, over);
+    	if (!budgets) {
+    		for (unsigned int i=0; i < count; i++)
+    			over[i] = false;
+    	}
     }
 
-    template <bool FILTER>
-    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-        unsigned int retCount = 0;
+public:
+    unsigned int query(const point_vec& upper) {
+    	MultiBinarySearchTree* self = this;
+    	unsigned int count;
+    	queryBatch(&self, &upper, 1, &count);
+    	return count;
+    }
+
+    unsigned int queryBudget(const point_vec& upper, unsigned int budget) {
+    	MultiBinarySearchTree* self = this;
+    	unsigned int count;
+    	queryBatchBudget(&self, &upper, &budget, 1, &count);
+    	return count;
+    }
+
+    static void queryBatch(MultiBinarySearchTree* const* lanes, const point_vec* uppers,
+    		unsigned int count, unsigned int* counts) {
+    	queryBatchBudget(lanes, uppers, NULL, count, counts);
+    }
 
+    /*
+     * Interleaves the descents of the queries, and then the binary searches of their ranges.
+     * With BUDGETS, the binary searches of a query stop once its resolved ranges exceed its budget.
+     */
+    static void queryBatchBudget(MultiBinarySearchTree* const* lanes, const point_vec* uppers,
+    		const unsigned int* budgets, unsigned int count, unsigned int* counts) {
+    	if (count == 0)
+    		return;
+
+    	unsigned int l[QUERY_BATCH_SIZE], h[QUERY_BATCH_SIZE];
+    	unsigned int d[QUERY_BATCH_SIZE], depth[QUERY_BATCH_SIZE];
+    	bool active[QUERY_BATCH_SIZE];
+    	for (unsigned int i=0; i < count; i++) {
+    		lanes[i]->res.reset();
+    		lanes[i]->findLeftMost(uppers[i], l[i], h[i], d[i], depth[i]);
+    		active[i] = true;
+    	}
+
+        // Multidimensional binary search in which we only continue with the
+        // dimensions that continues left (less).
+    	bool anyActive = true;
+    	while (anyActive) {
+    		anyActive = false;
+    		for (unsigned int i=0; i < count; i++) {
+    			if (!active[i])
+    				continue;
+    			active[i] = lanes[i]->descendStep(lanes[i]->getSortedArray(d[i]), uppers[i][d[i]],
+    					l[i], h[i], depth[i]);
+    			if (active[i])
+    				anyActive = true;
+    			else if (l[i] != h[i])
+    				lanes[i]->res.pushRange(l[i], h[i], depth[i]);
+    		}
+    	}
+
+    	bool over[QUERY_BATCH_SIZE];
+    	resolveRanges(lanes, uppers, d, count, budgets, over);
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = over[i] ? QUERY_OVER_BUDGET : lanes[i]->res.getPointCount();
+    }
+
+    template <bool FILTER, class F>
+    void forEachCandidate(const point_vec& upper, F& f) {
         while (!this->res.empty()) {
 			auto& r = this->res.popRange();
-			retCount = this->template appendMultipleResultPoint<FILTER>(r.depth, r.lo, r.hi, ret, retCount, upper);
+			if (LEAN)
+				visitLevelRange<FILTER>(r.sortDim, r.depth, r.lo, nodeHi(r.lo, r.depth), r.hi - r.lo,
+						upper, r.certified, f);
+			else
+				this->template visitHelperRange<FILTER>(r.depth, r.lo, r.hi, upper, r.certified, f);
         }
+    }
 
-        return retCount;
+    template <bool FILTER>
+    unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
+        return this->template fetchCandidates<FILTER>(*this, upper, ret);
     }
 };
 
@@ -398,6 +858,9 @@ using MultiBinarySearchTreeSingle = MultiBinarySearchTree<T,S,D,1>;
 template<typename T, typename S, unsigned int D>
 using MultiBinarySearchTreeDouble = MultiBinarySearchTree<T,S,D,2>;
 
+template<typename T, typename S, unsigned int D>
+using MultiBinarySearchTreeLean = MultiBinarySearchTree<T,S,D,D-1,true>;
+
 
 } // UpperBoundDS
 
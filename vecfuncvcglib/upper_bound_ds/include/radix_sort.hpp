@@ -0,0 +1,126 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef RADIX_SORT_HPP_
+#define RADIX_SORT_HPP_
+
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+
+// Arrays of at least RADIX_SORT_MIN_SIZE ids are sorted by a radix sort (see radixSortIds()).
+#ifndef RADIX_SORT_MIN_SIZE
+#define RADIX_SORT_MIN_SIZE (1024)
+#endif
+
+// The bits of a radix sort digit.
+#define RADIX_SORT_DIGIT_BITS (8)
+#define RADIX_SORT_BUCKETS (1u << RADIX_SORT_DIGIT_BITS)
+
+
+namespace UpperBoundDS {
+
+
+/*
+ * The radix key of a coordinate of type T: an unsigned integer of the same size with the same
+ * order. The sign bit of the signed integers is flipped. The bits of the floating point types
+ * are flipped if negative, and their sign bit is set otherwise.
+ */
+template<typename T, class Enable = void>
+struct RadixKey {
+	typedef typename std::make_unsigned<T>::type type;
+
+	static inline type get(T v) {
+		type ret = (type)v;
+		if (std::is_signed<T>::value)
+			ret ^= (type)1 << (sizeof(T) * 8 - 1);
+		return ret;
+	}
+};
+
+template<typename T>
+struct RadixKey<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+	typedef typename std::conditional<sizeof(T) == sizeof(uint32_t), uint32_t, uint64_t>::type type;
+
+	static inline type get(T v) {
+		type ret;
+		std::memcpy(&ret, &v, sizeof(T));
+		const type sign = (type)1 << (sizeof(T) * 8 - 1);
+		return (ret & sign) ? ~ret : (ret | sign);
+	}
+};
+
+
+/*
+ * LSD radix sort of the ids ARR[0, N) by their coordinates in COL.
+ * The ids are sorted as (key, id) pairs, one digit per pass. A digit that is the same for all
+ * the keys is skipped, so the ranks (see RankSpace) of a few distinct coordinates take a
+ * single pass. The sort is stable.
+ */
+template<typename T, typename I>
+void radixSortIds(I* arr, unsigned int n, const T* col) {
+	typedef RadixKey<T> Key;
+	typedef typename Key::type U;
+	typedef struct {
+		U key;
+		I id;
+	} Item;
+	const unsigned int digits = sizeof(U) * 8 / RADIX_SORT_DIGIT_BITS;
+	if (n < 2)
+		return;
+
+	std::unique_ptr<Item[]> buf(new Item[2 * (unsigned long)n]);
+	Item* src = buf.get();
+	Item* dst = src + n;
+
+	std::unique_ptr<unsigned int[]> counts(new unsigned int[digits * RADIX_SORT_BUCKETS]());
+	for (unsigned int i=0; i < n; i++) {
+		U key = Key::get(col[arr[i]]);
+		src[i].key = key;
+		src[i].id = arr[i];
+		for (unsigned int g=0; g < digits; g++)
+			counts[g * RADIX_SORT_BUCKETS + ((key >> (g * RADIX_SORT_DIGIT_BITS)) & (RADIX_SORT_BUCKETS-1))]++;
+	}
+
+	for (unsigned int g=0; g < digits; g++) {
+		unsigned int* c = counts.get() + g * RADIX_SORT_BUCKETS;
+		unsigned int shift = g * RADIX_SORT_DIGIT_BITS;
+		if (c[(src[0].key >> shift) & (RADIX_SORT_BUCKETS-1)] == n)
+			continue;
+
+		unsigned int sum = 0;
+		for (unsigned int b=0; b < RADIX_SORT_BUCKETS; b++) {
+			unsigned int t = c[b];
+			c[b] = sum;
+			sum += t;
+		}
+		for (unsigned int i=0; i < n; i++)
+			dst[c[(src[i].key >> shift) & (RADIX_SORT_BUCKETS-1)]++] = src[i];
+		std::swap(src, dst);
+	}
+
+	for (unsigned int i=0; i < n; i++)
+		arr[i] = src[i].id;
+}
+
+
+} // UpperBoundDS
+
+#endif //RADIX_SORT_HPP_
@@ -0,0 +1,179 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef RANK_SPACE_HPP_
+#define RANK_SPACE_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "upper_bound_ds.hpp"
+
+
+// The ranks of dims with fewer distinct coordinates fit in the narrow key type (see RankKey).
+#define RANK_NARROW_COUNT (1u << 16)
+
+
+namespace UpperBoundDS {
+
+
+/*
+ * The coordinate type of the data structures for points of type T: the ranks of the
+ * coordinates (32-bit) for the floating point and the wide types, and T itself otherwise.
+ * NARROW is the 16-bit rank type, for points with fewer than RANK_NARROW_COUNT distinct
+ * coordinates in every dim (T itself if its coordinates are not ranked).
+ */
+template<typename T>
+struct RankKey {
+	typedef typename std::conditional<std::is_floating_point<T>::value ||
+			(sizeof(T) > sizeof(unsigned int)), unsigned int, T>::type type;
+	typedef typename std::conditional<std::is_same<type, T>::value, T, unsigned short>::type narrow;
+};
+
+
+/*
+ * Rank space of points: each coordinate is replaced by its rank among the distinct
+ * coordinates of its dim.
+ * The rank of an upper vector's coordinate is the number of distinct coordinates below it, so
+ * a point is below the upper vector in rank space iff it is below it in the original space.
+ * The data structures are built on the (smaller) rank points, and compare integers.
+ * The ranks of all the dims must fit in K (see RankKey::narrow and maxCount()).
+ */
+template<typename T, typename K, unsigned int D>
+class RankSpace {
+public:
+	typedef vec<D,T> point_vec;
+	typedef vec<D,K> key_vec;
+
+	template<typename, typename, unsigned int> friend class RankSpace;
+
+private:
+	// The distinct coordinates of dim d (ascending): p_values[d][0, counts[d]).
+	SharedArray<T> p_values[D];
+	unsigned int counts[D];
+
+public:
+	RankSpace() {
+		std::fill(counts, counts + D, 0);
+	}
+
+	// The dims are ranked in parallel (see BuildThreads).
+	template<typename S>
+	explicit RankSpace(const SharedPoints<T,S,D>& pts) {
+		unsigned int size = pts.size();
+		BuildThreads::run(D, [this, &pts, size] (unsigned int d) {
+			const T* col = pts.column(d);
+			std::vector<T> values(col, col + size);
+			std::sort(values.begin(), values.end());
+			counts[d] = (unsigned int)(std::unique(values.begin(), values.end()) - values.begin());
+			p_values[d].reset(new T[counts[d]]);
+			std::copy(values.begin(), values.begin() + counts[d], p_values[d].get());
+		});
+	}
+
+	// Shares the coordinates of O, for ranks of type K.
+	template<typename K2>
+	explicit RankSpace(const RankSpace<T,K2,D>& o) {
+		for (unsigned int d=0; d < D; d++) {
+			p_values[d] = o.p_values[d];
+			counts[d] = o.counts[d];
+		}
+	}
+
+	// The maximal number of distinct coordinates of a dim.
+	unsigned int maxCount() const {
+		return *std::max_element(counts, counts + D);
+	}
+
+	// The number of distinct coordinates of dim D that are below V.
+	inline K rank(unsigned int d, T v) const {
+		const T* lo = p_values[d].get();
+		return (K)(std::lower_bound(lo, lo + counts[d], v) - lo);
+	}
+
+	// The points of PTS in rank space (with the same values), ranked column by column in parallel.
+	template<typename S>
+	SharedPoints<K,S,D> transform(const SharedPoints<T,S,D>& pts) const {
+		unsigned int size = pts.size();
+		SharedPoints<K,S,D> ret(size);
+		auto ids = pts.get();
+		BuildThreads::runRanges(size, [&] (unsigned int lo, unsigned int hi) {
+			for (unsigned int i=lo; i < hi; i++)
+				ret.pointOf(i)->val = pts.pointOf(ids[i])->val;
+			for (unsigned int d=0; d < D; d++) {
+				const T* col = pts.column(d);
+				K* rankCol = ret.column(d);
+				for (unsigned int i=lo; i < hi; i++)
+					rankCol[i] = rank(d, col[ids[i]]);
+			}
+		});
+		ret.setSize(size);
+		return ret;
+	}
+
+	// One binary search per dim.
+	inline void transformUpper(const point_vec& upper, key_vec& ret) const {
+		for (unsigned int d=0; d < D; d++)
+			ret[d] = rank(d, upper[d]);
+	}
+
+	unsigned long memoryFootprint() const {
+		unsigned long ret = 0;
+		for (unsigned int d=0; d < D; d++)
+			ret += (unsigned long)counts[d] * sizeof(T);
+		return ret;
+	}
+};
+
+
+// The identity rank space (the points are used as is).
+template<typename T, unsigned int D>
+class RankSpace<T,T,D> {
+public:
+	typedef vec<D,T> point_vec;
+	typedef vec<D,T> key_vec;
+
+	RankSpace() {}
+
+	template<typename S>
+	explicit RankSpace(const SharedPoints<T,S,D>&) {}
+
+	// The coordinates are not ranked.
+	unsigned int maxCount() const {
+		return 0;
+	}
+
+	template<typename S>
+	const SharedPoints<T,S,D>& transform(const SharedPoints<T,S,D>& pts) const {
+		return pts;
+	}
+
+	inline void transformUpper(const point_vec& upper, key_vec& ret) const {
+		ret = upper;
+	}
+
+	unsigned long memoryFootprint() const {
+		return 0;
+	}
+};
+
+
+} // UpperBoundDS
+
+#endif //RANK_SPACE_HPP_
@@ -21,15 +21,115 @@
 
 #include <cmath>
 #include <memory>
+#include <vector>
+#include <climits>
 #include <algorithm>
 
 #include <vec.hpp>
+#include <thread_pool.hpp>
+
+#include "radix_sort.hpp"
+
+
+// Maximal number of queries that are interleaved by a batched query (queryBatch()).
+#define QUERY_BATCH_SIZE (8)
+
+// The count of a budgeted query (queryBatchBudget()) with more candidates than its budget.
+#define QUERY_OVER_BUDGET (UINT_MAX)
+// A budget that is never exceeded.
+#define QUERY_NO_BUDGET (UINT_MAX - 1)
+
+#define PREFETCH(addr) __builtin_prefetch((const void*)(addr))
+
+// Build tasks per build thread (see BuildThreads). More tasks balance better the uneven parts.
+#define BUILD_TASKS_PER_THREAD (4)
+// The minimal number of ids that are merged by a build task (see mergeParallel()).
+#define BUILD_TASK_MIN_SIZE (4096)
 
 
 namespace UpperBoundDS {
 
 
-// D dim point of type T with value of type S
+// Indexable array with shared ownership.
+// The data structures keep their read-only arrays in it, so a copy of a data structure
+// shares its built arrays and only owns its query state.
+template<typename T>
+class SharedArray {
+private:
+	std::shared_ptr<T> p_arr;
+
+public:
+	void reset(T* arr) {
+		p_arr.reset(arr, std::default_delete<T[]>());
+	}
+
+	inline T* get() const {
+		return p_arr.get();
+	}
+
+	inline T& operator[](unsigned long i) const {
+		return p_arr.get()[i];
+	}
+};
+
+
+/*
+ * The number of threads that build the data structures, for the calling thread (1 by default,
+ * 0 for all the cores). The builders run their independent parts (dims, split pairs, subtrees)
+ * as tasks of runs of this size on the process wide WorkStealingPool (see
+ * WorkStealingPool::shared()), which is also the pool of the parallel joins. A task is built by a
+ * single thread, so a part does not split further into tasks of its own.
+ */
+class BuildThreads {
+public:
+	static unsigned int& count() {
+		static thread_local unsigned int c = 1;
+		return c;
+	}
+
+	static unsigned int size() {
+		return WorkStealingPool::shared(count()).size();
+	}
+
+	// Sets the count of the calling thread until the end of the scope.
+	class Scope {
+	private:
+		unsigned int prev;
+
+	public:
+		explicit Scope(unsigned int threadCount) : prev(count()) {
+			count() = threadCount;
+		}
+
+		~Scope() {
+			count() = prev;
+		}
+	};
+
+	// Runs F(task) for each task in [0, TASK_COUNT) on the build threads.
+	template<typename F>
+	static void run(unsigned int taskCount, F f) {
+		WorkStealingPool::shared(count()).run(taskCount, [&f] (unsigned int task, unsigned int) {
+			Scope serial(1);
+			f(task);
+		});
+	}
+
+	// Runs F(lo, hi) for the ranges of a split of [0, COUNT) into tasks.
+	template<typename F>
+	static void runRanges(unsigned int count, F f) {
+		unsigned int taskCount = std::min(count, size() * BUILD_TASKS_PER_THREAD);
+		run(taskCount, [count, taskCount, &f] (unsigned int task) {
+			unsigned int lo = (unsigned int)(((unsigned long)count * task) / taskCount);
+			unsigned int hi = (unsigned int)(((unsigned long)count * (task+1)) / taskCount);
+			f(lo, hi);
+		});
+	}
+};
+
+
+// D dim point of type T with value of type S. Its coordinates are in the columns of its
+// SharedPoints, so only the value is kept in the point.
 template<typename T, typename S, unsigned int D>
 class Point {
 public:
@@ -37,74 +137,132 @@ public:
 	static const unsigned int dim = D;
 
 public:
-    pointVec vector;
     S val;
 
     inline const S& value() const { return val; }
-    inline T operator[](int index) const { return vector[index]; }
-    inline bool less(const pointVec& upper) const {
-        return vector.less(upper);
-    }
 };
 
 
+/*
+ * The points of a data structure, by their 32-bit ids (their positions in the points array).
+ * The points only keep their values, and their coordinates are kept in a column per dim, so the
+ * data structures keep arrays of ids (instead of pointers), and compare the coordinates in the
+ * columns (instead of dereferencing the points).
+ * The points are created by id (see setPoint()), and then the first of them are used (see
+ * setSize()).
+ * A subset of the points (see CategoryTree) shares the points and the columns, with its own ids.
+ */
 template<typename T, typename S, unsigned int D>
 class SharedPoints {
 public:
 	typedef Point<T,S,D> point;
 	typedef typename point::pointVec point_vec;
 	typedef point* p_point;
+	typedef unsigned int point_id;
 	typedef std::shared_ptr<point> point_shared_arr;
-	typedef std::shared_ptr<p_point[]> p_point_shared_arr;
-	typedef p_point* p_point_arr;
+	typedef point_id* point_id_arr;
 
 private:
 	point_shared_arr p_pts;
+	// The coordinate d of the point id is in p_columns[d*stride + id]
+	SharedArray<T> p_columns;
+	unsigned int stride = 0;
 	unsigned int _size = 0;
 
-	p_point_shared_arr p_points_shared_arr;
-	p_point_arr ptr_arr;
+	SharedArray<point_id> p_ids_shared_arr;
+	point_id_arr ids_arr;
 
 public:
-	SharedPoints() : ptr_arr(NULL) {}
+	SharedPoints() : ids_arr(NULL) {}
 
 	SharedPoints(const SharedPoints& pts) :
-			p_pts(pts.p_pts), _size(pts._size), p_points_shared_arr(pts.p_points_shared_arr),
-			ptr_arr(pts.ptr_arr) {
+			p_pts(pts.p_pts), p_columns(pts.p_columns), stride(pts.stride), _size(pts._size),
+			p_ids_shared_arr(pts.p_ids_shared_arr), ids_arr(pts.ids_arr) {
 	}
 
-	SharedPoints(const point_shared_arr& pts, unsigned int size) : p_pts(pts), _size(size) {
-		initPointArray();
+	// Of up to CAPACITY points, that are set by setPoint().
+	explicit SharedPoints(unsigned int capacity) :
+			p_pts(new point[capacity], std::default_delete<point[]>()), stride(capacity),
+			_size(0), ids_arr(NULL) {
+		p_columns.reset(new T[(unsigned long)D * capacity]);
 	}
 
-	SharedPoints(const SharedPoints& pts, p_point_shared_arr p_points_shared_arr,
-			p_point_arr ptr_arr, unsigned int size) : p_pts(pts.p_pts), _size(size),
-					p_points_shared_arr(p_points_shared_arr), ptr_arr(ptr_arr) {
+	SharedPoints(const SharedPoints& pts, const SharedArray<point_id>& p_ids_shared_arr,
+			point_id_arr ids_arr, unsigned int size) : p_pts(pts.p_pts), p_columns(pts.p_columns),
+					stride(pts.stride), _size(size), p_ids_shared_arr(p_ids_shared_arr),
+					ids_arr(ids_arr) {
 	}
 
-	void init(const point_shared_arr& pts, unsigned int size) {
-		this->p_pts = pts;
-		this->_size = size;
-		initPointArray();
-	}
-
-	p_point_arr get() {
-		return ptr_arr;
+	point_id_arr get() const {
+		return ids_arr;
 	}
 
 	unsigned int size() const {
 		return this->_size;
 	}
 
+	inline p_point pointOf(point_id id) const {
+		return p_pts.get() + id;
+	}
+
+	inline const T* column(unsigned int d) const {
+		return p_columns.get() + (unsigned long)d * stride;
+	}
+
+	inline T* column(unsigned int d) {
+		return p_columns.get() + (unsigned long)d * stride;
+	}
+
+	// Sets the point ID to the coordinates V and the value VAL.
+	inline void setPoint(point_id id, const point_vec& v, const S& val) {
+		for (unsigned int d=0; d < D; d++)
+			column(d)[id] = v[d];
+		p_pts.get()[id].val = val;
+	}
+
+	// Is the point ID below UPPER (in all the dims)?
+	inline bool less(point_id id, const point_vec& upper) const {
+		for (unsigned int d=0; d < D; d++) {
+			if (!(column(d)[id] < upper[d]))
+				return false;
+		}
+		return true;
+	}
+
+	/*
+	 * Uses the first SIZE points (of the ones that were set). The points and the columns are
+	 * compacted to SIZE if there are fewer points than the capacity.
+	 */
+	void setSize(unsigned int size) {
+		if (size < stride) {
+			point_shared_arr pts(new point[size], std::default_delete<point[]>());
+			std::copy(p_pts.get(), p_pts.get() + size, pts.get());
+			SharedArray<T> columns;
+			columns.reset(new T[(unsigned long)D * size]);
+			for (unsigned int d=0; d < D; d++)
+				std::copy(column(d), column(d) + size, columns.get() + (unsigned long)d * size);
+			p_pts = pts;
+			p_columns = columns;
+			stride = size;
+		}
+		_size = size;
+		initIdArray();
+	}
+
+	// The bytes of the points, their columns and their ids.
+	unsigned long memoryFootprint() const {
+		return (unsigned long)stride * (sizeof(point) + D * sizeof(T)) +
+				(unsigned long)_size * sizeof(point_id);
+	}
+
 private:
-	void initPointArray() {
+	void initIdArray() {
 		if (!this->p_pts)
 			return;
-		auto pts = this->p_pts.get();
-		p_points_shared_arr.reset(new p_point[this->_size], std::default_delete<p_point[]>());
-		ptr_arr = p_points_shared_arr.get();
+		p_ids_shared_arr.reset(new point_id[this->_size]);
+		ids_arr = p_ids_shared_arr.get();
 		for (unsigned int i=0; i < this->_size; i++)
-			ptr_arr[i] = pts + i;
+			ids_arr[i] = i;
 	}
 };
 
@@ -116,6 +274,7 @@ public:
     using point = typename shared_points::point;
     using point_vec = typename point::pointVec;
     typedef point* p_point;
+    typedef typename shared_points::point_id point_id;
 
 protected:
     shared_points p_pts;
@@ -123,6 +282,9 @@ protected:
     unsigned int maxDepth = 0;
     unsigned int chunkSize = 0;
 
+    // The maximal coordinates of the points (the upper corner of their bounding box).
+    point_vec boxMax;
+
 public:
 	BaseUpperBoundDataStruct(const shared_points& pts, unsigned int chunkSize) {
 		baseInit(pts, chunkSize);
@@ -135,17 +297,143 @@ public:
     	this->p_pts = pts;
     	this->size = pts.size();
     	this->chunkSize = chunkSize;
+		this->maxDepth = treeDepth(this->size, chunkSize);
+		boundingBox(this->p_pts.get(), 0, this->size, this->boxMax);
+    }
+
+    // The depth of a tree of SIZE points, with leaves of CHUNK_SIZE points.
+    static unsigned int treeDepth(unsigned int size, unsigned int chunkSize) {
     	unsigned int log_n = (unsigned int) std::log2(size);
     	unsigned int log_chunk = (unsigned int) std::log2(chunkSize);
-		this->maxDepth = log_n > log_chunk ? log_n - log_chunk : 0;
+		return log_n > log_chunk ? log_n - log_chunk : 0;
+    }
+
+    // The bytes of the arrays that are built by the data structure (without its points).
+    unsigned long memoryFootprint() const {
+    	return 0;
+    }
+
+    // The memoryFootprint() of a data structure of SIZE points, before it is built.
+    static unsigned long estimateFootprint(unsigned int size __attribute__((unused)),
+    		unsigned int chunkSize __attribute__((unused))) {
+    	return 0;
+    }
+
+    unsigned long pointsFootprint() const {
+    	return p_pts.memoryFootprint();
+    }
+
+    // The coordinate D of the point ID.
+    inline T key(point_id id, unsigned int d) const {
+    	return p_pts.column(d)[id];
+    }
+
+    inline p_point pointOf(point_id id) const {
+    	return p_pts.pointOf(id);
+    }
+
+    // Is the point ID below UPPER (in all the dims)?
+    inline bool pointLess(point_id id, const point_vec& upper) const {
+    	return p_pts.less(id, upper);
+    }
+
+    // The upper corner of the bounding box of ARR[LO, HI) (unchanged if the range is empty).
+    inline void boundingBox(const point_id* arr, unsigned int lo, unsigned int hi,
+    		point_vec& box) const {
+    	if (lo >= hi)
+    		return;
+    	for (unsigned int d=0; d < D; d++) {
+    		const T* col = p_pts.column(d);
+    		T m = col[arr[lo]];
+    		for (unsigned int i=lo+1; i < hi; i++) {
+    			if (m < col[arr[i]])
+    				m = col[arr[i]];
+    		}
+    		box[d] = m;
+    	}
+    }
+
+    static inline void expandBox(point_vec& box, const point_vec& v) {
+    	for (unsigned int d=0; d < D; d++) {
+    		if (box[d] < v[d])
+    			box[d] = v[d];
+    	}
+    }
+
+    /*
+     * Is a box with the upper corner BOX below UPPER? The dims in the BELOW_DIMS mask (bit d
+     * for dim d) are already known to be below, and are not checked.
+     */
+    static inline bool boxBelow(const point_vec& box, const point_vec& upper,
+    		unsigned int belowDims=0) {
+    	for (unsigned int d=0; d < D; d++) {
+    		if (!(belowDims & (1u << d)) && !(box[d] < upper[d]))
+    			return false;
+    	}
+    	return true;
     }
 
 public:
-    template <bool FILTER>
-    inline unsigned int appendResultPoint(p_point* ret, unsigned int retCount,
-    		p_point pt, const point_vec& upper  __attribute__((unused))) {
-    	if (!FILTER || pt->less(upper))
-			ret[retCount++] = pt;
+    /*
+     * Batched query: LANES[i]->query(UPPERS[i]) for each i in [0, COUNT), COUNT <= QUERY_BATCH_SIZE.
+     * Each lane is a copy of the data structure that keeps the state of its query for fetchQuery().
+     * Data structures whose queries are chains of dependent memory accesses override it to
+     * interleave the traversals of the queries.
+     */
+    template<class DS>
+    static void queryBatch(DS* const* lanes, const point_vec* uppers, unsigned int count,
+    		unsigned int* counts) {
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = lanes[i]->query(uppers[i]);
+    }
+
+    /*
+     * Budgeted batched query: as queryBatch(), but the count of a query with more candidates
+     * than BUDGETS[i] is QUERY_OVER_BUDGET. An over budget query cannot be fetched.
+     * Data structures that can bound their count during the traversal override it, and stop
+     * the traversal as soon as the budget is exceeded.
+     */
+    template<class DS>
+    static void queryBatchBudget(DS* const* lanes, const point_vec* uppers, const unsigned int* budgets,
+    		unsigned int count, unsigned int* counts) {
+    	DS::queryBatch(lanes, uppers, count, counts);
+    	for (unsigned int i=0; i < count; i++) {
+    		if (counts[i] > budgets[i])
+    			counts[i] = QUERY_OVER_BUDGET;
+    	}
+    }
+
+    /*
+     * Calls F(pt) for each point of ARR[LO, HI) that is below UPPER. A CERTIFIED range is known
+     * to be below UPPER, so its points are visited without checking them.
+     */
+    template <bool FILTER, class F>
+    inline void visitResultRange(const point_id* arr, unsigned int lo, unsigned int hi,
+    		const point_vec& upper, bool certified, F& f) const {
+    	if (!FILTER || certified) {
+    		for (unsigned int i = lo; i < hi; i++)
+    			f(pointOf(arr[i]));
+    		return;
+    	}
+    	for (unsigned int i = lo; i < hi; i++) {
+    		if (pointLess(arr[i], upper))
+    			f(pointOf(arr[i]));
+    	}
+    }
+
+    /*
+     * The fetchQuery() of a DS by its forEachCandidate(): writes the candidates of the last
+     * query to RET, and returns their count.
+     * forEachCandidate<FILTER>(upper, f) calls F(pt) for each candidate, without an intermediate
+     * array, so the caller can consume them as they are traversed.
+     */
+    template <bool FILTER, class DS>
+    static inline unsigned int fetchCandidates(DS& ds, const point_vec& upper, p_point* ret) {
+    	unsigned int retCount = 0;
+    	auto append = [ret, &retCount] (p_point pt) {
+    		ret[retCount++] = pt;
+    	};
+    	ds.template forEachCandidate<FILTER>(upper, append);
     	return retCount;
     }
 };
@@ -158,6 +446,8 @@ public:
         unsigned int hi;
         unsigned int depth;
         unsigned int sortDim;
+        // All the points of the range are known to be below the query's upper limit.
+        bool certified;
     } Range;
 
 public:
@@ -169,6 +459,16 @@ public:
     static const unsigned int None = UINT16_MAX;
 
 public:
+    UpperBoundRangeDSResults() : sz(0), back_it(0), fwd_it(0) {}
+
+    // A copy has its own (empty) results buffer, so copies can be queried concurrently.
+    UpperBoundRangeDSResults(const UpperBoundRangeDSResults& other) : sz(0), back_it(0), fwd_it(0) {
+    	if (other.ranges)
+    		init(other.sz);
+    }
+
+    UpperBoundRangeDSResults(UpperBoundRangeDSResults&& other) = default;
+
     void init(unsigned int sz) {
     	this->sz = sz;
         ranges.reset(new Range[sz]);
@@ -176,7 +476,7 @@ public:
     }
 
     void pushRange(unsigned int lo, unsigned int hi, unsigned int depth,
-    		unsigned int sortDim=None) {
+    		unsigned int sortDim=None, bool certified=false) {
         Range& r = ranges[fwd_it];
         fwd_it = (fwd_it+1) % sz;
 
@@ -184,6 +484,7 @@ public:
         r.hi = hi;
         r.depth = depth;
         r.sortDim = sortDim;
+        r.certified = certified;
     }
 
     const Range& popRange() {
@@ -233,10 +534,25 @@ public:
     using point_vec = typename BaseUpperBoundDataStruct<T,S,D>::point_vec;
     using p_point = typename BaseUpperBoundDataStruct<T,S,D>::p_point;
     using shared_points = typename BaseUpperBoundDataStruct<T,S,D>::shared_points;
-    using p_point_shared_arr = typename BaseUpperBoundDataStruct<T,S,D>::shared_points::p_point_shared_arr;
+    using point_id = typename BaseUpperBoundDataStruct<T,S,D>::point_id;
+
+    using Range = UpperBoundRangeDSResults::Range;
+
+    // A single binary search in an interleaved batch (see binarySearchUpperBatch()).
+    typedef struct {
+    	const point_id* arr;
+    	const T* column;
+    	unsigned int lo;
+    	unsigned int len;
+    	unsigned int cmpDim;
+    	T pivot;
+    	point_id cur;
+    } BatchSearch;
 
 protected:
-    p_point_shared_arr p_helper_arr;
+    // Arrays of point ids (each of SIZE ids)
+    SharedArray<point_id> p_helper_arr;
+    unsigned int helperCount = 0;
     UpperBoundRangeDSResults res;
 
 public:
@@ -245,16 +561,21 @@ public:
 	}
     BaseUpperBoundRangeDS() : BaseUpperBoundDataStruct<T, S, D>() {}
 
+    unsigned long memoryFootprint() const {
+    	return (unsigned long)this->size * helperCount * sizeof(point_id);
+    }
+
 protected:
     inline void allocHelperArrays(unsigned int count) {
-    	p_helper_arr.reset(new p_point[this->size * count], std::default_delete<p_point[]>());
+    	helperCount = count;
+    	p_helper_arr.reset(new point_id[(unsigned long)this->size * count]);
     }
 
-    inline p_point* helperArray(unsigned int d) {
-        return p_helper_arr.get() + (this->size * d);
+    inline point_id* helperArray(unsigned int d) {
+        return p_helper_arr.get() + ((unsigned long)this->size * d);
     }
 
-    inline void fillPointsArray(p_point* arr) {
+    inline void fillPointsArray(point_id* arr) {
     	auto src_arr = this->p_pts.get();
         for (unsigned int i=0; i<this->size; i++)
             arr[i] = src_arr[i];
@@ -272,9 +593,15 @@ protected:
 			dstArr[i] = srcArr[i];
 	}
 
-    inline void sortPointsByDim(p_point* s, p_point* e, unsigned int cmpDim) {
-        std::sort(s, e, [cmpDim](const p_point a, const p_point b) {
-            return a->vector[cmpDim] < b->vector[cmpDim];
+    // Long arrays are sorted by a radix sort (see radixSortIds()).
+    inline void sortPointsByDim(point_id* s, point_id* e, unsigned int cmpDim) {
+    	const T* col = this->p_pts.column(cmpDim);
+    	if (e - s >= RADIX_SORT_MIN_SIZE) {
+    		radixSortIds(s, (unsigned int)(e - s), col);
+    		return;
+    	}
+        std::sort(s, e, [col](const point_id a, const point_id b) {
+            return col[a] < col[b];
         });
     }
 
@@ -287,28 +614,39 @@ protected:
 	// Partition an array such that the everything left of the
 	// the item in the K position is smaller than it, and to the right is larger.
 	// Returns: the point in the K position.
-    inline p_point partitionHelperByDim(unsigned int helperArr, unsigned int cmpDim,
+    inline point_id partitionHelperByDim(unsigned int helperArr, unsigned int cmpDim,
     		unsigned int k, unsigned int lo, unsigned int hi) {
     	auto arr = helperArray(helperArr);
     	return partitionPointsByDim(arr, cmpDim, k, lo, hi);
     }
 
-    inline p_point partitionPointsByDim(p_point* arr, unsigned int cmpDim,
+    inline point_id partitionPointsByDim(point_id* arr, unsigned int cmpDim,
 			unsigned int k, unsigned int lo, unsigned int hi) {
-		std::nth_element(arr+lo, arr+k, arr+hi, [cmpDim](const p_point a, const p_point b) {
-			return a->vector[cmpDim] < b->vector[cmpDim];
+    	const T* col = this->p_pts.column(cmpDim);
+		std::nth_element(arr+lo, arr+k, arr+hi, [col](const point_id a, const point_id b) {
+			return col[a] < col[b];
 		});
 		return arr[k];
 	}
 
+    // A merge of [LEFT, MID) and [MID, TOP) into DST by CMP_DIM (see mergePointsByDim()).
+    typedef struct {
+    	point_id* left;
+    	point_id* mid;
+    	point_id* top;
+    	point_id* dst;
+    	unsigned int cmpDim;
+    } MergeJob;
+
     // Merge sort iteration
-    inline void mergePointsByDim(p_point* arrLeft, p_point* arrLeftTop,
-    		p_point* arrRight, p_point* arrRightTop, p_point* dst, unsigned int d) {
+    inline void mergePointsByDim(point_id* arrLeft, point_id* arrLeftTop,
+    		point_id* arrRight, point_id* arrRightTop, point_id* dst, unsigned int d) {
 //        std::merge(sa, ea, sb, eb, st, [cmpDim](const p_point a, const p_point b) {
 //            return a->vector[cmpDim] < b->vector[cmpDim];
 //        });
+    	const T* col = this->p_pts.column(d);
         while(arrLeft < arrLeftTop && arrRight < arrRightTop) {
-				if ((*arrLeft)->vector[d] < (*arrRight)->vector[d]) {
+				if (col[*arrLeft] < col[*arrRight]) {
 				*dst = *arrLeft;
 				arrLeft++;
 			} else {
@@ -340,20 +678,211 @@ protected:
 		mergePointsByDim(arr1+lo1, arr1+hi1, arr2+lo2, arr2+hi2, dstArr+dstLo, cmpDim);
 	}
 
+    /*
+     * The split of the merge J at the output position O (its merge path): the number of ids of
+     * the left array among the first O merged ids. As in mergePointsByDim(), a left id is
+     * merged before a right id only if it is smaller.
+     */
+    inline unsigned int mergePathSplit(const MergeJob& j, unsigned int o) {
+    	const T* col = this->p_pts.column(j.cmpDim);
+    	unsigned int leftSize = (unsigned int)(j.mid - j.left);
+    	unsigned int rightSize = (unsigned int)(j.top - j.mid);
+    	unsigned int lo = o > rightSize ? o - rightSize : 0;
+    	unsigned int hi = std::min(o, leftSize);
+    	while (lo < hi) {
+    		unsigned int m = (lo + hi) / 2;
+    		if (col[j.left[m]] < col[j.mid[o - m - 1]])
+    			lo = m + 1;
+    		else
+    			hi = m;
+    	}
+    	return lo;
+    }
+
+    // Merges the output positions [LO, HI) of the merge J.
+    inline void mergePart(const MergeJob& j, unsigned int lo, unsigned int hi) {
+    	unsigned int leftLo = mergePathSplit(j, lo);
+    	unsigned int leftHi = mergePathSplit(j, hi);
+    	mergePointsByDim(j.left + leftLo, j.left + leftHi, j.mid + (lo - leftLo),
+    			j.mid + (hi - leftHi), j.dst + lo, j.cmpDim);
+    }
+
+    /*
+     * Runs the merges of a level on the build threads (see BuildThreads).
+     * The short merges (the bottom levels) are grouped into tasks, and the long ones (the top
+     * levels) are split into parts along their merge paths. The result is the same as merging
+     * them one after another.
+     */
+    void mergeParallel(const std::vector<MergeJob>& jobs) {
+    	unsigned int threads = BuildThreads::size();
+    	if (threads <= 1) {
+    		for (auto& j : jobs)
+    			mergePointsByDim(j.left, j.mid, j.mid, j.top, j.dst, j.cmpDim);
+    		return;
+    	}
+
+    	unsigned long total = 0;
+    	for (auto& j : jobs)
+    		total += j.top - j.left;
+    	unsigned long taskSize = std::max<unsigned long>(BUILD_TASK_MIN_SIZE,
+    			total / (threads * BUILD_TASKS_PER_THREAD));
+
+    	// The parts of the jobs, by their output positions. Task t merges the parts
+    	// [taskParts[t], taskParts[t+1]).
+    	typedef struct {
+    		unsigned int job;
+    		unsigned int lo;
+    		unsigned int hi;
+    	} MergePart;
+    	std::vector<MergePart> parts;
+    	std::vector<unsigned int> taskParts;
+    	unsigned long curTaskSize = 0;
+    	for (unsigned int k=0; k < jobs.size(); k++) {
+    		unsigned long len = jobs[k].top - jobs[k].left;
+    		for (unsigned long lo=0; lo < len; lo += taskSize) {
+    			unsigned long hi = std::min(lo + taskSize, len);
+    			if (curTaskSize == 0)
+    				taskParts.push_back(parts.size());
+    			parts.push_back(MergePart{k, (unsigned int)lo, (unsigned int)hi});
+    			curTaskSize += hi - lo;
+    			if (curTaskSize >= taskSize)
+    				curTaskSize = 0;
+    		}
+    	}
+    	taskParts.push_back(parts.size());
+
+    	BuildThreads::run(taskParts.size() - 1, [&] (unsigned int t) {
+    		for (unsigned int i=taskParts[t]; i < taskParts[t+1]; i++)
+    			mergePart(jobs[parts[i].job], parts[i].lo, parts[i].hi);
+    	});
+    }
+
+    // Sorts each leaf [SPLITS[i], SPLITS[i+1]) of ARR by CMP_DIM, on the build threads.
+    void sortLeavesParallel(point_id* arr, const unsigned int* splits, unsigned int splitCount,
+    		unsigned int cmpDim) {
+    	BuildThreads::runRanges(splitCount, [&] (unsigned int lo, unsigned int hi) {
+    		for (unsigned int i=lo; i < hi; i++)
+    			sortPointsByDim(arr+splits[i], arr+splits[i+1], cmpDim);
+    	});
+    }
+
     inline unsigned int calcMid(unsigned int l, unsigned int h) {
         return ((h-l-1) / 2) + l;
     }
 
-    inline unsigned int binarySearchUpper(const p_point* arr,
+    inline unsigned int binarySearchUpper(const point_id* arr,
                 unsigned int lo, unsigned int hi,
                 const vec<D,T>& upper, unsigned int cmpDim) {
     	T pivot = upper[cmpDim];
-    	auto lower = std::lower_bound(arr+lo, arr+hi, pivot, [cmpDim](const p_point a, const T p) {
-            return a->vector[cmpDim] < p;
+    	const T* col = this->p_pts.column(cmpDim);
+    	auto lower = std::lower_bound(arr+lo, arr+hi, pivot, [col](const point_id a, const T p) {
+            return col[a] < p;
         });
     	return lower - arr;
     }
 
+    /*
+     * Interleaves COUNT binary searches, each with the same result as binarySearchUpper() on
+     * [LO, LO+LEN). The result of each search is in its LO.
+     * A step of a search is a chain of two cache misses: the id in the array and its coordinate
+     * in the column. So each step is split to two rounds, and the prefetches of all the searches
+     * in a round are in flight together.
+     */
+    static inline void binarySearchUpperBatch(BatchSearch* s, unsigned int count) {
+    	bool active = false;
+    	for (unsigned int i=0; i < count; i++) {
+    		if (s[i].len > 0) {
+    			PREFETCH(s[i].arr + s[i].lo + s[i].len/2);
+    			active = true;
+    		}
+    	}
+
+    	while (active) {
+    		for (unsigned int i=0; i < count; i++) {
+    			auto& q = s[i];
+    			if (q.len == 0)
+    				continue;
+    			q.cur = q.arr[q.lo + q.len/2];
+    			PREFETCH(q.column + q.cur);
+    		}
+
+    		active = false;
+    		for (unsigned int i=0; i < count; i++) {
+    			auto& q = s[i];
+    			if (q.len == 0)
+    				continue;
+    			unsigned int half = q.len / 2;
+    			if (q.column[q.cur] < q.pivot) {
+    				q.lo += half + 1;
+    				q.len -= half + 1;
+    			} else
+    				q.len = half;
+
+    			if (q.len > 0) {
+    				PREFETCH(q.arr + q.lo + q.len/2);
+    				active = true;
+    			}
+    		}
+    	}
+    }
+
+    /*
+     * Resolves the upper limit (HI) of the pending ranges of each lane with interleaved binary
+     * searches, and drops the ranges that become empty.
+     * SETUP(lane, range, search, out) sets the search's array and dimension, and the depth, the
+     * sort dim and the certification of the resolved range (OUT).
+     * With BUDGETS, a lane stops resolving (OVER[i] is set) once its resolved ranges have more
+     * points than its budget.
+     */
+    template<class DS, class F>
+    static void resolveRangesBatch(DS* const* lanes, const point_vec* uppers, unsigned int count,
+    		F setup, const unsigned int* budgets=NULL, bool* over=NULL) {
+    	unsigned int pending[QUERY_BATCH_SIZE];
+    	unsigned int resolved[QUERY_BATCH_SIZE];
+    	unsigned int maxPending = 0;
+    	for (unsigned int i=0; i < count; i++) {
+    		pending[i] = lanes[i]->res.getRangeCount();
+    		maxPending = std::max(maxPending, pending[i]);
+    		resolved[i] = 0;
+    		if (budgets)
+    			over[i] = false;
+    	}
+
+    	BatchSearch s[QUERY_BATCH_SIZE] = {};
+    	Range out[QUERY_BATCH_SIZE];
+    	unsigned int lane[QUERY_BATCH_SIZE];
+    	for (unsigned int k=0; k < maxPending; k++) {
+    		unsigned int searchCount = 0;
+    		for (unsigned int i=0; i < count; i++) {
+    			if (k >= pending[i] || (budgets && over[i]))
+    				continue;
+    			// Copy, as the resolved range might be pushed to the same slot
+    			const Range r = lanes[i]->res.popRange();
+    			auto& q = s[searchCount];
+    			out[searchCount] = r;
+    			setup(i, r, q, out[searchCount]);
+    			q.column = lanes[i]->p_pts.column(q.cmpDim);
+    			q.lo = r.lo;
+    			q.len = r.hi - r.lo;
+    			q.pivot = uppers[i][q.cmpDim];
+    			lane[searchCount++] = i;
+    		}
+
+    		binarySearchUpperBatch(s, searchCount);
+
+    		for (unsigned int j=0; j < searchCount; j++) {
+    			if (s[j].lo > out[j].lo)
+    				lanes[lane[j]]->res.pushRange(out[j].lo, s[j].lo, out[j].depth, out[j].sortDim,
+    						out[j].certified);
+    			if (budgets) {
+    				auto i = lane[j];
+    				resolved[i] += s[j].lo - out[j].lo;
+    				over[i] = resolved[i] > budgets[i];
+    			}
+    		}
+    	}
+    }
+
     inline unsigned int binarySearchUpperHelperByDim(unsigned int helperArr,
                     unsigned int lo, unsigned int hi,
                     const vec<D,T>& upper, unsigned int cmpDim) {
@@ -383,14 +912,62 @@ protected:
 		}
 	}
 
-    template <bool FILTER>
-	inline unsigned int appendMultipleResultPoint(unsigned int helperArrayIdx,
-			unsigned int lo, unsigned int hi,
-			p_point* ret, unsigned int retCount, const point_vec& upper) {
+    // The nodes of a tree of MAX_DEPTH, in heap order (see nodeIndex()).
+    static unsigned long nodeCount(unsigned int maxDepth) {
+    	return (2ul << maxDepth) - 1;
+    }
+
+    // The heap index of the node at DEPTH that starts at LO: the children of the node K are
+    // 2K+1 and 2K+2, as split by calcMid().
+    inline unsigned int nodeIndex(unsigned int lo, unsigned int depth) {
+    	unsigned int k = 0;
+    	unsigned int l = 0;
+    	unsigned int h = this->size;
+    	for (unsigned int i=0; i < depth; i++) {
+    		unsigned int mid = this->calcMid(l, h) + 1;
+    		if (lo < mid) {
+    			h = mid;
+    			k = 2*k + 1;
+    		} else {
+    			l = mid;
+    			k = 2*k + 2;
+    		}
+    	}
+    	return k;
+    }
+
+    /*
+     * The upper corner of the bounding box of each node (in heap order) into BOXES, of the ids of
+     * ARR. ARR is sorted by the main dim up to its leaves (the order within a leaf is not
+     * relevant).
+     */
+    void buildNodeBoxes(const point_id* arr, point_vec* boxes) {
+    	buildNodeBoxes(arr, boxes, 0, 0, this->size, 0);
+    }
+
+    // The node [LO, HI) of ARR at DEPTH is the K-th.
+    void buildNodeBoxes(const point_id* arr, point_vec* boxes, unsigned int k, unsigned int lo,
+    		unsigned int hi, unsigned int depth) {
+    	if (lo >= hi)
+    		return;
+    	if (depth == this->maxDepth) {
+    		this->boundingBox(arr, lo, hi, boxes[k]);
+    		return;
+    	}
+
+    	unsigned int mid = this->calcMid(lo, hi) + 1;
+    	buildNodeBoxes(arr, boxes, 2*k + 1, lo, mid, depth + 1);
+    	buildNodeBoxes(arr, boxes, 2*k + 2, mid, hi, depth + 1);
+    	boxes[k] = boxes[2*k + 1];
+    	if (mid < hi)
+    		this->expandBox(boxes[k], boxes[2*k + 2]);
+    }
+
+    template <bool FILTER, class F>
+	inline void visitHelperRange(unsigned int helperArrayIdx, unsigned int lo, unsigned int hi,
+			const point_vec& upper, bool certified, F& f) {
     	auto arr = this->helperArray(helperArrayIdx);
-		for (unsigned int i = lo; i < hi; i++)
-			retCount = this->template appendResultPoint<FILTER>(ret, retCount, arr[i], upper);
-		return retCount;
+		this->template visitResultRange<FILTER>(arr, lo, hi, upper, certified, f);
 	}
 };
 
@@ -413,15 +990,24 @@ public:
 		return 0;
 	}
 
-    template <bool FILTER>
-	unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
-		unsigned retCount = 0;
+    // The fetch scans all the points, so they are all counted against the budget.
+    static void queryBatchBudget(SimpleUpperBoundDataStruct* const* lanes,
+    		const point_vec* uppers __attribute__((unused)), const unsigned int* budgets,
+    		unsigned int count, unsigned int* counts) {
+    	for (unsigned int i=0; i < count; i++)
+    		counts[i] = lanes[i]->size > budgets[i] ? QUERY_OVER_BUDGET : lanes[i]->size;
+    }
 
+    template <bool FILTER, class F>
+	void forEachCandidate(const point_vec& upper, F& f) {
 		auto arr = this->p_pts.get();
-		for (unsigned int i=0; i<this->size; i++)
-			retCount = this->template appendResultPoint<FILTER>(ret, retCount, arr[i], upper);
+		this->template visitResultRange<FILTER>(arr, 0, this->size, upper,
+				this->boxBelow(this->boxMax, upper), f);
+	}
 
-		return retCount;
+    template <bool FILTER>
+	unsigned int fetchQuery(const point_vec& upper, p_point* ret) {
+		return this->template fetchCandidates<FILTER>(*this, upper, ret);
 	}
 };
 